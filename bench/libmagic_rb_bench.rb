@@ -0,0 +1,196 @@
+#!/usr/bin/env ruby
+# frozen_string_literal: true
+
+# Benchmarks of LibmagicRb, run with `rake bench`.
+#
+# Files are checked from a corpus generated in a temporary directory, so runs are
+# comparable between machines. Results are printed, and written as JSON to
+# BENCH_OUTPUT (bench_output.json by default).
+#
+# [BENCH_TIME] Seconds to measure each case. Defaults to 1.
+# [BENCH_COPIES] Copies of each file of the corpus. Defaults to 16.
+# [BENCH_OUTPUT] Path of the JSON output.
+#
+# With benchmark-ips installed, cases are measured with it, otherwise with a
+# simple harness on the monotonic clock.
+
+require 'json'
+require 'etc'
+require 'tmpdir'
+require 'zlib'
+require 'libmagic_rb'
+
+begin
+	require 'benchmark/ips'
+rescue LoadError
+end
+
+module Bench
+	TIME = Float(ENV.fetch('BENCH_TIME', 1))
+	COPIES = Integer(ENV.fetch('BENCH_COPIES', 16))
+	OUTPUT = ENV.fetch('BENCH_OUTPUT', File.expand_path('../bench_output.json', __dir__))
+
+	FILES = {
+		'text.txt' => "Hello world!\n" * 2048,
+		'script.rb' => "#!/usr/bin/env ruby\nputs 'hello'\n" * 128,
+		'doc.pdf' => "%PDF-1.4\n%\xE2\xE3\xCF\xD3\n".b + "1 0 obj\n<< >>\nendobj\n" * 64,
+		'image.png' => "\x89PNG\r\n\x1a\n\x00\x00\x00\rIHDR\x00\x00\x00\x10\x00\x00\x00\x10\x08\x06\x00\x00\x00\x1f\xf3\xffa".b + "\x00" * 64,
+		'data.json' => '{"a": [1, 2, 3], "b": {"c": "d"}}' * 256,
+		'page.html' => "<!DOCTYPE html>\n<html><body>#{'<p>hi</p>' * 512}</body></html>\n",
+		'archive.gz' => Zlib.gzip('x' * 65536),
+		'program' => File.binread(RbConfig.ruby, 65536),
+		'random.bin' => Random.new(42).bytes(65536),
+	}.freeze
+
+	@results = {}
+
+	# Measures the block, per is the number of operations a call of the block does
+	def self.measure(group, name, per: 1, &block)
+		ips = if defined?(Benchmark::IPS)
+			report = Benchmark.ips(quiet: true) { |x|
+				x.config(time: TIME, warmup: TIME / 5.0)
+				x.report(name, &block)
+			}
+
+			report.entries[0].ips
+		else
+			block.call
+			count, started = 0, now
+
+			count += 1 while (block.call ; now - started < TIME)
+			count / (now - started)
+		end * per
+
+		(@results[group] ||= {})[name] = { ips: ips.round(2), us: (1e6 / ips).round(3) }
+		puts "  %-40s %14.2f i/s %12.3f us" % [name, ips, 1e6 / ips]
+	end
+
+	# Objects allocated per call
+	def self.allocations(name, count = 1000)
+		yield
+		before = GC.stat(:total_allocated_objects)
+		count.times { yield }
+
+		per_call = (GC.stat(:total_allocated_objects) - before) / count.to_f
+		(@results['allocations'] ||= {})[name] = per_call.round(3)
+		puts "  %-40s %14.3f objects" % [name, per_call]
+	end
+
+	def self.now
+		Process.clock_gettime(Process::CLOCK_MONOTONIC)
+	end
+
+	def self.section(title)
+		puts "\n\e[1m#{title}\e[0m"
+	end
+
+	def self.corpus(dir)
+		COPIES.times.flat_map { |i|
+			FILES.map { |name, content|
+				File.join(dir, "#{i}-#{name}").tap { |path| File.binwrite(path, content) }
+			}
+		}
+	end
+
+	def self.write
+		File.write(OUTPUT, JSON.pretty_generate(
+			libmagic_rb: LibmagicRb::VERSION,
+			libmagic: LibmagicRb::MAGIC_VERSION,
+			ruby: RUBY_DESCRIPTION,
+			cpus: Etc.nprocessors,
+			harness: defined?(Benchmark::IPS) ? 'benchmark-ips' : 'monotonic clock',
+			time: TIME,
+			copies: COPIES,
+			results: @results
+		))
+
+		puts "\nWrote #{OUTPUT}"
+	end
+end
+
+Dir.mktmpdir do |dir|
+	paths = Bench.corpus(dir)
+	pdf = paths.find { |x| x.end_with?('doc.pdf') }
+	cycle = paths.cycle
+
+	Bench.section('Checking files')
+	cookie = LibmagicRb.new(file: pdf)
+	cached = LibmagicRb.new(file: pdf, cache: paths.size)
+	mapped = LibmagicRb.new(file: pdf, mmap: true)
+	fast = LibmagicRb.new(file: pdf, fast_path: true)
+
+	Bench.measure('check', 'LibmagicRb.check') { LibmagicRb.check(file: cycle.next) }
+	Bench.measure('check', 'check') { cookie.file = cycle.next ; cookie.check }
+	Bench.measure('check', 'check (cache:)') { cached.file = cycle.next ; cached.check }
+	Bench.measure('check', 'check (mmap:)') { mapped.file = cycle.next ; mapped.check }
+	Bench.measure('check', 'check (fast_path:)') { fast.file = cycle.next ; fast.check }
+	Bench.measure('check', 'check_mime') { cookie.file = cycle.next ; cookie.check_mime }
+	Bench.measure('check', 'check_all') { cookie.file = cycle.next ; cookie.check_all }
+
+	File.open(pdf) { |file| Bench.measure('check', 'check_io') { cookie.check_io(file) } }
+
+	batch = paths.first(64)
+	Bench.measure('check', 'check_many (per file)', per: batch.size) { cookie.check_many(batch) }
+
+	Bench.section('Checking buffers')
+	random = Random.new(42)
+	buffer_cached = LibmagicRb.new(file: ?., buffer_cache: 1 << 20)
+
+	[64, 4096, 65536, 1 << 20].each { |size|
+		buffer = (Bench::FILES['doc.pdf'] + random.bytes(size)).byteslice(0, size).freeze
+		Bench.measure('magic_buffer', "magic_buffer (#{size} bytes)") { cookie.magic_buffer(buffer) }
+		Bench.measure('magic_buffer', "magic_buffer (#{size} bytes, buffer_cache:)") { buffer_cached.magic_buffer(buffer) }
+		Bench.measure('magic_buffer', "magic_buffer (#{size} bytes, fast_path:)") { fast.magic_buffer(buffer) }
+	}
+
+	Bench.section('Loading the database')
+	Bench.measure('load', 'new + load + close') {
+		LibmagicRb.new(file: ?.).tap { |x| x.load(nil) }.close
+	}
+
+	Bench.measure('load', 'new + load + check + close') {
+		LibmagicRb.new(file: pdf).tap(&:check).close
+	}
+
+	begin
+		LibmagicRb.preload
+		Bench.measure('load', 'new + load + close (preloaded)') {
+			LibmagicRb.new(file: ?.).tap { |x| x.load(nil) }.close
+		}
+	rescue NotImplementedError, LibmagicRb::InvalidDBError => e
+		puts "  Skipped preload: #{e.message}"
+	end
+
+	Bench.section('Threads')
+	[1, 2, 4, Etc.nprocessors].uniq.sort.each { |threads|
+		cookies = Array.new(threads) { LibmagicRb.new(file: ?.).tap { |x| x.load(nil) } }
+		slices = paths.each_slice((paths.size / threads.to_f).ceil).to_a
+
+		Bench.measure('threads', "check_many, #{threads} threads (per file)", per: paths.size) {
+			slices.zip(cookies).map { |slice, x| Thread.new { x.check_many(slice) } }.each(&:join)
+		}
+
+		cookies.each(&:close)
+	}
+
+	[1, Etc.nprocessors].uniq.each { |threads|
+		Bench.measure('threads', "LibmagicRb.scan, #{threads} threads (per file)", per: paths.size) {
+			LibmagicRb.scan(dir, threads: threads)
+		}
+	}
+
+	Bench.section('Allocations per call')
+	interned = LibmagicRb.new(file: pdf.dup.freeze, intern: true)
+	small = Bench::FILES['doc.pdf'].dup.freeze
+
+	Bench.allocations('LibmagicRb.check') { LibmagicRb.check(file: pdf) }
+	Bench.allocations('check') { cookie.file = pdf ; cookie.check }
+	Bench.allocations('check (intern:)') { interned.check }
+	Bench.allocations('check_mime') { interned.check_mime }
+	Bench.allocations('magic_buffer') { cookie.magic_buffer(small) }
+	Bench.allocations('magic_buffer (intern:)') { interned.magic_buffer(small) }
+
+	[cookie, cached, mapped, fast, buffer_cached, interned].each(&:close)
+end
+
+Bench.write
@@ -0,0 +1,239 @@
+/*
+	Batch checks: many files are checked in a single call without the GVL,
+	with the database loaded once for the whole batch.
+*/
+#define BATCH_CHUNK 256
+
+typedef struct {
+	magic_t magic ;
+	char **paths ;
+	long count ;
+
+	// Filled by batchRun(), results are malloc'ed copies
+	char **results ;
+	int *errors ;
+	long done ;
+
+	volatile char interrupted ;
+} batch_t ;
+
+void *batchRun(void *data) {
+	batch_t *batch = data ;
+
+	// Resumes after the files done before an interrupt
+	for( ; batch->done < batch->count ; batch->done++) {
+		if (batch->interrupted) break ;
+
+		long i = batch->done ;
+		char *path = batch->paths[i] ;
+
+		if (access(path, R_OK)) {
+			batch->errors[i] = errno ;
+			continue ;
+		}
+
+		const char *mt = magic_file(batch->magic, path) ;
+		batch->results[i] = mt ? strdup(mt) : NULL ;
+	}
+
+	return NULL ;
+}
+
+// Stops the batch after the file being checked. The interrupt is handled on return, then the batch resumes unless it raised.
+void batchUnblock(void *data) {
+	batch_t *batch = data ;
+	batch->interrupted = 1 ;
+}
+
+void batchFree(batch_t *batch) {
+	if (batch->results) {
+		for(long i = 0 ; i < batch->count ; i++) free(batch->results[i]) ;
+	}
+
+	free(batch->results) ;
+	free(batch->errors) ;
+	free(batch->paths) ;
+
+	batch->results = NULL ;
+	batch->errors = NULL ;
+	batch->paths = NULL ;
+}
+
+/*
+	Copies count paths starting at offset, so they stay valid without the GVL.
+	The copies live in one block after the pointers, freed along with batch->paths.
+*/
+void batchPrepare(batch_t *batch, volatile VALUE paths, long offset, long count) {
+	size_t bytes = 0 ;
+
+	for(long i = 0 ; i < count ; i++) {
+		VALUE path = rb_ary_entry(paths, offset + i) ;
+
+		if (!RB_TYPE_P(path, T_STRING)) {
+			rb_raise(rb_eArgError, "Filename must be an instance of String.") ;
+		}
+
+		bytes += strlen(StringValueCStr(path)) + 1 ;
+	}
+
+	batch->count = count ;
+	batch->done = 0 ;
+	batch->interrupted = 0 ;
+
+	if (!count) return ;
+
+	batch->paths = malloc(sizeof(char *) * count + bytes) ;
+	batch->results = calloc(count, sizeof(char *)) ;
+	batch->errors = calloc(count, sizeof(int)) ;
+
+	if (!batch->paths || !batch->results || !batch->errors) {
+		batchFree(batch) ;
+		rb_raise(rb_eNoMemError, "Failed to allocate memory for %ld paths", count) ;
+	}
+
+	char *copy = (char *)(batch->paths + count) ;
+
+	for(long i = 0 ; i < count ; i++) {
+		VALUE path = rb_ary_entry(paths, offset + i) ;
+		size_t len = strlen(StringValuePtr(path)) + 1 ;
+
+		memcpy(copy, RSTRING_PTR(path), len) ;
+		batch->paths[i] = copy ;
+		copy += len ;
+	}
+}
+
+/*
+	Result of the i-th path: String, nil,
+	or an instance of LibmagicRb::FileNotFound / LibmagicRb::FileUnreadable.
+*/
+VALUE batchResult(batch_t *batch, long i, char intern) {
+	if (batch->errors[i]) {
+		return rb_exc_new_cstr(fileErrorClass(batch->errors[i]), batch->paths[i]) ;
+	}
+
+	return magicResult(batch->results[i], intern) ;
+}
+
+typedef struct {
+	volatile VALUE self ;
+	volatile VALUE paths ;
+	long offset ;
+	long count ;
+	batch_t batch ;
+} batchArgs_t ;
+
+// Checks one chunk of paths, runs with the cookie locked
+static VALUE _batchLocked_(VALUE data) {
+	batchArgs_t *args = (batchArgs_t *)data ;
+	volatile VALUE self = args->self ;
+
+	RB_UNWRAP(cookie) ;
+	cookieEnsureLoaded(cookie, cookieDBPath(self)) ;
+
+	batchPrepare(&args->batch, args->paths, args->offset, args->count) ;
+	args->batch.magic = cookie->magic ;
+
+	unsigned long long started = traceBegin(STATS_CHECK, NULL) ;
+
+	// Interrupts that don't raise, like traps, resume the batch where it stopped
+	while (args->batch.done < args->batch.count) {
+		args->batch.interrupted = 0 ;
+		magicWithoutGVL(batchRun, &args->batch, batchUnblock, &args->batch) ;
+		if (args->batch.done < args->batch.count) rb_thread_check_ints() ;
+	}
+
+	// The whole chunk is one check in the timings
+	traceEnd(&cookie->stats, STATS_CHECK, started) ;
+	statsCount(&cookie->stats, STATS_CHECKS, args->batch.done) ;
+
+	return Qnil ;
+}
+
+static VALUE _batchChunk_(VALUE data) {
+	batchArgs_t *args = (batchArgs_t *)data ;
+	cookie_t *cookie ;
+	TypedData_Get_Struct(args->self, cookie_t, &fileType, cookie) ;
+
+	cookieRun(cookie, _batchLocked_, data) ;
+
+	long count = args->batch.count ;
+	char block = rb_block_given_p() ;
+	VALUE results = block ? Qnil : rb_ary_new_capa(count) ;
+
+	for(long i = 0 ; i < count ; i++) {
+		VALUE result = batchResult(&args->batch, i, cookie->intern) ;
+
+		if (block) {
+			rb_yield_values(2, rb_ary_entry(args->paths, args->offset + i), result) ;
+		} else {
+			rb_ary_push(results, result) ;
+		}
+	}
+
+	return results ;
+}
+
+static VALUE _batchFree_(VALUE data) {
+	batchFree(&((batchArgs_t *)data)->batch) ;
+	return Qnil ;
+}
+
+/*
+	Checks many files in one call. The database is loaded once, and the files
+	are checked without going back and forth between ruby and C for each file.
+
+	For example:
+
+		> cookie = LibmagicRb.new(file: '.')
+		# => #<LibmagicRb:0x000055d4f8a6b8e8 @closed=false, @db=nil, @file=".", @mode=1106>
+
+		> cookie.check_many(['/usr/share/dict/words', '/tmp', '/nonexistent'])
+		# => ["text/plain; charset=utf-8", "inode/directory; charset=binary", #<LibmagicRb::FileNotFound: /nonexistent>]
+
+		> cookie.check_many(Dir.glob('/usr/share/backgrounds/[^.]*')) { |path, mime| puts "#{path}: #{mime}" }
+		/usr/share/backgrounds/vienna-5164602.jpg: image/jpeg; charset=binary
+		.
+		.
+		.
+		# => #<LibmagicRb:0x000055d4f8a6b8e8 @closed=false, @db=nil, @file=".", @mode=1106>
+
+	Files that can't be checked don't raise. Instead the result is an instance of
+	LibmagicRb::FileNotFound or LibmagicRb::FileUnreadable.
+
+	Without a block, the whole batch runs without the GVL, and an Array of results is returned.
+	With a block, files are checked in chunks of 256, yielding path and result after each chunk,
+	and returns self. The cookie can be used inside the block.
+
+	Returns Array or self.
+*/
+VALUE _checkManyGlobal_(volatile VALUE self, volatile VALUE paths) {
+	Check_Type(paths, T_ARRAY) ;
+
+	// The block may change the array, work on a snapshot of it
+	paths = rb_ary_dup(paths) ;
+
+	long total = RARRAY_LEN(paths) ;
+	char block = rb_block_given_p() ;
+	long chunk = block ? BATCH_CHUNK : total ;
+
+	volatile VALUE results = block ? self : rb_ary_new_capa(total) ;
+
+	long offset = 0 ;
+	do {
+		batchArgs_t args = {
+			.self = self,
+			.paths = paths,
+			.offset = offset,
+			.count = (total - offset < chunk) ? total - offset : chunk
+		} ;
+
+		VALUE chunkResults = rb_ensure(_batchChunk_, (VALUE)&args, _batchFree_, (VALUE)&args) ;
+		if (!block) rb_ary_concat(results, chunkResults) ;
+
+		offset += chunk ;
+	} while(offset < total) ;
+
+	RB_GC_GUARD(paths) ;
+	return results ;
+}
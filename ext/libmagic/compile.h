@@ -0,0 +1,158 @@
+/*
+	Compiling magic source files into databases (.mgc), for LibmagicRb#magic_compile()
+	and LibmagicRb.compile() (lib/libmagic_rb/compile.rb).
+
+	magic_compile() writes the database to the current directory, named after the source.
+	All threads of a process share the current directory, so the database is compiled in a
+	forked child that changes to the output directory. The parent waits for it without the GVL,
+	and raises the error the child reports through a pipe. When the wait is interrupted, the
+	child is killed and reaped before the exception goes on.
+*/
+#if defined(HAVE_FORK) && defined(HAVE_SYS_WAIT_H)
+#define HAVE_COMPILE 1
+#include <sys/wait.h>
+#include <signal.h>
+
+typedef struct {
+	pid_t pid ;
+	int fd ;
+
+	// Filled once the child is reaped
+	char reaped ;
+	int status ;
+	char message[1024] ;
+	ssize_t length ;
+} compileChild_t ;
+
+static VALUE _compileWait_(VALUE data) {
+	compileChild_t *child = (compileChild_t *)data ;
+
+	if (rb_waitpid(child->pid, &child->status, 0) != child->pid) rb_sys_fail("waitpid") ;
+	child->reaped = 1 ;
+
+	// The child has exited, its message is all in the pipe
+	child->length = read(child->fd, child->message, sizeof(child->message) - 1) ;
+	return Qnil ;
+}
+
+static VALUE _compileReap_(VALUE data) {
+	compileChild_t *child = (compileChild_t *)data ;
+
+	// Gone already if the wait reaped it before raising
+	if (!child->reaped && waitpid(child->pid, NULL, WNOHANG) == 0) {
+		kill(child->pid, SIGKILL) ;
+		while (waitpid(child->pid, NULL, 0) < 0 && errno == EINTR) ;
+	}
+
+	close(child->fd) ;
+	return Qnil ;
+}
+#endif
+
+static VALUE _compileLocked_(VALUE args) {
+	volatile VALUE self = ((VALUE *)args)[0] ;
+	volatile VALUE source = ((VALUE *)args)[1] ;
+	volatile VALUE dir = ((VALUE *)args)[2] ;
+
+	RB_UNWRAP(cookie) ;
+
+	#ifdef HAVE_COMPILE
+		char *sourcePath = StringValueCStr(source) ;
+		char *dirPath = StringValueCStr(dir) ;
+
+		// The source is read from the output directory
+		volatile VALUE absolute = rb_file_expand_path(source, Qnil) ;
+		char *absolutePath = StringValueCStr(absolute) ;
+
+		fileReadable(sourcePath) ;
+
+		int fds[2] ;
+		if (pipe(fds)) rb_sys_fail("pipe") ;
+
+		pid_t pid = fork() ;
+
+		if (pid == 0) {
+			const char *message = NULL ;
+			close(fds[0]) ;
+
+			if (chdir(dirPath)) {
+				message = strerror(errno) ;
+			} else if (magic_compile(cookie->magic, absolutePath)) {
+				message = magic_error(cookie->magic) ;
+				if (!message) message = "Failed to compile" ;
+			}
+
+			if (message) {
+				ssize_t written = write(fds[1], message, strlen(message)) ;
+				(void)written ;
+			}
+
+			_exit(message ? 1 : 0) ;
+		}
+
+		int err = errno ;
+		close(fds[1]) ;
+
+		if (pid < 0) {
+			close(fds[0]) ;
+			rb_syserr_fail(err, "fork") ;
+		}
+
+		compileChild_t child = { .pid = pid, .fd = fds[0] } ;
+		rb_ensure(_compileWait_, (VALUE)&child, _compileReap_, (VALUE)&child) ;
+
+		if (!WIFEXITED(child.status) || WEXITSTATUS(child.status)) {
+			ssize_t length = child.length ;
+			child.message[length > 0 ? length : 0] = '\0' ;
+			rb_raise(rb_eInvalidDBError, "%s (%s is not a valid magic file)", length > 0 ? child.message : "Failed to compile", sourcePath) ;
+		}
+
+		// Named after the source, with .mgc appended unless it's there already
+		const char *base = strrchr(absolutePath, '/') ;
+		base = base ? base + 1 : absolutePath ;
+
+		size_t baseLength = strlen(base) ;
+		char hasExt = baseLength > 4 && strcmp(base + baseLength - 4, ".mgc") == 0 ;
+
+		volatile VALUE output = rb_str_new_cstr(base) ;
+		if (!hasExt) rb_str_cat_cstr(output, ".mgc") ;
+
+		RB_GC_GUARD(absolute) ;
+		return rb_file_expand_path(output, dir) ;
+	#else
+		rb_raise(rb_eNotImpError, "LibmagicRb#magic_compile() is not supported on this platform") ;
+	#endif
+}
+
+/*
+	Compiles magic source files into a database, like `file -C -m source`. For example:
+
+		> cookie = LibmagicRb.new(file: '.')
+		# => #<LibmagicRb:0x000055cf280a9b30 @closed=false, @db=nil, @file=".", @mode=1106>
+
+		> cookie.magic_compile('magic/images', '/tmp')
+		# => "/tmp/images.mgc"
+
+		> LibmagicRb.check(file: 'photo.png', db: '/tmp/images.mgc')
+		# => "image/png; charset=binary"
+
+	[source] A magic source file, or a directory of them.
+	[dir] The directory to write the database to, defaults to the current directory.
+	The database is named after the source, with .mgc appended.
+
+	The cookie's loaded database isn't affected. Raises LibmagicRb::InvalidDBError if the source
+	doesn't compile. See LibmagicRb.compile() for databases of only the MIME types you need.
+	Returns the path of the database.
+*/
+VALUE _compileGlobal_(int argc, VALUE *argv, volatile VALUE self) {
+	VALUE source, dir ;
+	rb_scan_args(argc, argv, "11", &source, &dir) ;
+
+	if (!RB_TYPE_P(source, T_STRING)) rb_raise(rb_eArgError, "Source must be an instance of String.") ;
+
+	if (NIL_P(dir)) dir = rb_str_new_cstr(".") ;
+	else if (!RB_TYPE_P(dir, T_STRING)) rb_raise(rb_eArgError, "Directory must be an instance of String.") ;
+
+	volatile VALUE args[] = { self, source, dir } ;
+	return cookieSynchronize(_compileLocked_, args) ;
+}
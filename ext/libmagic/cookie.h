@@ -0,0 +1,228 @@
+/*
+	The data wrapped by a LibmagicRb object.
+
+	Along with the magic_t, it remembers which database is loaded into the cookie.
+	That way the database is parsed once, and parsed again only when the
+	database path changes, or the database file is replaced or modified.
+*/
+typedef struct {
+	magic_t magic ;
+
+	// A magic_t can't be used by multiple threads at once.
+	// Calls that release the GVL hold this Mutex.
+	VALUE lock ;
+
+	// Checks regular files through a memory map, see mmap.h
+	char mmap ;
+
+	// Returns interned frozen results, see intern.h
+	char intern ;
+
+	// Answers common formats from their first bytes, with the signatures the database agrees with, see signature.h
+	char fastPath ;
+	char signaturesChecked ;
+	unsigned int signatures ;
+
+	// Results of check() and magic_buffer(), NULL unless enabled, see resultcache.h
+	resultCache_t *results ;
+	resultCache_t *bufferResults ;
+
+	// MIME results split into Symbols, NULL until used, see mime.h
+	st_table *mimes ;
+
+	// Counters and timings, see stats.h
+	stats_t stats ;
+
+	// Database state
+	char loaded ;
+
+	// Frozen Array of the Strings given to load_buffers(), or nil when the database is loaded from a path.
+	// libmagic reads them in place, so they are kept alive and pinned while loaded.
+	VALUE buffers ;
+
+	char *dbPath ;
+	dev_t dbDev ;
+	ino_t dbIno ;
+	off_t dbSize ;
+	long long dbMtime ;
+} cookie_t ;
+
+/*
+	Validates and loads the database into the cookie, and remembers what was loaded.
+	The dbPath is either nil (system database) or a String.
+	A database preloaded with LibmagicRb.preload() is loaded from the preload, without validating it again.
+	Raises ruby error if the database isn't valid.
+*/
+void cookieLoad(cookie_t *cookie, volatile VALUE dbPath) {
+	cookie->loaded = 0 ;
+
+	volatile VALUE db = NIL_P(dbPath) ? Qnil : rb_str_new_frozen(dbPath) ;
+	char *databasePath = NIL_P(db) ? NULL : StringValuePtr(db) ;
+
+	struct stat statbuf ;
+	char statOK = dbStat(databasePath, &statbuf) == 0 ;
+	preload_t *preload = statOK ? preloadFind(databasePath, &statbuf) : NULL ;
+
+	if(!preload && databasePath) {
+		unsigned long long validated = traceBegin(STATS_VALIDATE, databasePath) ;
+		magic_validate_db(cookie->magic, databasePath) ;
+		traceEnd(&cookie->stats, STATS_VALIDATE, validated) ;
+	}
+
+	// Whatever happens, libmagic has let go of the buffers loaded before
+	unsigned long long started = traceBegin(STATS_LOAD, databasePath) ;
+	int status = preload ? preloadLoad(cookie->magic, preload) : magicLoadNoGVL(cookie->magic, databasePath) ;
+	traceEnd(&cookie->stats, STATS_LOAD, started) ;
+
+	cookie->buffers = Qnil ;
+	if(status) return ;
+
+	statsCount(&cookie->stats, STATS_LOADS, 1) ;
+
+	free(cookie->dbPath) ;
+	cookie->dbPath = databasePath ? strdup(databasePath) : NULL ;
+	resultCacheClear(cookie->results) ;
+	resultCacheClear(cookie->bufferResults) ;
+	mimeTableClear(cookie->mimes) ;
+	cookie->signaturesChecked = 0 ;
+
+	if (statOK) {
+		cookie->dbDev = statbuf.st_dev ;
+		cookie->dbIno = statbuf.st_ino ;
+		cookie->dbSize = statbuf.st_size ;
+		cookie->dbMtime = statMtime(&statbuf) ;
+	} else {
+		cookie->dbDev = 0 ;
+		cookie->dbIno = 0 ;
+		cookie->dbSize = 0 ;
+		cookie->dbMtime = 0 ;
+	}
+
+	cookie->loaded = 1 ;
+	RB_GC_GUARD(db) ;
+}
+
+/*
+	Returns the String that libmagic can read in place for a compiled database.
+	Usually that's the same String (or a frozen String sharing its bytes). But libmagic byte swaps
+	a database compiled for the other byte order in place, and reads it as aligned structs,
+	so those get a private copy of their own.
+*/
+VALUE dbBuffer(volatile VALUE buffer) {
+	if (!RB_TYPE_P(buffer, T_STRING)) {
+		rb_raise(rb_eArgError, "Database buffer must be an instance of String.") ;
+	}
+
+	buffer = rb_str_new_frozen(buffer) ;
+
+	const char *ptr = RSTRING_PTR(buffer) ;
+	uint32_t magicno = 0 ;
+	if (RSTRING_LEN(buffer) >= 4) memcpy(&magicno, ptr, 4) ;
+
+	if (magicno != MAGIC_DB_MAGICNO || (uintptr_t)ptr % sizeof(uint64_t)) {
+		buffer = rb_str_new(ptr, RSTRING_LEN(buffer)) ;
+		rb_obj_freeze(buffer) ;
+	}
+
+	return buffer ;
+}
+
+/*
+	Loads compiled databases from the frozen Array of Strings built by load_buffers().
+	Raises LibmagicRb::InvalidDBError if libmagic can't load them.
+*/
+void cookieLoadBuffers(cookie_t *cookie, volatile VALUE buffers) {
+	#ifdef HAVE_MAGIC_LOAD_BUFFERS
+		long count = RARRAY_LEN(buffers) ;
+
+		cookie->loaded = 0 ;
+		cookie->buffers = Qnil ;
+
+		VALUE ptrsTmp, sizesTmp ;
+		void **ptrs = ALLOCV_N(void *, ptrsTmp, count + 1) ;
+		size_t *sizes = ALLOCV_N(size_t, sizesTmp, count + 1) ;
+
+		for(long i = 0 ; i < count ; i++) {
+			VALUE buffer = RARRAY_AREF(buffers, i) ;
+			ptrs[i] = RSTRING_PTR(buffer) ;
+			sizes[i] = RSTRING_LEN(buffer) ;
+		}
+
+		// Kept before loading, libmagic reads the buffers without the GVL
+		cookie->buffers = buffers ;
+
+		unsigned long long started = traceBegin(STATS_LOAD, NULL) ;
+		int status = magicLoadBuffersNoGVL(cookie->magic, ptrs, sizes, count) ;
+		traceEnd(&cookie->stats, STATS_LOAD, started) ;
+		ALLOCV_END(ptrsTmp) ;
+		ALLOCV_END(sizesTmp) ;
+
+		if (status) {
+			cookie->buffers = Qnil ;
+
+			const char *err = magic_error(cookie->magic) ;
+			rb_raise(rb_eInvalidDBError, "%s", err ? err : "Failed to load database buffers") ;
+		}
+
+		statsCount(&cookie->stats, STATS_LOADS, 1) ;
+
+		free(cookie->dbPath) ;
+		cookie->dbPath = NULL ;
+		resultCacheClear(cookie->results) ;
+		resultCacheClear(cookie->bufferResults) ;
+		mimeTableClear(cookie->mimes) ;
+		cookie->signaturesChecked = 0 ;
+		cookie->dbDev = 0 ;
+		cookie->dbIno = 0 ;
+		cookie->dbSize = 0 ;
+		cookie->dbMtime = 0 ;
+
+		cookie->loaded = 1 ;
+		RB_GC_GUARD(buffers) ;
+	#else
+		rb_raise(rb_eNotImpError, "magic_load_buffers() isn't available in this libmagic") ;
+	#endif
+}
+
+/*
+	Loads the database only if it's not loaded yet, or if the loaded one is stale.
+	The database is stale when the path is changed, or the file's inode, size or mtime changed.
+*/
+void cookieEnsureLoaded(cookie_t *cookie, volatile VALUE dbPath) {
+	// Buffers stay loaded until another database is loaded explicitly
+	if (!NIL_P(cookie->buffers)) {
+		if (!cookie->loaded) cookieLoadBuffers(cookie, cookie->buffers) ;
+		return ;
+	}
+
+	if (cookie->loaded) {
+		char *databasePath = NIL_P(dbPath) ? NULL : StringValuePtr(dbPath) ;
+
+		char samePath = (!databasePath && !cookie->dbPath) ||
+			(databasePath && cookie->dbPath && strcmp(databasePath, cookie->dbPath) == 0) ;
+
+		if (samePath) {
+			struct stat statbuf ;
+			int status = dbStat(databasePath, &statbuf) ;
+
+			if (status != 0 && !cookie->dbIno) return ;
+
+			if (status == 0 &&
+				statbuf.st_dev == cookie->dbDev &&
+				statbuf.st_ino == cookie->dbIno &&
+				statbuf.st_size == cookie->dbSize &&
+				statMtime(&statbuf) == cookie->dbMtime
+			) return ;
+		}
+	}
+
+	cookieLoad(cookie, dbPath) ;
+}
+
+/*
+	Returns the database path from the @db instance variable, or nil.
+*/
+VALUE cookieDBPath(volatile VALUE self) {
+	VALUE db = rb_iv_get(self, "@db") ;
+	return RB_TYPE_P(db, T_STRING) ? db : Qnil ;
+}
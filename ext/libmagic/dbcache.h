@@ -0,0 +1,220 @@
+/*
+	Process-wide cache of loaded magic handles used by LibmagicRb.check().
+
+	Handles are keyed by (db path, flags). A magic_t can't be used by two threads
+	at once, so a handle is borrowed by one caller at a time (refs), and a key may
+	have more than one handle when there are concurrent callers.
+	Idle handles beyond the capacity are closed, least recently used first.
+
+	Every Ractor borrows from the same cache, the list is only touched while holding dbCache.lock.
+*/
+typedef struct dbHandle {
+	cookie_t cookie ;
+	unsigned int flags ;
+	unsigned int refs ;
+	unsigned long long lastUsed ;
+	struct dbHandle *next ;
+} dbHandle_t ;
+
+struct {
+	dbHandle_t *head ;
+	unsigned long size ;
+	unsigned long capacity ;
+	unsigned long long tick ;
+
+	unsigned long long hits ;
+	unsigned long long misses ;
+	unsigned long long evictions ;
+
+	ractorLock_t lock ;
+} dbCache = { .capacity = 8 } ;
+
+void dbCacheClose(dbHandle_t *handle) {
+	magic_close(handle->cookie.magic) ;
+	free(handle->cookie.dbPath) ;
+	free(handle) ;
+}
+
+char dbHandleMatches(dbHandle_t *handle, char *databasePath, unsigned int flags) {
+	if (handle->refs || handle->flags != flags) return 0 ;
+
+	// Handles are keyed by the path they were asked for, not loaded yet ones don't match
+	if (!handle->cookie.loaded) return 0 ;
+	if (!databasePath) return !handle->cookie.dbPath ;
+	return handle->cookie.dbPath && strcmp(handle->cookie.dbPath, databasePath) == 0 ;
+}
+
+/*
+	Closes idle handles until there are at most `keep` of them, holding dbCache.lock.
+	Returns the number of closed handles.
+*/
+unsigned long dbCacheTrim(unsigned long keep) {
+	unsigned long idle = 0, evicted = 0 ;
+
+	for(dbHandle_t *h = dbCache.head ; h ; h = h->next)
+		if (!h->refs) idle++ ;
+
+	while (idle > keep) {
+		dbHandle_t **lru = NULL ;
+
+		for(dbHandle_t **h = &dbCache.head ; *h ; h = &(*h)->next)
+			if (!(*h)->refs && (!lru || (*h)->lastUsed < (*lru)->lastUsed)) lru = h ;
+
+		dbHandle_t *victim = *lru ;
+		*lru = victim->next ;
+		dbCacheClose(victim) ;
+
+		dbCache.size-- ;
+		idle-- ;
+		evicted++ ;
+	}
+
+	dbCache.evictions += evicted ;
+	return evicted ;
+}
+
+/*
+	Borrows a handle with the database loaded.
+	Must be given back with dbCacheRelease(), even if loading raised an error.
+*/
+dbHandle_t *dbCacheBorrow(volatile VALUE dbPath, unsigned int flags) {
+	char *databasePath = NIL_P(dbPath) ? NULL : StringValuePtr(dbPath) ;
+	dbHandle_t *handle = NULL ;
+
+	ractorLock(&dbCache.lock) ;
+
+	for(dbHandle_t *h = dbCache.head ; h ; h = h->next) {
+		if (dbHandleMatches(h, databasePath, flags)) {
+			handle = h ;
+			break ;
+		}
+	}
+
+	if (handle) {
+		dbCache.hits++ ;
+	} else {
+		dbCache.misses++ ;
+
+		handle = calloc(1, sizeof(dbHandle_t)) ;
+
+		if (!handle) {
+			ractorUnlock(&dbCache.lock) ;
+			rb_raise(rb_eNoMemError, "Failed to allocate magic handle") ;
+		}
+
+		handle->cookie.magic = magic_open(flags) ;
+		handle->cookie.lock = Qnil ;
+		handle->cookie.buffers = Qnil ;
+		handle->flags = flags ;
+
+		handle->next = dbCache.head ;
+		dbCache.head = handle ;
+		dbCache.size++ ;
+	}
+
+	handle->refs++ ;
+	ractorUnlock(&dbCache.lock) ;
+
+	return handle ;
+}
+
+void dbCacheRelease(dbHandle_t *handle) {
+	ractorLock(&dbCache.lock) ;
+
+	handle->refs-- ;
+	handle->lastUsed = ++dbCache.tick ;
+
+	// A handle that failed to load the database isn't worth keeping
+	if (!handle->cookie.loaded && !handle->refs) {
+		for(dbHandle_t **h = &dbCache.head ; *h ; h = &(*h)->next) {
+			if (*h == handle) {
+				*h = handle->next ;
+				dbCacheClose(handle) ;
+				dbCache.size-- ;
+				break ;
+			}
+		}
+	}
+
+	dbCacheTrim(dbCache.capacity) ;
+	ractorUnlock(&dbCache.lock) ;
+}
+
+/*
+	Returns a Hash with stats of the database cache used by LibmagicRb.check():
+
+		> LibmagicRb.cache_stats
+		# => {:size=>1, :in_use=>0, :capacity=>8, :hits=>41, :misses=>1, :evictions=>0}
+
+	[size] The number of handles, each holding a loaded database.
+	[in_use] The number of handles being used right now.
+	[capacity] The maximum number of idle handles kept.
+	[hits] The number of checks that reused a loaded database.
+	[misses] The number of checks that had to open and load a new handle.
+	[evictions] The number of handles closed to stay within the capacity.
+*/
+VALUE _cacheStats_(volatile VALUE obj) {
+	unsigned long inUse = 0 ;
+
+	ractorLock(&dbCache.lock) ;
+
+	for(dbHandle_t *h = dbCache.head ; h ; h = h->next)
+		if (h->refs) inUse++ ;
+
+	unsigned long size = dbCache.size, capacity = dbCache.capacity ;
+	unsigned long long hits = dbCache.hits, misses = dbCache.misses, evictions = dbCache.evictions ;
+
+	ractorUnlock(&dbCache.lock) ;
+
+	VALUE hash = rb_hash_new() ;
+	rb_hash_aset(hash, ID2SYM(rb_intern("size")), ULONG2NUM(size)) ;
+	rb_hash_aset(hash, ID2SYM(rb_intern("in_use")), ULONG2NUM(inUse)) ;
+	rb_hash_aset(hash, ID2SYM(rb_intern("capacity")), ULONG2NUM(capacity)) ;
+	rb_hash_aset(hash, ID2SYM(rb_intern("hits")), ULL2NUM(hits)) ;
+	rb_hash_aset(hash, ID2SYM(rb_intern("misses")), ULL2NUM(misses)) ;
+	rb_hash_aset(hash, ID2SYM(rb_intern("evictions")), ULL2NUM(evictions)) ;
+
+	return hash ;
+}
+
+/*
+	Closes all idle handles of the database cache. Handles in use are closed when they are given back,
+	if the cache is over capacity.
+
+		> LibmagicRb.cache_evict
+		# => 1
+
+	Returns the number of handles closed.
+*/
+VALUE _cacheEvict_(volatile VALUE obj) {
+	ractorLock(&dbCache.lock) ;
+	unsigned long evicted = dbCacheTrim(0) ;
+	ractorUnlock(&dbCache.lock) ;
+
+	return ULONG2NUM(evicted) ;
+}
+
+/*
+	Returns the maximum number of idle handles kept in the database cache. Defaults to 8.
+*/
+VALUE _cacheCapacity_(volatile VALUE obj) {
+	return ULONG2NUM(dbCache.capacity) ;
+}
+
+/*
+	Sets the maximum number of idle handles kept in the database cache.
+	Setting it to 0 disables the cache, so every LibmagicRb.check() loads the database again.
+
+		> LibmagicRb.cache_capacity = 2
+		# => 2
+*/
+VALUE _setCacheCapacity_(volatile VALUE obj, volatile VALUE capacity) {
+	unsigned long value = capacityValue(capacity, "Cache capacity", ULONG_MAX) ;
+
+	ractorLock(&dbCache.lock) ;
+	dbCache.capacity = value ;
+	dbCacheTrim(dbCache.capacity) ;
+	ractorUnlock(&dbCache.lock) ;
+
+	return capacity ;
+}
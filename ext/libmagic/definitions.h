@@ -1,4 +1,4 @@
 #define RB_UNWRAP(cookie) \
-	magic_t *cookie ; \
-	TypedData_Get_Struct(self, magic_t, &fileType, cookie) ; \
-	if(!*cookie) rb_raise(rb_eFileClosedError, "Magic cookie already closed") ;
+	cookie_t *cookie ; \
+	TypedData_Get_Struct(self, cookie_t, &fileType, cookie) ; \
+	if(!cookie->magic) rb_raise(rb_eFileClosedError, "Magic cookie already closed") ;
@@ -0,0 +1,140 @@
+/*
+	Checks of files that are already open, through magic_descriptor().
+	No path is opened again, so there's no extra open() and no race with the file being removed.
+*/
+typedef struct {
+	magicCall_t call ;
+	char preserve ;
+	int error ;
+} descriptorCall_t ;
+
+/*
+	Regular files are checked from the start, like check() does with a path,
+	and the position is restored after the check if preserve is set, otherwise it's left at the start.
+	Pipes, sockets and other streams are checked from where they are, what's read is consumed.
+*/
+void *descriptorRun(void *data) {
+	descriptorCall_t *d = data ;
+	struct stat statbuf ;
+
+	if (fstat(d->call.fd, &statbuf)) {
+		d->error = errno ;
+		return NULL ;
+	}
+
+	off_t pos = S_ISREG(statbuf.st_mode) ? lseek(d->call.fd, 0, SEEK_CUR) : -1 ;
+	if (pos > 0) lseek(d->call.fd, 0, SEEK_SET) ;
+
+	magicCallRun(&d->call) ;
+
+	if (pos > 0 && d->preserve) lseek(d->call.fd, pos, SEEK_SET) ;
+	return NULL ;
+}
+
+void descriptorUnblock(void *data) {
+	magicCallUnblock(&((descriptorCall_t *)data)->call) ;
+}
+
+static VALUE _descriptorLocked_(VALUE args) {
+	volatile VALUE self = ((VALUE *)args)[0] ;
+
+	RB_UNWRAP(cookie) ;
+	cookieEnsureLoaded(cookie, cookieDBPath(self)) ;
+
+	descriptorCall_t d = {
+		.call = { .op = MAGIC_CALL_DESCRIPTOR, .magic = cookie->magic, .fd = NUM2INT(((VALUE *)args)[1]) },
+		.preserve = RTEST(((VALUE *)args)[2])
+	} ;
+
+	unsigned long long started = traceBegin(STATS_CHECK, NULL) ;
+
+	magicWithoutGVL(descriptorRun, &d, descriptorUnblock, &d) ;
+
+	traceEnd(&cookie->stats, STATS_CHECK, started) ;
+	statsCount(&cookie->stats, STATS_CHECKS, 1) ;
+
+	if (d.error) rb_syserr_fail(d.error, "Failed to check file descriptor") ;
+	return magicResult(d.call.result, cookie->intern) ;
+}
+
+/*
+	Checks an open file descriptor with the magic database. For example:
+
+		> cookie = LibmagicRb.new(file: '.')
+		# => #<LibmagicRb:0x000055d4f8a6b8e8 @closed=false, @db=nil, @file=".", @mode=1106>
+
+		> fd = IO.sysopen('/usr/share/dict/words')
+		# => 5
+
+		> cookie.check_fd(fd)
+		# => "text/plain; charset=utf-8"
+
+	Regular files are checked from the start. With preserve_position (the default), the position
+	of the descriptor is restored after the check, otherwise the descriptor is left at the start.
+	Pipes and sockets are checked from where they are, and the bytes read are consumed.
+
+	The descriptor isn't closed. Raises Errno::EBADF if it's not open.
+
+	Returns String or nil.
+*/
+VALUE _checkFdGlobal_(int argc, VALUE *argv, volatile VALUE self) {
+	VALUE fd, preserve ;
+	rb_scan_args(argc, argv, "11", &fd, &preserve) ;
+
+	if (!RB_TYPE_P(fd, T_FIXNUM)) {
+		rb_raise(rb_eArgError, "File descriptor must be an instance of Integer.") ;
+	}
+
+	volatile VALUE args[] = { self, fd, NIL_P(preserve) ? Qtrue : preserve } ;
+	return cookieSynchronize(_descriptorLocked_, args) ;
+}
+
+/*
+	Checks an open IO with the magic database. Anything that responds to to_io works,
+	so a Tempfile can be checked without opening it again. For example:
+
+		> cookie = LibmagicRb.new(file: '.')
+		# => #<LibmagicRb:0x000055d4f8a6b8e8 @closed=false, @db=nil, @file=".", @mode=1106>
+
+		> file = File.open('/usr/share/dict/words')
+		# => #<File:/usr/share/dict/words>
+
+		> cookie.check_io(file)
+		# => "text/plain; charset=utf-8"
+
+		> IO.popen(['cat', '/usr/share/dict/words']) { |io| cookie.check_io(io) }
+		# => "text/plain; charset=utf-8"
+
+	Buffered writes are flushed first, so what was just written is checked.
+	Like check_fd(), files are checked from the start, and with preserve_position (the default)
+	the position of the IO is restored, otherwise the IO is rewound.
+
+	Raises IOError if the IO is closed or not opened for reading.
+
+	Returns String or nil.
+*/
+VALUE _checkIOGlobal_(int argc, VALUE *argv, volatile VALUE self) {
+	VALUE io, preserve ;
+	rb_scan_args(argc, argv, "11", &io, &preserve) ;
+
+	io = rb_io_get_io(io) ;
+
+	rb_io_t *fptr ;
+	GetOpenFile(io, fptr) ;
+	rb_io_check_readable(fptr) ;
+
+	// Writes buffered data, and gives back read ahead data, so the descriptor is where the IO is
+	rb_io_flush(io) ;
+
+	#ifdef HAVE_RB_IO_DESCRIPTOR
+		int fd = rb_io_descriptor(io) ;
+	#else
+		int fd = fptr->fd ;
+	#endif
+
+	volatile VALUE args[] = { self, INT2NUM(fd), NIL_P(preserve) ? Qtrue : preserve } ;
+	volatile VALUE result = cookieSynchronize(_descriptorLocked_, args) ;
+
+	RB_GC_GUARD(io) ;
+	return result ;
+}
@@ -0,0 +1,230 @@
+/*
+	All the results of a file in one go (check_all()): the file is read once,
+	and the bytes are checked with a pass per flag on the cookie's loaded database.
+	Flags are set per pass with magic_setflags(), which is cheap, and restored after.
+*/
+#include <fcntl.h>
+
+#ifdef MAGIC_EXTENSION
+	#define DETECT_PASSES 5
+#else
+	#define DETECT_PASSES 4
+#endif
+
+VALUE cLibmagicRbResult ;
+
+typedef struct {
+	cookie_t *cookie ;
+	magic_t magic ;
+	const char *path ;
+	int mode ;
+
+	// Filled by detectRun(), results are malloc'ed copies, length is the bytes read
+	char *results[DETECT_PASSES] ;
+	int flags[DETECT_PASSES] ;
+	size_t length ;
+
+	// Passes done, the next run resumes after them
+	int passes ;
+	volatile char interrupted ;
+} detect_t ;
+
+/*
+	Opens the file, and reads the first bytesMax bytes of it if it's a regular file,
+	the same bytes magic_file() would look at.
+	Returns the descriptor, or -1 if the file has to go through magic_file().
+*/
+int detectOpen(detect_t *detect, unsigned char **buffer, size_t *length) {
+	int flags = O_RDONLY | O_NONBLOCK | O_NOCTTY ;
+
+	#ifdef O_CLOEXEC
+		flags |= O_CLOEXEC ;
+	#endif
+
+	// libmagic describes the link itself without MAGIC_SYMLINK, and resets the access time itself
+	if (!(detect->mode & MAGIC_SYMLINK)) flags |= O_NOFOLLOW ;
+	if (detect->mode & MAGIC_PRESERVE_ATIME) return -1 ;
+
+	int fd = open(detect->path, flags) ;
+	if (fd < 0) return -1 ;
+
+	struct stat statbuf ;
+	size_t size = 0 ;
+	*buffer = NULL ;
+
+	if (fstat(fd, &statbuf) == 0 && S_ISREG(statbuf.st_mode) && statbuf.st_size > 0) {
+		size_t bytesMax = magicBytesMax(detect->magic) ;
+		if ((unsigned long long)statbuf.st_size < bytesMax) bytesMax = statbuf.st_size ;
+
+		*buffer = malloc(bytesMax) ;
+
+		while (*buffer && size < bytesMax) {
+			ssize_t bytes = read(fd, *buffer + size, bytesMax - size) ;
+
+			if (bytes < 0 && errno == EINTR) continue ;
+			if (bytes <= 0) break ;
+			size += bytes ;
+		}
+	}
+
+	if (!size) {
+		free(*buffer) ;
+		*buffer = NULL ;
+		close(fd) ;
+		return -1 ;
+	}
+
+	*length = size ;
+	return fd ;
+}
+
+void *detectRun(void *data) {
+	detect_t *detect = data ;
+
+	unsigned char *buffer ;
+	size_t length ;
+	int fd = detectOpen(detect, &buffer, &length) ;
+
+	// Checked from the file, instead of the bytes read
+	char descriptor = fd >= 0 && magicNeedsDescriptor(buffer, length) ;
+	if (fd >= 0) detect->length = length ;
+	if (descriptor) lseek(fd, 0, SEEK_SET) ;
+
+	for( ; detect->passes < DETECT_PASSES && !detect->interrupted ; detect->passes++) {
+		int i = detect->passes ;
+		magic_setflags(detect->magic, detect->flags[i]) ;
+
+		const char *result ;
+		if (fd < 0) result = magic_file(detect->magic, detect->path) ;
+		else if (descriptor) result = magic_descriptor(detect->magic, fd) ;
+		else result = magic_buffer(detect->magic, buffer, length) ;
+
+		detect->results[i] = result ? strdup(result) : NULL ;
+	}
+
+	magic_setflags(detect->magic, detect->mode) ;
+
+	if (fd >= 0) close(fd) ;
+	free(buffer) ;
+	return NULL ;
+}
+
+// Stops after the pass being run. The interrupt is handled on return, then the passes left run unless it raised.
+void detectUnblock(void *data) {
+	detect_t *detect = data ;
+	detect->interrupted = 1 ;
+}
+
+// Runs the passes, then makes the LibmagicRb::Result of them
+static VALUE _detectResult_(VALUE data) {
+	detect_t *detect = (detect_t *)data ;
+	cookie_t *cookie = detect->cookie ;
+
+	unsigned long long started = traceBegin(STATS_CHECK, detect->path) ;
+
+	// Interrupts that don't raise, like traps, resume the passes left
+	while (detect->passes < DETECT_PASSES) {
+		detect->interrupted = 0 ;
+		magicWithoutGVL(detectRun, detect, detectUnblock, detect) ;
+		if (detect->passes < DETECT_PASSES) rb_thread_check_ints() ;
+	}
+
+	traceEnd(&cookie->stats, STATS_CHECK, started) ;
+	statsCount(&cookie->stats, STATS_CHECKS, DETECT_PASSES) ;
+	statsCount(&cookie->stats, STATS_BYTES, detect->length) ;
+
+	volatile VALUE mimeType = magicResult(detect->results[0], cookie->intern) ;
+	volatile VALUE encoding = magicResult(detect->results[1], cookie->intern) ;
+	volatile VALUE description = magicResult(detect->results[2], cookie->intern) ;
+	volatile VALUE apple = Qnil ;
+	volatile VALUE extensions = rb_ary_new() ;
+
+	// Unknowns as libmagic prints them
+	if (detect->results[3] && strcmp(detect->results[3], "UNKNUNKN"))
+		apple = magicResult(detect->results[3], cookie->intern) ;
+
+	#ifdef MAGIC_EXTENSION
+		if (detect->results[4] && strcmp(detect->results[4], "???")) {
+			// strtok() isn't thread safe, and check_all() runs in parallel in Ractors
+			char *saved ;
+
+			for(char *ext = strtok_r(detect->results[4], "/", &saved) ; ext ; ext = strtok_r(NULL, "/", &saved))
+				rb_ary_push(extensions, magicResult(ext, cookie->intern)) ;
+		}
+	#endif
+
+	return rb_struct_new(cLibmagicRbResult, mimeType, encoding, description, extensions, apple) ;
+}
+
+// Frees the results, even if the passes or ruby raised
+static VALUE _detectFree_(VALUE data) {
+	detect_t *detect = (detect_t *)data ;
+	for(int i = 0 ; i < DETECT_PASSES ; i++) free(detect->results[i]) ;
+
+	return Qnil ;
+}
+
+static VALUE _checkAllLocked_(VALUE args) {
+	volatile VALUE self = ((VALUE *)args)[0] ;
+
+	RB_UNWRAP(cookie) ;
+
+	volatile VALUE f = rb_str_new_frozen(rb_iv_get(self, "@file")) ;
+	char *file = StringValueCStr(f) ;
+
+	cookieEnsureLoaded(cookie, cookieDBPath(self)) ;
+	fileReadableStats(file, &cookie->stats) ;
+
+	int mode = NUM2INT(rb_iv_get(self, "@mode")) ;
+	// The rest of the cookie's mode (MAGIC_SYMLINK, MAGIC_NO_CHECK_*, ...) is kept
+	int base = mode & ~MAGIC_OUTPUT_FLAGS ;
+
+	detect_t detect = {
+		.cookie = cookie,
+		.magic = cookie->magic,
+		.path = file,
+		.mode = mode,
+		.flags = {
+			base | MAGIC_MIME_TYPE,
+			base | MAGIC_MIME_ENCODING,
+			base,
+			base | MAGIC_APPLE,
+			#ifdef MAGIC_EXTENSION
+			base | MAGIC_EXTENSION,
+			#endif
+		}
+	} ;
+
+	volatile VALUE result = rb_ensure(_detectResult_, (VALUE)&detect, _detectFree_, (VALUE)&detect) ;
+
+	RB_GC_GUARD(f) ;
+	return result ;
+}
+
+/*
+	Checks a file for its MIME type, encoding, description, extensions and Apple type and creator,
+	all at once. For example:
+
+		> cookie = LibmagicRb.new(file: '/usr/share/dict/words')
+		# => #<LibmagicRb:0x00005581019181b0 @closed=false, @db=nil, @file="/usr/share/dict/words", @mode=1106>
+
+		> cookie.check_all
+		# => #<struct LibmagicRb::Result mime_type="text/plain", encoding="utf-8", description="Unicode text, UTF-8 text", extensions=[], apple=nil>
+
+		> cookie.check_all.mime_type
+		# => "text/plain"
+
+	That's the same as setting five modes and calling check() five times, but the file is opened
+	and read once, and the bytes are checked from memory for each. The database is loaded once,
+	and the mode of the cookie isn't changed.
+
+	extensions are an empty Array and apple is nil when libmagic doesn't know them.
+	Flags of the cookie's mode other than the output ones (like MAGIC_SYMLINK or MAGIC_NO_CHECK_*)
+	apply to all the checks.
+
+	Returns LibmagicRb::Result.
+*/
+VALUE _checkAllGlobal_(volatile VALUE self) {
+	volatile VALUE args[] = { self } ;
+	return cookieSynchronize(_checkAllLocked_, args) ;
+}
@@ -6,4 +6,32 @@ $CFLAGS << ' -Os'
 abort "\e[1;31m*** Can't find magic.h ***\e[0m" unless have_header('magic.h')
 abort "\e[1;31m*** Can't find magic_open() in magic.h ***\e[0m" unless have_library('magic', 'magic_open')
 
+have_header('ruby/thread.h')
+have_func('rb_thread_call_without_gvl', 'ruby/thread.h')
+have_func('rb_io_descriptor', 'ruby/io.h')
+have_func('rb_enc_interned_str', 'ruby/encoding.h')
+have_header('ruby/fiber/scheduler.h')
+have_func('rb_fiber_scheduler_current', 'ruby/fiber/scheduler.h')
+have_func('rb_io_wait', 'ruby/io.h')
+have_func('rb_ext_ractor_safe', 'ruby.h')
+have_header('ruby/ractor.h')
+have_header('ruby/thread_native.h')
+
+have_header('sys/mman.h')
+have_func('mmap', 'sys/mman.h')
+have_func('magic_getflags', 'magic.h')
+have_func('magic_load_buffers', 'magic.h')
+
+have_header('pthread.h')
+have_func('pthread_condattr_setclock', 'pthread.h')
+have_header('sys/wait.h')
+have_func('fork', 'unistd.h')
+have_header('sys/sdt.h')
+have_func('openat', 'fcntl.h')
+have_func('fdopendir', 'dirent.h')
+have_func('fstatat', 'sys/stat.h')
+
+have_struct_member('struct stat', 'st_mtim', 'sys/stat.h')
+have_struct_member('struct stat', 'st_mtimespec', 'sys/stat.h')
+
 create_makefile 'libmagic_rb/main'
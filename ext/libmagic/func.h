@@ -1,3 +1,67 @@
+/*
+	Every method here runs its body (the _*Locked_ function) while holding the cookie's lock.
+	So a cookie shared between threads is used by one thread at a time,
+	even though libmagic is called without the GVL.
+*/
+
+typedef struct {
+	VALUE (*func)(VALUE) ;
+	VALUE data ;
+	cookie_t *cookie ;
+	unsigned long long started ;
+} synchronize_t ;
+
+static VALUE cookieSynchronized(VALUE data) {
+	synchronize_t *s = (synchronize_t *)data ;
+
+	traceEnd(&s->cookie->stats, STATS_LOCK, s->started) ;
+	return statsProtect(&s->cookie->stats, s->func, s->data) ;
+}
+
+static VALUE cookieLock(VALUE data) {
+	synchronize_t *s = (synchronize_t *)data ;
+
+	s->started = traceBegin(STATS_LOCK, NULL) ;
+	return rb_mutex_synchronize(s->cookie->lock, cookieSynchronized, data) ;
+}
+
+// Runs func(data) while holding the cookie's lock, counted in the stats of the cookie, and traced.
+VALUE cookieRun(cookie_t *cookie, VALUE (*func)(VALUE), VALUE data) {
+	synchronize_t s = { .func = func, .data = data, .cookie = cookie } ;
+	return traceCall(cookieLock, (VALUE)&s) ;
+}
+
+/*
+	Runs func(args) while holding the cookie's lock.
+	args[0] must be self, rest are passed as is.
+*/
+VALUE cookieSynchronize(VALUE (*func)(VALUE), volatile VALUE *args) {
+	cookie_t *cookie ;
+	TypedData_Get_Struct(args[0], cookie_t, &fileType, cookie) ;
+
+	return cookieRun(cookie, func, (VALUE)args) ;
+}
+
+static VALUE _closeLocked_(VALUE args) {
+	volatile VALUE self = ((VALUE *)args)[0] ;
+
+	RB_UNWRAP(cookie) ;
+
+	magic_close(cookie->magic) ;
+	cookie->magic = NULL ;
+	cookie->loaded = 0 ;
+
+	resultCacheFree(cookie->results) ;
+	resultCacheFree(cookie->bufferResults) ;
+	mimeTableFree(cookie->mimes) ;
+	cookie->results = NULL ;
+	cookie->bufferResults = NULL ;
+	cookie->mimes = NULL ;
+
+	rb_ivar_set(self, rb_intern("@closed"), Qtrue) ;
+	return self ;
+}
+
 /*
 	Closes a magic cookie. For example:
 
@@ -11,11 +75,27 @@
 */
 
 VALUE _closeGlobal_(volatile VALUE self) {
+	volatile VALUE args[] = { self } ;
+	return cookieSynchronize(_closeLocked_, args) ;
+}
+
+static VALUE _loadLocked_(VALUE args) {
+	volatile VALUE self = ((VALUE *)args)[0] ;
+	volatile VALUE dbPath = ((VALUE *)args)[1] ;
+
+	if (RB_TYPE_P(dbPath, T_STRING)) {
+		rb_iv_set(self, "@db", dbPath) ;
+	} else if(RB_TYPE_P(dbPath, T_NIL)) {
+		rb_iv_set(self, "@db", Qnil) ;
+	}
+
+	// Check if the database is a valid file or not
+	// Raises ruby error which will return.
 	RB_UNWRAP(cookie) ;
 
-	magic_close(*cookie) ;
-	*cookie = NULL ;
-	rb_ivar_set(self, rb_intern("@closed"), Qtrue) ;
+	// Loading explicitly always reloads the database
+	cookieLoad(cookie, cookieDBPath(self)) ;
+
 	return self ;
 }
 
@@ -33,29 +113,104 @@ VALUE _closeGlobal_(volatile VALUE self) {
 		> cookie.close
 		# => #<LibmagicRb:0x00005581019181b0 @closed=true, @db="/usr/share/file/misc/magic.mgc", @file="/usr/share/dict/words", @mode=1106>
 
+	The database is loaded once and kept in the cookie. Later calls to check
+	and magic_buffer reuse it, and reload only when the db path is changed,
+	or the database file is modified.
+
 	Returns self.
 */
 
 VALUE _loadGlobal_(volatile VALUE self, volatile VALUE dbPath) {
-	char *databasePath = NULL ;
+	volatile VALUE args[] = { self, dbPath } ;
+	return cookieSynchronize(_loadLocked_, args) ;
+}
 
-	if (RB_TYPE_P(dbPath, T_STRING)) {
-		databasePath = StringValuePtr(dbPath) ;
-		rb_iv_set(self, "@db", dbPath) ;
-	} else if(RB_TYPE_P(dbPath, T_STRING)) {
-		rb_iv_set(self, "@db", Qnil) ;
-	}
+static VALUE _loadBuffersLocked_(VALUE args) {
+	volatile VALUE self = ((VALUE *)args)[0] ;
+	volatile VALUE buffers = ((VALUE *)args)[1] ;
 
-	// Check if the database is a valid file or not
-	// Raises ruby error which will return.
 	RB_UNWRAP(cookie) ;
+	cookieLoadBuffers(cookie, buffers) ;
 
-	if(databasePath) magic_validate_db(*cookie, databasePath) ;
-	magic_load(*cookie, databasePath) ;
-
+	rb_iv_set(self, "@db", Qnil) ;
 	return self ;
 }
 
+/*
+	Loads compiled databases (.mgc files) from Strings in memory, instead of from the disk.
+	For example:
+
+		> db = File.binread('/usr/share/file/magic.mgc').freeze
+		# => "\x1C\x04\x1E\xF1\x12\x00\x00\x00..."
+
+		> cookie = LibmagicRb.new(file: '/usr/share/dict/words')
+		# => #<LibmagicRb:0x000055e3a1f4a6c8 @closed=false, @db=nil, @file="/usr/share/dict/words", @mode=1106>
+
+		> cookie.load_buffers([db])
+		# => #<LibmagicRb:0x000055e3a1f4a6c8 @closed=false, @db=nil, @file="/usr/share/dict/words", @mode=1106>
+
+		> cookie.check
+		# => "text/plain; charset=utf-8"
+
+	libmagic reads the Strings in place, they aren't copied. Frozen Strings can be given to
+	any number of cookies, which all share the same memory. The cookie keeps the Strings alive,
+	until another database is loaded with load().
+
+	There are no checks on the disk, and the databases aren't parsed beforehand.
+	Raises LibmagicRb::InvalidDBError if libmagic can't load them.
+
+	Returns self.
+*/
+VALUE _loadBuffersGlobal_(volatile VALUE self, volatile VALUE buffers) {
+	Check_Type(buffers, T_ARRAY) ;
+
+	volatile VALUE strings = rb_ary_new_capa(RARRAY_LEN(buffers)) ;
+	for(long i = 0 ; i < RARRAY_LEN(buffers) ; i++)
+		rb_ary_push(strings, dbBuffer(RARRAY_AREF(buffers, i))) ;
+
+	rb_obj_freeze(strings) ;
+
+	volatile VALUE args[] = { self, strings } ;
+	return cookieSynchronize(_loadBuffersLocked_, args) ;
+}
+
+static VALUE _checkLocked_(VALUE args) {
+	volatile VALUE self = ((VALUE *)args)[0] ;
+
+	RB_UNWRAP(cookie) ;
+
+	// File path
+	volatile VALUE f = rb_str_new_frozen(rb_iv_get(self, "@file")) ;
+	char *file = StringValuePtr(f) ;
+
+	// Loads the database only if it's not loaded or stale
+	cookieEnsureLoaded(cookie, cookieDBPath(self)) ;
+
+	// A cached result costs a stat() of the file
+	resultKey_t key ;
+	char cacheable = cookie->results && resultKey(file, NUM2UINT(rb_iv_get(self, "@mode")), &key) == 0 ;
+
+	if (cacheable) {
+		const char *cached = resultCacheGet(cookie->results, &key) ;
+		if (cached) return magicResult(cached, cookie->intern) ;
+	}
+
+	fileReadableStats(file, &cookie->stats) ;
+
+	volatile VALUE timeout = ((VALUE *)args)[1] ;
+	int mode = NUM2INT(rb_iv_get(self, "@mode")) ;
+
+	unsigned long long started = traceBegin(STATS_CHECK, file) ;
+	const char *mt = NIL_P(timeout) ? cookieFileNoGVL(cookie, file, mode) : cookieFileTimed(cookie, file, mode, NUM2DBL(timeout)) ;
+	traceEnd(&cookie->stats, STATS_CHECK, started) ;
+	statsCount(&cookie->stats, STATS_CHECKS, 1) ;
+
+	if (cacheable && mt) resultCachePut(cookie->results, &key, mt) ;
+
+	RB_GC_GUARD(f) ;
+	return magicResult(mt, cookie->intern) ;
+}
+
 /*
 	Check a file with the magic database. For example:
 		> cookie = LibmagicRb.new(file: '/usr/share/dict/words')
@@ -64,34 +219,521 @@ VALUE _loadGlobal_(volatile VALUE self, volatile VALUE dbPath) {
 		> cookie.check
 		# => "text/plain; charset=utf-8"
 
+		> cookie.check(timeout: 0.5)
+		# => "text/plain; charset=utf-8"
+
 		> cookie.close
 		# => #<LibmagicRb:0x00005581019181b0 @closed=true, @db="/usr/share/file/misc/magic.mgc", @file="/usr/share/dict/words", @mode=1106>
 
+		With timeout: seconds, raises LibmagicRb::TimeoutError if libmagic takes longer than that,
+		and Thread#raise or Timeout.timeout stop the check right away. Loading the database isn't counted.
+		The cookie can be used again afterwards, it loads the database again (see timeout.h).
+		Without it, the check runs to completion before ruby handles interrupts.
+
 		Returns String or nil.
 */
 
-VALUE _checkGlobal_(volatile VALUE self) {
+VALUE _checkGlobal_(int argc, VALUE *argv, volatile VALUE self) {
+	VALUE opts ;
+	rb_scan_args(argc, argv, "0:", &opts) ;
+
+	volatile VALUE args[] = { self, timeoutOption(opts) } ;
+	return cookieSynchronize(_checkLocked_, args) ;
+}
+
+/*
+	A check with the cookie's flags switched to MAGIC_MIME for the call,
+	switched back without the GVL, so an interrupt can't leave them switched.
+*/
+typedef struct {
+	magicCall_t call ;
+	char map ;
+	int flags ;
+	int mode ;
+} mimeCall_t ;
+
+void *mimeRun(void *data) {
+	mimeCall_t *m = data ;
+
+	if (m->flags != m->mode) magic_setflags(m->call.magic, m->flags) ;
+	m->map ? mmapRun(&m->call) : magicCallRun(&m->call) ;
+	if (m->flags != m->mode) magic_setflags(m->call.magic, m->mode) ;
+
+	return NULL ;
+}
+
+void mimeUnblock(void *data) {
+	magicCallUnblock(&((mimeCall_t *)data)->call) ;
+}
+
+const char *mimeCallNoGVL(mimeCall_t *m) {
+	magicWithoutGVL(mimeRun, m, mimeUnblock, m) ;
+	return m->call.result ;
+}
+
+// MAGIC_MIME, along with the cookie's flags that don't choose the output
+int mimeFlags(int mode) {
+	return (mode & ~MAGIC_OUTPUT_FLAGS) | MAGIC_MIME ;
+}
+
+static VALUE _checkMimeLocked_(VALUE args) {
+	volatile VALUE self = ((VALUE *)args)[0] ;
+
 	RB_UNWRAP(cookie) ;
 
-	// Database path
-	VALUE db = rb_iv_get(self, "@db") ;
+	volatile VALUE f = rb_str_new_frozen(rb_iv_get(self, "@file")) ;
+	char *file = StringValueCStr(f) ;
 
-	char *database = NULL ;
-	if(RB_TYPE_P(db, T_STRING)) {
-		database = StringValuePtr(db) ;
+	cookieEnsureLoaded(cookie, cookieDBPath(self)) ;
+
+	int mode = NUM2INT(rb_iv_get(self, "@mode")) ;
+	mimeCall_t m = {
+		.call = { .op = MAGIC_CALL_FILE, .magic = cookie->magic, .path = file },
+		.map = cookie->mmap,
+		.flags = mimeFlags(mode),
+		.mode = mode
+	} ;
+
+	// Shares the result cache with check(), the flags are part of the key
+	resultKey_t key ;
+	char cacheable = cookie->results && resultKey(file, m.flags, &key) == 0 ;
+
+	if (cacheable) {
+		const char *cached = resultCacheGet(cookie->results, &key) ;
+		if (cached) return mimeLookup(&cookie->mimes, cached) ;
 	}
 
-	// File path
-	VALUE f = rb_iv_get(self, "@file") ;
-	char *file = StringValuePtr(f) ;
+	fileReadableStats(file, &cookie->stats) ;
+
+	unsigned long long started = traceBegin(STATS_CHECK, file) ;
+	const char *mt = mimeCallNoGVL(&m) ;
+	traceEnd(&cookie->stats, STATS_CHECK, started) ;
+	statsCount(&cookie->stats, STATS_CHECKS, 1) ;
+
+	if (cacheable && mt) resultCachePut(cookie->results, &key, mt) ;
+
+	RB_GC_GUARD(f) ;
+	return mimeLookup(&cookie->mimes, mt) ;
+}
+
+/*
+	Checks the file for its MIME type and charset, as a frozen pair of Symbols. For example:
+
+		> cookie = LibmagicRb.new(file: '/usr/share/dict/words')
+		# => #<LibmagicRb:0x00005581019181b0 @closed=false, @db=nil, @file="/usr/share/dict/words", @mode=1106>
+
+		> cookie.check_mime
+		# => [:"text/plain", :"utf-8"]
+
+		> type, charset = cookie.check_mime
+		# => [:"text/plain", :"utf-8"]
+
+	It's check() with MAGIC_MIME, without parsing the "type/subtype; charset=x" String back.
+	The pairs are kept per cookie, and the same pair is returned for the same result, so
+	once a result has been seen, there's nothing to parse or allocate. The charset is nil
+	if libmagic doesn't give one.
+
+	The mode of the cookie isn't changed. Its flags other than the output ones
+	(like MAGIC_SYMLINK or MAGIC_NO_CHECK_*) apply.
+
+	Returns Array or nil.
+*/
+VALUE _checkMimeGlobal_(volatile VALUE self) {
+	volatile VALUE args[] = { self } ;
+	return cookieSynchronize(_checkMimeLocked_, args) ;
+}
+
+static VALUE _bufferMimeLocked_(VALUE args) {
+	volatile VALUE self = ((VALUE *)args)[0] ;
+	volatile VALUE str = rb_str_new_frozen(((VALUE *)args)[1]) ;
+
+	RB_UNWRAP(cookie) ;
+	cookieEnsureLoaded(cookie, cookieDBPath(self)) ;
+
+	int mode = NUM2INT(rb_iv_get(self, "@mode")) ;
+	mimeCall_t m = {
+		.call = { .op = MAGIC_CALL_BUFFER, .magic = cookie->magic, .buffer = RSTRING_PTR(str), .length = RSTRING_LEN(str) },
+		.flags = mimeFlags(mode),
+		.mode = mode
+	} ;
+
+	unsigned long long started = traceBegin(STATS_CHECK, NULL) ;
+	const char *mt = mimeCallNoGVL(&m) ;
+	traceEnd(&cookie->stats, STATS_CHECK, started) ;
+	statsCount(&cookie->stats, STATS_CHECKS, 1) ;
+	statsCount(&cookie->stats, STATS_BYTES, RSTRING_LEN(str)) ;
+
+	RB_GC_GUARD(str) ;
+	return mimeLookup(&cookie->mimes, mt) ;
+}
+
+/*
+	Checks a String in memory for its MIME type and charset, as a frozen pair of Symbols,
+	like check_mime() does with the file. For example:
+
+		> cookie = LibmagicRb.new(file: '.')
+		# => #<LibmagicRb:0x00005581019181b0 @closed=false, @db=nil, @file=".", @mode=1106>
+
+		> cookie.buffer_mime("%PDF-1.4\n")
+		# => [:"application/pdf", :"us-ascii"]
+
+	Returns Array or nil.
+*/
+VALUE _bufferMimeGlobal_(volatile VALUE self, volatile VALUE string) {
+	if (!RB_TYPE_P(string, T_STRING)) {
+		rb_raise(rb_eArgError, "Buffer must be an instance of String.") ;
+	}
+
+	volatile VALUE args[] = { self, string } ;
+	return cookieSynchronize(_bufferMimeLocked_, args) ;
+}
+
+/*
+	Returns true if check() reads regular files through a memory map. See mmap=.
+*/
+VALUE _mmapGlobal_(volatile VALUE self) {
+	RB_UNWRAP(cookie) ;
+	return cookie->mmap ? Qtrue : Qfalse ;
+}
+
+/*
+	Sets whether check() reads regular files through a memory map. It's also the `mmap:` key of LibmagicRb.new().
+
+	Only the prefix libmagic looks at (MAGIC_PARAM_BYTES_MAX bytes) is mapped and populated,
+	then checked in place with magic_buffer(), which saves copies with big files and big
+	MAGIC_PARAM_BYTES_MAX values. Other files are checked as usual.
+
+	For example:
+
+		> cookie = LibmagicRb.new(file: '/usr/share/dict/words', mmap: true)
+		# => #<LibmagicRb:0x000055fa4e2f1a28 @closed=false, @db=nil, @file="/usr/share/dict/words", @mode=1106>
+
+		> cookie.mmap?
+		# => true
+
+		> cookie.check
+		# => "text/plain; charset=utf-8"
+
+	Note that as with any memory map, a file that's truncated while it's being checked
+	kills the process with SIGBUS. Use it with files that aren't being written to.
+*/
+VALUE _setMmapGlobal_(volatile VALUE self, volatile VALUE value) {
+	RB_UNWRAP(cookie) ;
+	cookie->mmap = RTEST(value) ;
+	return value ;
+}
+
+/*
+	Returns true if check() and magic_buffer() answer common formats from their first bytes. See fast_path=.
+*/
+VALUE _fastPathGlobal_(volatile VALUE self) {
+	RB_UNWRAP(cookie) ;
+	return cookie->fastPath ? Qtrue : Qfalse ;
+}
+
+/*
+	Sets whether check() and magic_buffer() answer common formats from their first bytes,
+	without walking the rules of the database. It's also the `fast_path:` key of LibmagicRb.new().
+
+	PNG, JPEG, PDF, gzip and MP4 are told apart by a table of signatures, and answered with the
+	MIME type libmagic gives them. Everything else goes through libmagic as usual. For example:
+
+		> cookie = LibmagicRb.new(file: '/tmp/photo.jpg', fast_path: true)
+		# => #<LibmagicRb:0x00005581019181b0 @closed=false, @db=nil, @file="/tmp/photo.jpg", @mode=1106>
+
+		> cookie.check
+		# => "image/jpeg; charset=binary"
+
+		> cookie.stats[:fast_path]
+		# => 1
+
+	Only the MIME type and encoding are answered (MAGIC_MIME_TYPE, MAGIC_MIME), with other modes the
+	fast path is skipped. Signatures the loaded database disagrees with are turned off, so answers
+	stay the ones of the database. A text PDF, whose encoding needs libmagic, goes through libmagic.
+*/
+VALUE _setFastPathGlobal_(volatile VALUE self, volatile VALUE value) {
+	RB_UNWRAP(cookie) ;
+	cookie->fastPath = RTEST(value) ;
+	return value ;
+}
+
+/*
+	Returns true if results are interned frozen Strings. See intern=.
+*/
+VALUE _internGlobal_(volatile VALUE self) {
+	RB_UNWRAP(cookie) ;
+	return cookie->intern ? Qtrue : Qfalse ;
+}
+
+/*
+	Sets whether results are interned frozen Strings. It's also the `intern:` key of LibmagicRb.new().
+
+	By default every check allocates a new String. Interned results are deduplicated
+	and frozen, so the same result is the same object each time, and checking doesn't
+	allocate once a result has been seen. They are US-ASCII, or UTF-8 if they aren't ASCII.
+	It applies to check(), check_all(), check_many(), check_io(), check_fd() and magic_buffer().
+
+	For example:
+
+		> cookie = LibmagicRb.new(file: '/usr/share/dict/words', intern: true)
+		# => #<LibmagicRb:0x000055fa4e2f1a28 @closed=false, @db=nil, @file="/usr/share/dict/words", @mode=1106>
+
+		> cookie.check
+		# => "text/plain; charset=utf-8"
+
+		> cookie.check.equal?(cookie.check)
+		# => true
+
+		> cookie.check.frozen?
+		# => true
+*/
+VALUE _setInternGlobal_(volatile VALUE self, volatile VALUE value) {
+	RB_UNWRAP(cookie) ;
+	cookie->intern = RTEST(value) ;
+	return value ;
+}
 
-	if(database) magic_validate_db(*cookie, database) ;
-	magic_load(*cookie, database) ;
+static VALUE _resultCacheStatsLocked_(VALUE args) {
+	volatile VALUE self = ((VALUE *)args)[0] ;
 
-	fileReadable(file) ;
-	const char *mt = magic_file(*cookie, file) ;
+	RB_UNWRAP(cookie) ;
+	return resultCacheStats(cookie->results) ;
+}
+
+/*
+	Returns a Hash with stats of the result cache of the cookie. See result_cache_capacity=.
+
+		> cookie = LibmagicRb.new(file: '/usr/share/dict/words', cache: 1024)
+		# => #<LibmagicRb:0x000055c1c3b6a2f0 @closed=false, @db=nil, @file="/usr/share/dict/words", @mode=1106>
+
+		> 3.times { cookie.check }
+		# => 3
+
+		> cookie.result_cache_stats
+		# => {:size=>1, :capacity=>1024, :bytes=>98, :max_bytes=>0, :hits=>2, :misses=>1, :evictions=>0}
+*/
+VALUE _resultCacheStatsGlobal_(volatile VALUE self) {
+	volatile VALUE args[] = { self } ;
+	return cookieSynchronize(_resultCacheStatsLocked_, args) ;
+}
+
+/*
+	Returns the maximum number of results cached by the cookie, 0 if the cache is disabled.
+*/
+VALUE _resultCacheCapacityGlobal_(volatile VALUE self) {
+	RB_UNWRAP(cookie) ;
+	return ULONG2NUM(cookie->results ? cookie->results->capacity : 0) ;
+}
+
+static VALUE _setResultCacheCapacityLocked_(VALUE args) {
+	volatile VALUE self = ((VALUE *)args)[0] ;
+	unsigned long capacity = capacityValue(((VALUE *)args)[1], "Cache", ULONG_MAX) ;
+
+	RB_UNWRAP(cookie) ;
+
+	resultCacheFree(cookie->results) ;
+	cookie->results = NULL ;
+	cookie->results = resultCacheNew(capacity, 0) ;
+
+	return ((VALUE *)args)[1] ;
+}
+
+/*
+	Sets the maximum number of check() results cached by the cookie, least recently used are evicted first.
+	It's also the `cache:` key of LibmagicRb.new(). Defaults to 0, which disables the cache.
+
+	Results of regular files are cached by the file's device, inode, size, mtime and ctime,
+	along with the mode of the cookie. A modified or replaced file is checked again,
+	and a cached result costs a stat() of the file instead of a check.
+	The cache is cleared when the database is loaded again, or a parameter is set.
+
+		> cookie = LibmagicRb.new(file: '/usr/share/dict/words')
+		# => #<LibmagicRb:0x000055c1c3b6a2f0 @closed=false, @db=nil, @file="/usr/share/dict/words", @mode=1106>
+
+		> cookie.result_cache_capacity = 4096
+		# => 4096
+
+	Changing the capacity clears the cache.
+*/
+VALUE _setResultCacheCapacityGlobal_(volatile VALUE self, volatile VALUE capacity) {
+	volatile VALUE args[] = { self, capacity } ;
+	return cookieSynchronize(_setResultCacheCapacityLocked_, args) ;
+}
+
+static VALUE _bufferCacheStatsLocked_(VALUE args) {
+	volatile VALUE self = ((VALUE *)args)[0] ;
+
+	RB_UNWRAP(cookie) ;
+	return resultCacheStats(cookie->bufferResults) ;
+}
+
+/*
+	Returns a Hash with stats of the magic_buffer() cache of the cookie. See buffer_cache_bytes=.
+
+		> cookie = LibmagicRb.new(file: '.', buffer_cache: 1 << 20)
+		# => #<LibmagicRb:0x000055c1c3b6a2f0 @closed=false, @db=nil, @file=".", @mode=1106>
+
+		> 3.times { cookie.magic_buffer("%PDF-1.3\r\n") }
+		# => 3
+
+		> cookie.buffer_cache_stats
+		# => {:size=>1, :capacity=>8738, :bytes=>105, :max_bytes=>1048576, :hits=>2, :misses=>1, :evictions=>0}
+*/
+VALUE _bufferCacheStatsGlobal_(volatile VALUE self) {
+	volatile VALUE args[] = { self } ;
+	return cookieSynchronize(_bufferCacheStatsLocked_, args) ;
+}
+
+/*
+	Returns the memory limit of the magic_buffer() cache in bytes, 0 if the cache is disabled.
+*/
+VALUE _bufferCacheBytesGlobal_(volatile VALUE self) {
+	RB_UNWRAP(cookie) ;
+	return SIZET2NUM(cookie->bufferResults ? cookie->bufferResults->maxBytes : 0) ;
+}
+
+static VALUE _setBufferCacheBytesLocked_(VALUE args) {
+	volatile VALUE self = ((VALUE *)args)[0] ;
+	size_t bytes = capacityValue(((VALUE *)args)[1], "Buffer cache", SIZE_MAX) ;
+
+	RB_UNWRAP(cookie) ;
+
+	resultCacheFree(cookie->bufferResults) ;
+	cookie->bufferResults = NULL ;
+	cookie->bufferResults = resultCacheNewBytes(bytes) ;
 
-	return mt ? rb_str_new_cstr(mt) : Qnil ;
+	return ((VALUE *)args)[1] ;
+}
+
+/*
+	Sets the memory limit in bytes of the cache of magic_buffer() results, least recently used are evicted first.
+	It's also the `buffer_cache:` key of LibmagicRb.new(). Defaults to 0, which disables the cache.
+
+	Results are cached by a 128 bit hash and the length of the bytes checked, along with the mode of the cookie.
+	So checking the same bytes again costs hashing them (a few nanoseconds for a small header)
+	instead of a check. The cache is cleared when the database is loaded again, or a parameter is set.
+
+		> cookie = LibmagicRb.new(file: '.')
+		# => #<LibmagicRb:0x000055c1c3b6a2f0 @closed=false, @db=nil, @file=".", @mode=1106>
+
+		> cookie.buffer_cache_bytes = 1 << 20
+		# => 1048576
+
+	Changing the limit clears the cache.
+*/
+VALUE _setBufferCacheBytesGlobal_(volatile VALUE self, volatile VALUE bytes) {
+	volatile VALUE args[] = { self, bytes } ;
+	return cookieSynchronize(_setBufferCacheBytesLocked_, args) ;
+}
+
+static VALUE _invalidateLocked_(VALUE args) {
+	volatile VALUE self = ((VALUE *)args)[0] ;
+	volatile VALUE path = ((VALUE *)args)[1] ;
+
+	RB_UNWRAP(cookie) ;
+
+	if (NIL_P(path)) return ULONG2NUM(resultCacheClear(cookie->results) + resultCacheClear(cookie->bufferResults)) ;
+	if (!cookie->results) return Qfalse ;
+
+	resultKey_t key ;
+	if (resultKey(StringValueCStr(path), NUM2UINT(rb_iv_get(self, "@mode")), &key)) return Qfalse ;
+
+	return resultCacheInvalidate(cookie->results, &key) ? Qtrue : Qfalse ;
+}
+
+/*
+	Removes cached results. See result_cache_capacity=.
+
+		> cookie.invalidate('/usr/share/dict/words')
+		# => true
+
+		> cookie.invalidate
+		# => 41
+
+	With a path, removes the result of the file as it is now, and returns true if there was one.
+	Without a path, removes all results, of check() and magic_buffer(), and returns how many there were.
+*/
+VALUE _invalidateGlobal_(int argc, VALUE *argv, volatile VALUE self) {
+	VALUE path ;
+	rb_scan_args(argc, argv, "01", &path) ;
+
+	if (!NIL_P(path) && !RB_TYPE_P(path, T_STRING)) {
+		rb_raise(rb_eArgError, "Filename must be an instance of String.") ;
+	}
+
+	volatile VALUE args[] = { self, path } ;
+	return cookieSynchronize(_invalidateLocked_, args) ;
+}
+
+/*
+	Returns counters and timings of the cookie. For example:
+
+		> cookie = LibmagicRb.new(file: '/usr/share/dict/words')
+		# => #<LibmagicRb:0x00005581019181b0 @closed=false, @db=nil, @file="/usr/share/dict/words", @mode=1106>
+
+		> 2.times { cookie.check }
+		# => 2
+
+		> cookie.stats
+		# => {:calls=>2, :errors=>0, :loads=>1, :checks=>2, :bytes=>0,
+		#	:lock=>{:count=>2, :total_ns=>1530, :max_ns=>1024},
+		#	:load=>{:count=>1, :total_ns=>38914213, :max_ns=>38914213},
+		#	:validate=>{:count=>2, :total_ns=>4392, :max_ns=>2410},
+		#	:check=>{:count=>2, :total_ns=>983502, :max_ns=>501876}}
+
+	[calls] Calls of methods that take the cookie's lock (check_many() with a block takes it per chunk),
+	[errors] those of them that raised.
+
+	[loads] Databases loaded.
+
+	[checks] Files and buffers checked. check_all() counts a check per result, check_many() a check per file.
+
+	[bytes] Bytes checked from memory: magic_buffer(), buffer_mime(), and the bytes check_all() reads.
+
+	[lock] Times the cookie's lock was taken, and the time waiting for it while another thread held it.
+
+	[load] Time loading databases.
+
+	[validate] Time checking that files and databases exist, are readable, and that databases are valid.
+
+	[check] Time libmagic spent checking, which includes reading the files.
+
+	Times are nanoseconds on the monotonic clock. The process wide sums are in LibmagicRb.stats.
+*/
+VALUE _statsGlobal_(volatile VALUE self) {
+	cookie_t *cookie ;
+	TypedData_Get_Struct(self, cookie_t, &fileType, cookie) ;
+
+	return statsHash(&cookie->stats) ;
+}
+
+/*
+	Sets the stats of the cookie to 0. LibmagicRb.stats are kept. Returns self.
+*/
+VALUE _resetStatsGlobal_(volatile VALUE self) {
+	cookie_t *cookie ;
+	TypedData_Get_Struct(self, cookie_t, &fileType, cookie) ;
+
+	memset(&cookie->stats, 0, sizeof(stats_t)) ;
+	return self ;
+}
+
+static VALUE _getParamLocked_(VALUE args) {
+	volatile VALUE self = ((VALUE *)args)[0] ;
+	volatile VALUE param = ((VALUE *)args)[1] ;
+
+	#if MAGIC_VERSION > 525
+		RB_UNWRAP(cookie) ;
+
+		unsigned int _param = NUM2UINT(param) ;
+		unsigned long value ;
+
+		int status = magic_getparam(cookie->magic, _param, &value) ;
+		if (status) return Qnil ;
+		return ULONG2NUM(value) ;
+	#else
+		return Qnil ;
+	#endif
 }
 
 /*
@@ -107,15 +749,32 @@ VALUE _checkGlobal_(volatile VALUE self) {
 */
 
 VALUE _getParamGlobal_(volatile VALUE self, volatile VALUE param) {
+	volatile VALUE args[] = { self, param } ;
+	return cookieSynchronize(_getParamLocked_, args) ;
+}
+
+static VALUE _setParamLocked_(VALUE args) {
+	volatile VALUE self = ((VALUE *)args)[0] ;
+	volatile VALUE param = ((VALUE *)args)[1] ;
+	volatile VALUE paramVal = ((VALUE *)args)[2] ;
+
 	#if MAGIC_VERSION > 525
+		unsigned int _param = NUM2UINT(param) ;
+		unsigned long _paramVal = NUM2ULONG(paramVal) ;
+
 		RB_UNWRAP(cookie) ;
 
-		unsigned int _param = NUM2UINT(param) ;
 		unsigned long value ;
+		magic_setparam(cookie->magic, _param, &_paramVal) ;
 
-		int status = magic_getparam(*cookie, _param, &value) ;
+		// Parameters change results
+		resultCacheClear(cookie->results) ;
+		resultCacheClear(cookie->bufferResults) ;
+
+		int status = magic_getparam(cookie->magic, _param, &value) ;
 		if (status) return Qnil ;
-		return ULONG2NUM(value) ;
+
+		return ULONG2NUM((int)value) ;
 	#else
 		return Qnil ;
 	#endif
@@ -143,26 +802,75 @@ VALUE _getParamGlobal_(volatile VALUE self, volatile VALUE param) {
 */
 
 VALUE _setParamGlobal_(volatile VALUE self, volatile VALUE param, volatile VALUE paramVal) {
-	#if MAGIC_VERSION > 525
-		unsigned int _param = NUM2UINT(param) ;
-		unsigned long _paramVal = NUM2ULONG(paramVal) ;
+	volatile VALUE args[] = { self, param, paramVal } ;
+	return cookieSynchronize(_setParamLocked_, args) ;
+}
 
-		RB_UNWRAP(cookie) ;
+/*
+	Resolves the offset and length arguments of magic_buffer() to a window in a string of size bytes.
+	A negative offset counts from the end, a nil length reaches the end, and a length past the end is cut.
+*/
+void bufferWindow(long size, volatile VALUE offset, volatile VALUE length, long *start, long *len) {
+	long off = NIL_P(offset) ? 0 : NUM2LONG(offset) ;
+	*start = off < 0 ? off + size : off ;
 
-		unsigned long value ;
-		magic_setparam(*cookie, _param, &_paramVal) ;
+	if (*start < 0 || *start > size) {
+		rb_raise(rb_eIndexError, "Offset %ld is out of the buffer of %ld bytes", off, size) ;
+	}
 
-		int status = magic_getparam(*cookie, _param, &value) ;
-		if (status) return Qnil ;
+	*len = NIL_P(length) ? size - *start : NUM2LONG(length) ;
+	if (*len < 0) rb_raise(rb_eArgError, "Length must not be negative") ;
+	if (*len > size - *start) *len = size - *start ;
+}
 
-		return ULONG2NUM((int)value) ;
-	#else
-		return Qnil ;
-	#endif
+static VALUE _bufferLocked_(VALUE args) {
+	volatile VALUE self = ((VALUE *)args)[0] ;
+	volatile VALUE string = ((VALUE *)args)[1] ;
+
+	RB_UNWRAP(cookie) ;
+	cookieEnsureLoaded(cookie, cookieDBPath(self)) ;
+
+	// Shares the bytes of string, so nothing is copied, and they can't change while libmagic reads them
+	volatile VALUE str = rb_str_new_frozen(string) ;
+
+	long start, len ;
+	bufferWindow(RSTRING_LEN(str), ((VALUE *)args)[2], ((VALUE *)args)[3], &start, &len) ;
+
+	const char *ptr = RSTRING_PTR(str) + start ;
+
+	// Common formats are told from their first bytes, that's cheaper than hashing them all
+	const char *fast = cookieBufferFast(cookie, ptr, len, NUM2INT(rb_iv_get(self, "@mode"))) ;
+	if (fast) return magicResult(fast, cookie->intern) ;
+
+	// A cached result costs hashing the bytes
+	resultKey_t key ;
+	if (cookie->bufferResults) {
+		bufferKey(ptr, len, NUM2UINT(rb_iv_get(self, "@mode")), &key) ;
+
+		const char *cached = resultCacheGet(cookie->bufferResults, &key) ;
+		if (cached) return magicResult(cached, cookie->intern) ;
+	}
+
+	volatile VALUE timeout = ((VALUE *)args)[4] ;
+
+	unsigned long long started = traceBegin(STATS_CHECK, NULL) ;
+	const char *buf = NIL_P(timeout) ? magicBufferNoGVL(cookie->magic, ptr, len) :
+		cookieBufferTimed(cookie, ptr, len, NUM2INT(rb_iv_get(self, "@mode")), NUM2DBL(timeout)) ;
+	traceEnd(&cookie->stats, STATS_CHECK, started) ;
+	statsCount(&cookie->stats, STATS_CHECKS, 1) ;
+	statsCount(&cookie->stats, STATS_BYTES, len) ;
+	if (cookie->bufferResults && buf) resultCachePut(cookie->bufferResults, &key, buf) ;
+
+	RB_GC_GUARD(str) ;
+	return magicResult(buf, cookie->intern) ;
 }
 
 /*
-	Returns a textual description of the contents of the buffer argument with length bytes size.
+	Returns a textual description of the contents of the buffer argument.
+
+	The whole string is checked, including NUL bytes, so binary data can be passed as is.
+	Optionally, offset and length bytes select a window of the string to check,
+	without allocating a substring. A negative offset counts from the end of the string.
 
 	For example:
 
@@ -172,31 +880,62 @@ VALUE _setParamGlobal_(volatile VALUE self, volatile VALUE param, volatile VALUE
 		> cookie.magic_buffer("%PDF-1.3\r\n")
 		# => "application/pdf; charset=us-ascii"
 
+		> cookie.magic_buffer(File.binread('/bin/ls', 4096))
+		# => "application/x-pie-executable; charset=binary"
+
+		> cookie.magic_buffer("garbage%PDF-1.3\r\n", 7)
+		# => "application/pdf; charset=us-ascii"
+
+		> cookie.magic_buffer("garbage%PDF-1.3\r\ngarbage", 7, 10)
+		# => "application/pdf; charset=us-ascii"
+
 		> cookie.close
 		# => #<LibmagicRb:0x00005582de0d1bf8 @closed=true, @db=nil, @file=".", @mode=1106>
 
-	Note that it automatically loads the database.
+	Note that it automatically loads the database, if it's not loaded already.
+	Raises IndexError if the offset is outside the string.
+
+	Like check(), takes timeout: seconds, and raises LibmagicRb::TimeoutError past them:
+
+		> cookie.magic_buffer(File.binread('upload.bin'), timeout: 0.5)
+		# => "application/octet-stream; charset=binary"
 
 	Returns either String or nil.
 */
 
-VALUE _bufferGlobal_(volatile VALUE self, volatile VALUE string) {
+VALUE _bufferGlobal_(int argc, VALUE *argv, volatile VALUE self) {
+	VALUE string, offset, length, opts ;
+	rb_scan_args(argc, argv, "12:", &string, &offset, &length, &opts) ;
+
+	if (!RB_TYPE_P(string, T_STRING)) {
+		rb_raise(rb_eArgError, "Buffer must be an instance of String.") ;
+	}
+
+	volatile VALUE args[] = { self, string, offset, length, timeoutOption(opts) } ;
+	return cookieSynchronize(_bufferLocked_, args) ;
+}
+
+static VALUE _listLocked_(VALUE args) {
+	volatile VALUE self = ((VALUE *)args)[0] ;
+
 	RB_UNWRAP(cookie) ;
 
-	VALUE db = rb_iv_get(self, "@db") ;
+	volatile VALUE db = cookieDBPath(self) ;
 
 	char *database = NULL ;
-	if(RB_TYPE_P(db, T_STRING)) {
+	if (RB_TYPE_P(db, T_STRING)) {
+		db = rb_str_new_frozen(db) ;
 		database = StringValuePtr(db) ;
 	}
 
-	if(database) magic_validate_db(*cookie, database) ;
-	magic_load(*cookie, database) ;
+	if(database) magic_validate_db(cookie->magic, database) ;
+	int status = magic_list(cookie->magic, database) ;
 
-	char *buffer = StringValuePtr(string) ;
-	const char *buf = magic_buffer(*cookie, buffer, strlen(buffer)) ;
+	// Listing discards the loaded database
+	cookie->loaded = 0 ;
 
-	return buf ? rb_str_new_cstr(buf) : Qnil ;
+	RB_GC_GUARD(db) ;
+	return INT2FIX(status) ;
 }
 
 /*
@@ -230,19 +969,25 @@ VALUE _bufferGlobal_(volatile VALUE self, volatile VALUE string) {
 */
 
 VALUE _listGlobal_(volatile VALUE self) {
-	RB_UNWRAP(cookie) ;
+	volatile VALUE args[] = { self } ;
+	return cookieSynchronize(_listLocked_, args) ;
+}
 
-	VALUE db = rb_iv_get(self, "@db") ;
+static VALUE _setflagsLocked_(VALUE args) {
+	volatile VALUE self = ((VALUE *)args)[0] ;
+	volatile VALUE flags = ((VALUE *)args)[1] ;
 
-	char *database = NULL ;
-	if (RB_TYPE_P(db, T_STRING)) {
-		database = StringValuePtr(db) ;
-	}
+	unsigned int flag = NUM2UINT(flags) ;
 
-	if(database) magic_validate_db(*cookie, database) ;
-	int status = magic_list(*cookie, database) ;
+	RB_UNWRAP(cookie) ;
+	int status = magic_setflags(cookie->magic, flag) ;
 
-	return INT2FIX(status) ;
+	if (status) {
+		return Qnil ;
+	} else {
+		rb_ivar_set(self, rb_intern("@mode"), flags) ;
+		return flags ;
+	}
 }
 
 /*
@@ -277,15 +1022,6 @@ VALUE _listGlobal_(volatile VALUE self) {
 */
 
 VALUE _setflagsGlobal_(volatile VALUE self, volatile VALUE flags) {
-	unsigned int flag = NUM2UINT(flags) ;
-
-	RB_UNWRAP(cookie) ;
-	int status = magic_setflags(*cookie, flag) ;
-
-	if (status) {
-		return Qnil ;
-	} else {
-		rb_ivar_set(self, rb_intern("@mode"), flags) ;
-		return flags ;
-	}
+	volatile VALUE args[] = { self, flags } ;
+	return cookieSynchronize(_setflagsLocked_, args) ;
 }
@@ -0,0 +1,36 @@
+/*
+	Results as Ruby Strings.
+
+	By default, each result is a new String. With `intern: true`, results are
+	deduplicated frozen Strings instead (like String#-@ returns): the handful of
+	distinct results are allocated once, and each check returns the same object.
+	They can be used as Hash keys as is, Ruby doesn't copy frozen String keys.
+
+	Interned results are US-ASCII when they are (MIME types always are),
+	and UTF-8 otherwise, as descriptions can quote text from the file.
+*/
+#include "ruby/encoding.h"
+
+VALUE magicResult(const char *result, char intern) {
+	if (!result) return Qnil ;
+	if (!intern) return rb_str_new_cstr(result) ;
+
+	long len = strlen(result) ;
+	char ascii = 1 ;
+
+	for(long i = 0 ; i < len ; i++) {
+		if ((unsigned char)result[i] > 127) {
+			ascii = 0 ;
+			break ;
+		}
+	}
+
+	rb_encoding *enc = ascii ? rb_usascii_encoding() : rb_utf8_encoding() ;
+
+	#ifdef HAVE_RB_ENC_INTERNED_STR
+		return rb_enc_interned_str(result, len, enc) ;
+	#else
+		VALUE str = rb_enc_str_new(result, len, enc) ;
+		return rb_funcall(str, rb_intern("-@"), 0) ;
+	#endif
+}
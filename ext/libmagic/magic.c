@@ -1,8 +1,18 @@
 #include <magic.h>
 #include <stdio.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <limits.h>
 #include <unistd.h>
 #include <sys/stat.h>
 #include "ruby.h"
+#include "ruby/io.h"
+
+#ifdef HAVE_RUBY_THREAD_H
+#include "ruby/thread.h"
+#endif
 
 /*
 * LibmagicRB Header files
@@ -23,15 +33,53 @@ VALUE rb_eFileNotReadableError ;
 VALUE rb_eInvalidDBError ;
 VALUE rb_eIsDirError ;
 VALUE rb_eFileClosedError ;
+VALUE rb_eTimeoutError ;
+
+#include "nogvl.h"
+#include "ractor.h"
+#include "stats.h"
+#include "trace.h"
+#include "validations.h"
+#include "intern.h"
+#include "preload.h"
+#include "resultcache.h"
+#include "mime.h"
+#include "cookie.h"
+#include "dbcache.h"
+#include "mmap.h"
+#include "signature.h"
+#include "timeout.h"
 
 // Garbage collect
-void file_free(void **data) {
-	if(*data) {
-		magic_close(*data) ;
-		*data = NULL ;
+void file_mark(void *data) {
+	cookie_t *cookie = data ;
+	rb_gc_mark(cookie->lock) ;
+
+	// Pinned, the table isn't updated by compaction
+	if (cookie->mimes) rb_mark_tbl(cookie->mimes) ;
+
+	// Pinned, libmagic holds pointers to their bytes
+	if (!NIL_P(cookie->buffers)) {
+		rb_gc_mark(cookie->buffers) ;
+
+		for(long i = 0 ; i < RARRAY_LEN(cookie->buffers) ; i++)
+			rb_gc_mark(RARRAY_AREF(cookie->buffers, i)) ;
+	}
+}
+
+void file_free(void *data) {
+	cookie_t *cookie = data ;
+
+	if(cookie->magic) {
+		magic_close(cookie->magic) ;
+		cookie->magic = NULL ;
 	}
 
-	free(data) ;
+	resultCacheFree(cookie->results) ;
+	resultCacheFree(cookie->bufferResults) ;
+	mimeTableFree(cookie->mimes) ;
+	free(cookie->dbPath) ;
+	free(cookie) ;
 }
 
 // Filetype
@@ -39,7 +87,7 @@ static rb_data_type_t fileType = {
 	.wrap_struct_name = "file",
 
 	.function = {
-		.dmark = NULL,
+		.dmark = file_mark,
 		.dfree = file_free,
 	},
 
@@ -50,47 +98,61 @@ static rb_data_type_t fileType = {
 	#endif
 } ;
 
-#include "validations.h"
 #include "func.h"
+#include "batch.h"
+#include "descriptor.h"
+#include "scan.h"
+#include "detect.h"
+#include "compile.h"
+
+typedef struct {
+	dbHandle_t *handle ;
+	volatile VALUE dbPath ;
+	char *checkPath ;
+	char intern ;
+} oneshot_t ;
+
+static VALUE _checkRun_(VALUE data) {
+	oneshot_t *oneshot = (oneshot_t *)data ;
+
+	// Loads the database only if the borrowed handle doesn't have it already
+	cookieEnsureLoaded(&oneshot->handle->cookie, oneshot->dbPath) ;
+	stats_t *stats = &oneshot->handle->cookie.stats ;
+
+	unsigned long long started = traceBegin(STATS_CHECK, oneshot->checkPath) ;
+	const char *mt = magicFileNoGVL(oneshot->handle->cookie.magic, oneshot->checkPath) ;
+	traceEnd(stats, STATS_CHECK, started) ;
+	statsCount(stats, STATS_CHECKS, 1) ;
+
+	return magicResult(mt, oneshot->intern) ;
+}
 
-/*
-	Directly check a file with LibmagicRb, without creating any sort of cookies:
-
-		LibmagicRb.check(file: '/tmp/', db: '/usr/share/file/misc/magic.mgc', mode: LibmagicRb::MAGIC_CHECK) # => "sticky, directory"
-
-	[file] The key `file:` is the filename to check. Should be a string
-
-	[db] The key `db:` can be left as nil. Or you can give it the path of the current magic database.
+static VALUE _checkRelease_(VALUE data) {
+	oneshot_t *oneshot = (oneshot_t *)data ;
+	dbCacheRelease(oneshot->handle) ;
+	return Qnil ;
+}
 
-	[mode] The key `mode` can be any of the LibmagicRb.lsmodes().
-	To combine modes you can use `|`. For example:
-	`mode: LibmagicRb::MAGIC_CHECK | LibmagicRb::MAGIC_SYMLINK | Libmagic_MAGIC_MIME`
-	If `mode` key is nil, it will default to `MAGIC_MIME | MAGIC_CHECK | MAGIC_SYMLINK`
-*/
-static VALUE _check_(volatile VALUE obj, volatile VALUE args) {
+static VALUE _checkOneshot_(VALUE args) {
 	if(!RB_TYPE_P(args, T_HASH)) {
 		rb_raise(rb_eArgError, "Expected hash as argument.") ;
 	}
 
 	// Database Path
-	VALUE argDBPath = rb_hash_aref(args, ID2SYM(rb_intern("db"))) ;
+	volatile VALUE argDBPath = rb_hash_aref(args, ID2SYM(rb_intern("db"))) ;
 
-	char *databasePath ;
-	if (RB_TYPE_P(argDBPath, T_NIL)) {
-		databasePath = NULL ;
-	} else if (!RB_TYPE_P(argDBPath, T_STRING)) {
+	if (!RB_TYPE_P(argDBPath, T_NIL) && !RB_TYPE_P(argDBPath, T_STRING)) {
 		rb_raise(rb_eArgError, "Database name must be an instance of String.") ;
-	} else {
-		databasePath = StringValuePtr(argDBPath) ;
 	}
 
 	// File path
-	VALUE argFilePath = rb_hash_aref(args, ID2SYM(rb_intern("file"))) ;
+	volatile VALUE argFilePath = rb_hash_aref(args, ID2SYM(rb_intern("file"))) ;
 	if (RB_TYPE_P(argFilePath, T_NIL)) {
 		rb_raise(rb_eArgError, "Expected `file:\" key as a string, got nil instead") ;
 	} else if (!RB_TYPE_P(argFilePath, T_STRING)) {
 		rb_raise(rb_eArgError, "Filename must be an instance of String.") ;
 	}
+	argFilePath = rb_str_new_frozen(argFilePath) ;
 	char *checkPath = StringValuePtr(argFilePath) ;
 
 	// Modes
@@ -104,25 +166,50 @@ static VALUE _check_(volatile VALUE obj, volatile VALUE args) {
 		modes = FIX2UINT(argModes) ;
 	}
 
-	// Checks
-	struct magic_set *magic = magic_open(modes) ;
-
 	// Check if the database is a valid file or not
 	// Raises ruby error which will return.
-	fileReadable(checkPath) ;
+	fileReadableStats(checkPath, NULL) ;
 
-	if(databasePath) {
-		magic_validate_db(magic, databasePath) ;
-	}
+	// Checks
+	oneshot_t oneshot = {
+		.handle = dbCacheBorrow(argDBPath, modes),
+		.dbPath = argDBPath,
+		.checkPath = checkPath,
+		.intern = RTEST(rb_hash_aref(args, ID2SYM(rb_intern("intern"))))
+	} ;
 
-	magic_load(magic, databasePath) ;
+	VALUE retVal = rb_ensure(_checkRun_, (VALUE)&oneshot, _checkRelease_, (VALUE)&oneshot) ;
 
-	const char *mt = magic_file(magic, checkPath) ;
+	RB_GC_GUARD(argDBPath) ;
+	RB_GC_GUARD(argFilePath) ;
+	return retVal ;
+}
 
-	VALUE retVal = mt ? rb_str_new_cstr(mt) : Qnil ;
-	magic_close(magic) ;
+static VALUE _checkProtect_(VALUE args) {
+	return statsProtect(NULL, _checkOneshot_, args) ;
+}
 
-	return retVal ;
+/*
+	Directly check a file with LibmagicRb, without creating any sort of cookies:
+
+		LibmagicRb.check(file: '/tmp/', db: '/usr/share/file/misc/magic.mgc', mode: LibmagicRb::MAGIC_CHECK) # => "sticky, directory"
+
+	[file] The key `file:` is the filename to check. Should be a string
+
+	[db] The key `db:` can be left as nil. Or you can give it the path of the current magic database.
+
+	[mode] The key `mode` can be any of the LibmagicRb.lsmodes().
+	To combine modes you can use `|`. For example:
+	`mode: LibmagicRb::MAGIC_CHECK | LibmagicRb::MAGIC_SYMLINK | Libmagic_MAGIC_MIME`
+	If `mode` key is nil, it will default to `MAGIC_MIME | MAGIC_CHECK | MAGIC_SYMLINK`
+
+	[intern] The key `intern:` returns an interned frozen String, like LibmagicRb#intern=.
+
+	The loaded database is kept in a shared cache keyed by db and mode, so the next check
+	with the same db and mode doesn't load it again. See LibmagicRb.cache_stats().
+*/
+static VALUE _check_(volatile VALUE obj, volatile VALUE args) {
+	return traceCall(_checkProtect_, args) ;
 }
 
 /*
@@ -202,25 +289,79 @@ VALUE rb_libmagicRb_initialize(volatile VALUE self, volatile VALUE args) {
 	rb_ivar_set(self, rb_intern("@closed"), Qfalse) ;
 
 	RB_UNWRAP(cookie) ;
-	magic_setflags(*cookie, modes) ;
+	magic_setflags(cookie->magic, modes) ;
+
+	// Memory mapped checks, off by default
+	cookie->mmap = RTEST(rb_hash_aref(args, ID2SYM(rb_intern("mmap")))) ;
+
+	// Answers of common formats from their first bytes, off by default
+	cookie->fastPath = RTEST(rb_hash_aref(args, ID2SYM(rb_intern("fast_path")))) ;
+
+	// Interned frozen results, off by default
+	cookie->intern = RTEST(rb_hash_aref(args, ID2SYM(rb_intern("intern")))) ;
+
+	// Cache of results, off by default
+	VALUE argCache = rb_hash_aref(args, ID2SYM(rb_intern("cache"))) ;
+	if (!NIL_P(argCache)) {
+		resultCacheFree(cookie->results) ;
+		cookie->results = resultCacheNew(capacityValue(argCache, "Cache", ULONG_MAX), 0) ;
+	}
+
+	VALUE argBufferCache = rb_hash_aref(args, ID2SYM(rb_intern("buffer_cache"))) ;
+	if (!NIL_P(argBufferCache)) {
+		resultCacheFree(cookie->bufferResults) ;
+		cookie->bufferResults = resultCacheNewBytes(capacityValue(argBufferCache, "Buffer cache", SIZE_MAX)) ;
+	}
 
 	return self ;
 }
 
 VALUE initAlloc(volatile VALUE self) {
-	magic_t *cookie ;
-	cookie = malloc(sizeof(*cookie)) ;
-	*cookie = magic_open(0) ;
+	cookie_t *cookie ;
+	cookie = calloc(1, sizeof(*cookie)) ;
+	cookie->magic = magic_open(0) ;
+	cookie->lock = rb_mutex_new() ;
+	cookie->buffers = Qnil ;
 
 	return TypedData_Wrap_Struct(self, &fileType, cookie) ;
 }
 
 void Init_main() {
+	#ifdef HAVE_RACTOR
+		// Methods defined from here can be called from any Ractor, see ractor.h
+		rb_ext_ractor_safe(true) ;
+
+		traceHookKey = rb_ractor_local_storage_ptr_newkey(&traceHookType) ;
+	#else
+		rb_global_variable(&traceHookGlobal.hook) ;
+	#endif
+
+	#ifdef TRACE_THREAD
+		traceKey = rb_intern("__libmagic_rb_trace__") ;
+	#endif
+
+	ractorLockInit(&dbCache.lock) ;
+	ractorLockInit(&preloadsLock) ;
+
+	#ifdef HAVE_FIBER_CALL
+		pthread_atfork(fiberPoolPrepare, fiberPoolParent, fiberPoolChild) ;
+	#endif
+
+	#ifdef HAVE_TIMEOUT
+		// Hidden, marks what abandoned calls read, see timeout.h
+		timeoutKeeper = TypedData_Wrap_Struct(0, &timeoutKeeperType, &timeoutsAbandoned) ;
+		rb_global_variable(&timeoutKeeper) ;
+		pthread_atfork(timeoutsPrepare, timeoutsParent, timeoutsChild) ;
+	#endif
+
 	rb_global_variable(&rb_eFileNotFoundError) ;
 	rb_global_variable(&rb_eFileNotReadableError) ;
 	rb_global_variable(&rb_eInvalidDBError) ;
 	rb_global_variable(&rb_eIsDirError) ;
 	rb_global_variable(&rb_eFileClosedError) ;
+	rb_global_variable(&rb_eTimeoutError) ;
+	rb_global_variable(&cLibmagicRbResult) ;
+	rb_global_variable(&cLibmagicRbTrace) ;
 
 	/*
 	* Libmagic Errors
@@ -236,6 +377,17 @@ void Init_main() {
 	rb_eInvalidDBError = rb_define_class_under(cLibmagicRb, "InvalidDBError", rb_eRuntimeError) ;
 	rb_eIsDirError = rb_define_class_under(cLibmagicRb, "IsDirError", rb_eRuntimeError) ;
 	rb_eFileClosedError = rb_define_class_under(cLibmagicRb, "FileClosedError", rb_eRuntimeError) ;
+	rb_eTimeoutError = rb_define_class_under(cLibmagicRb, "TimeoutError", rb_eRuntimeError) ;
+
+	/*
+		Results of LibmagicRb#check_all.
+	*/
+	cLibmagicRbResult = rb_struct_define_under(cLibmagicRb, "Result", "mime_type", "encoding", "description", "extensions", "apple", NULL) ;
+
+	/*
+		Where a call traced by LibmagicRb.trace spent its time.
+	*/
+	cLibmagicRbTrace = rb_struct_define_under(cLibmagicRb, "Trace", "name", "path", "total_ns", "phases", "error", NULL) ;
 
 	/*
 	* Constants
@@ -252,9 +404,9 @@ void Init_main() {
 			LibmagicRb::MAGIC_VERSION returns the magic version of the library.
 			For older libmagic version, this can be undefined, so this method will return "0" instead.
 		*/
-		rb_define_const(cLibmagicRb, "MAGIC_VERSION", rb_str_new_cstr(version)) ;
+		rb_define_const(cLibmagicRb, "MAGIC_VERSION", rb_obj_freeze(rb_str_new_cstr(version))) ;
 	#else
-		rb_define_const(cLibmagicRb, "MAGIC_VERSION", rb_str_new_cstr("0")) ;
+		rb_define_const(cLibmagicRb, "MAGIC_VERSION", rb_obj_freeze(rb_str_new_cstr("0"))) ;
 	#endif
 
 	/*
@@ -264,6 +416,26 @@ void Init_main() {
 	rb_define_singleton_method(cLibmagicRb, "lsmodes", lsmodes, 0) ;
 	rb_define_singleton_method(cLibmagicRb, "lsparams", lsparams, 0) ;
 
+	rb_define_singleton_method(cLibmagicRb, "scan", _scan_, -1) ;
+
+	// Databases shared by forked processes
+	rb_define_singleton_method(cLibmagicRb, "preload", _preload_, -1) ;
+	rb_define_singleton_method(cLibmagicRb, "preloaded", _preloaded_, 0) ;
+
+	// Shared database cache used by LibmagicRb.check
+	rb_define_singleton_method(cLibmagicRb, "cache_stats", _cacheStats_, 0) ;
+	rb_define_singleton_method(cLibmagicRb, "cache_evict", _cacheEvict_, 0) ;
+	rb_define_singleton_method(cLibmagicRb, "cache_capacity", _cacheCapacity_, 0) ;
+	rb_define_singleton_method(cLibmagicRb, "cache_capacity=", _setCacheCapacity_, 1) ;
+
+	// Counters and timings
+	rb_define_singleton_method(cLibmagicRb, "stats", _stats_, 0) ;
+	rb_define_singleton_method(cLibmagicRb, "reset_stats", _resetStats_, 0) ;
+
+	// Hooks around the phases of calls
+	rb_define_singleton_method(cLibmagicRb, "trace", _trace_, -1) ;
+	rb_define_singleton_method(cLibmagicRb, "untrace", _untrace_, 0) ;
+
 	/*
 	* Instance Methods
 	*/
@@ -284,9 +456,46 @@ void Init_main() {
 
 	// Load database
 	rb_define_method(cLibmagicRb, "load", _loadGlobal_, 1) ;
+	rb_define_method(cLibmagicRb, "load_buffers", _loadBuffersGlobal_, 1) ;
 
 	// Check for file mimetype
-	rb_define_method(cLibmagicRb, "check", _checkGlobal_, 0) ;
+	rb_define_method(cLibmagicRb, "check", _checkGlobal_, -1) ;
+	rb_define_method(cLibmagicRb, "check_all", _checkAllGlobal_, 0) ;
+	rb_define_alias(cLibmagicRb, "detect", "check_all") ;
+	rb_define_method(cLibmagicRb, "check_mime", _checkMimeGlobal_, 0) ;
+	rb_define_method(cLibmagicRb, "buffer_mime", _bufferMimeGlobal_, 1) ;
+
+	// Check open files
+	rb_define_method(cLibmagicRb, "check_fd", _checkFdGlobal_, -1) ;
+	rb_define_method(cLibmagicRb, "check_io", _checkIOGlobal_, -1) ;
+
+	// Memory mapped checks
+	rb_define_method(cLibmagicRb, "mmap?", _mmapGlobal_, 0) ;
+	rb_define_method(cLibmagicRb, "mmap=", _setMmapGlobal_, 1) ;
+
+	// Fast path for common formats
+	rb_define_method(cLibmagicRb, "fast_path?", _fastPathGlobal_, 0) ;
+	rb_define_method(cLibmagicRb, "fast_path=", _setFastPathGlobal_, 1) ;
+
+	// Interned frozen results
+	rb_define_method(cLibmagicRb, "intern?", _internGlobal_, 0) ;
+	rb_define_method(cLibmagicRb, "intern=", _setInternGlobal_, 1) ;
+
+	// Cache of check() results
+	rb_define_method(cLibmagicRb, "result_cache_stats", _resultCacheStatsGlobal_, 0) ;
+	rb_define_method(cLibmagicRb, "result_cache_capacity", _resultCacheCapacityGlobal_, 0) ;
+	rb_define_method(cLibmagicRb, "result_cache_capacity=", _setResultCacheCapacityGlobal_, 1) ;
+	rb_define_method(cLibmagicRb, "buffer_cache_stats", _bufferCacheStatsGlobal_, 0) ;
+	rb_define_method(cLibmagicRb, "buffer_cache_bytes", _bufferCacheBytesGlobal_, 0) ;
+	rb_define_method(cLibmagicRb, "buffer_cache_bytes=", _setBufferCacheBytesGlobal_, 1) ;
+	rb_define_method(cLibmagicRb, "invalidate", _invalidateGlobal_, -1) ;
+
+	// Counters and timings
+	rb_define_method(cLibmagicRb, "stats", _statsGlobal_, 0) ;
+	rb_define_method(cLibmagicRb, "reset_stats", _resetStatsGlobal_, 0) ;
+
+	// Check many files at once
+	rb_define_method(cLibmagicRb, "check_many", _checkManyGlobal_, 1) ;
 
 	// Get and set params
 	rb_define_method(cLibmagicRb, "getparam", _getParamGlobal_, 1) ;
@@ -297,6 +506,7 @@ void Init_main() {
 	rb_define_method(cLibmagicRb, "mode=", _setflagsGlobal_, 1) ;
 
 	// Miscellaneous
-	rb_define_method(cLibmagicRb, "magic_buffer", _bufferGlobal_, 1) ;
+	rb_define_method(cLibmagicRb, "magic_buffer", _bufferGlobal_, -1) ;
 	rb_define_method(cLibmagicRb, "magic_list", _listGlobal_, 0) ;
+	rb_define_method(cLibmagicRb, "magic_compile", _compileGlobal_, -1) ;
 }
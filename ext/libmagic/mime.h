@@ -0,0 +1,69 @@
+/*
+	Symbolic MIME results (check_mime(), buffer_mime()): frozen [type, charset] pairs
+	of Symbols, like [:"text/plain", :"utf-8"], instead of a String to parse.
+
+	Each cookie has a table from MIME results to their pairs, filled as results come,
+	and emptied when a database is loaded. A database has a few hundred distinct MIME
+	results at most, so once they're seen, a result is a lookup in the table, with no
+	parsing and no allocation. The pairs are pinned by the cookie.
+*/
+
+// Flags that choose what a check returns
+#ifdef MAGIC_EXTENSION
+	#define MAGIC_OUTPUT_FLAGS (MAGIC_MIME | MAGIC_APPLE | MAGIC_EXTENSION)
+#else
+	#define MAGIC_OUTPUT_FLAGS (MAGIC_MIME | MAGIC_APPLE)
+#endif
+
+/*
+	Splits "type/subtype; charset=x" into a frozen [:"type/subtype", :x].
+	The charset is nil when there's none.
+*/
+VALUE mimeSplit(const char *result) {
+	const char *separator = strchr(result, ';') ;
+	long typeLen = separator ? separator - result : (long)strlen(result) ;
+
+	const char *charset = separator ? strstr(separator, "charset=") : NULL ;
+
+	VALUE pair = rb_assoc_new(
+		ID2SYM(rb_intern2(result, typeLen)),
+		charset ? ID2SYM(rb_intern(charset + 8)) : Qnil
+	) ;
+
+	return rb_obj_freeze(pair) ;
+}
+
+/*
+	Returns the pair of a result, from the table if it's been seen before.
+	The table is created on first use, keys are malloc'ed copies of the results.
+*/
+VALUE mimeLookup(st_table **table, const char *result) {
+	if (!result) return Qnil ;
+	if (!*table) *table = st_init_strtable() ;
+
+	st_data_t value ;
+	if (st_lookup(*table, (st_data_t)result, &value)) return (VALUE)value ;
+
+	VALUE pair = mimeSplit(result) ;
+
+	char *key = strdup(result) ;
+	if (key) st_insert(*table, (st_data_t)key, (st_data_t)pair) ;
+
+	return pair ;
+}
+
+static int mimeFreeKey(st_data_t key, st_data_t value, st_data_t arg) {
+	free((char *)key) ;
+	return ST_DELETE ;
+}
+
+void mimeTableClear(st_table *table) {
+	if (table) st_foreach(table, mimeFreeKey, 0) ;
+}
+
+void mimeTableFree(st_table *table) {
+	if (!table) return ;
+
+	mimeTableClear(table) ;
+	st_free_table(table) ;
+}
@@ -0,0 +1,121 @@
+/*
+	Opt-in check of regular files through a memory map (LibmagicRb.new(mmap: true)).
+
+	libmagic never looks past the first MAGIC_PARAM_BYTES_MAX bytes, so only that prefix
+	is mapped, populated up front, and handed to magic_buffer(). The pages come straight
+	from the page cache, instead of being read into libmagic's own buffer.
+
+	Anything else (directories, devices, empty files, symlinks without MAGIC_SYMLINK,
+	files that can't be opened or mapped) goes through magic_file() as usual.
+	Formats libmagic reads through the descriptor (ELF, CDF) are checked from the open file.
+
+	magic_buffer() has no file to read the end of, so rules at offsets from the end of the
+	file (negative offsets) don't match the mapped prefix, and those files can get another
+	answer than from magic_file().
+*/
+
+// Bytes libmagic looks at, at most
+size_t magicBytesMax(magic_t magic) {
+	#if MAGIC_VERSION > 525 && defined(MAGIC_PARAM_BYTES_MAX)
+		size_t value ;
+		if (magic_getparam(magic, MAGIC_PARAM_BYTES_MAX, &value) == 0) return value ;
+	#endif
+
+	// libmagic without parameters read the first MiB
+	return 1 << 20 ;
+}
+
+/*
+	libmagic reads more than the first bytes of some formats through the descriptor, like
+	the program and section headers of ELF files, and the sectors of CDF (OLE2) files, the
+	.doc, .xls and .msi ones. Those have to be checked from the file.
+*/
+char magicNeedsDescriptor(const unsigned char *buffer, size_t length) {
+	return (length >= 4 && memcmp(buffer, "\177ELF", 4) == 0) ||
+		(length >= 8 && memcmp(buffer, "\320\317\021\340\241\261\032\341", 8) == 0) ;
+}
+
+#if defined(HAVE_SYS_MMAN_H) && defined(HAVE_MMAP)
+#include <sys/mman.h>
+#include <fcntl.h>
+
+int magicMapFlags(magic_t magic) {
+	int flags = O_RDONLY | O_NONBLOCK | O_NOCTTY ;
+
+	#ifdef O_CLOEXEC
+		flags |= O_CLOEXEC ;
+	#endif
+
+	#ifdef HAVE_MAGIC_GETFLAGS
+		// libmagic describes the link itself without MAGIC_SYMLINK
+		if (!(magic_getflags(magic) & MAGIC_SYMLINK)) flags |= O_NOFOLLOW ;
+
+		// Reading through a map can't preserve the access time
+		if (magic_getflags(magic) & MAGIC_PRESERVE_ATIME) return -1 ;
+	#else
+		flags |= O_NOFOLLOW ;
+	#endif
+
+	return flags ;
+}
+
+void *mmapRun(void *data) {
+	magicCall_t *call = data ;
+	int flags = magicMapFlags(call->magic) ;
+	int fd = flags == -1 ? -1 : open(call->path, flags) ;
+
+	if (fd >= 0) {
+		struct stat statbuf ;
+		void *map = MAP_FAILED ;
+		size_t length = 0 ;
+
+		if (fstat(fd, &statbuf) == 0 && S_ISREG(statbuf.st_mode) && statbuf.st_size > 0) {
+			length = magicBytesMax(call->magic) ;
+			if ((unsigned long long)statbuf.st_size < length) length = statbuf.st_size ;
+
+			#ifdef MAP_POPULATE
+				map = mmap(NULL, length, PROT_READ, MAP_PRIVATE | MAP_POPULATE, fd, 0) ;
+			#else
+				map = mmap(NULL, length, PROT_READ, MAP_PRIVATE, fd, 0) ;
+
+				#ifdef MADV_WILLNEED
+					if (map != MAP_FAILED) madvise(map, length, MADV_WILLNEED) ;
+				#endif
+			#endif
+		}
+
+		if (map != MAP_FAILED && magicNeedsDescriptor(map, length)) {
+			munmap(map, length) ;
+
+			call->result = magic_descriptor(call->magic, fd) ;
+			close(fd) ;
+			return NULL ;
+		}
+
+		close(fd) ;
+
+		if (map != MAP_FAILED) {
+			call->result = magic_buffer(call->magic, map, length) ;
+			munmap(map, length) ;
+			return NULL ;
+		}
+	}
+
+	call->result = magic_file(call->magic, call->path) ;
+	return NULL ;
+}
+
+const char *magicMapNoGVL(magic_t magic, const char *path) {
+	magicCall_t call = { .op = MAGIC_CALL_FILE, .magic = magic, .path = path } ;
+	magicWithoutGVL(mmapRun, &call, magicCallUnblock, &call) ;
+	return call.result ;
+}
+#else
+void *mmapRun(void *data) {
+	return magicCallRun(data) ;
+}
+
+const char *magicMapNoGVL(magic_t magic, const char *path) {
+	return magicFileNoGVL(magic, path) ;
+}
+#endif
@@ -0,0 +1,402 @@
+/*
+	Calls to libmagic that can take long (parsing the database, reading and matching files)
+	are run without the GVL, so other ruby threads can run in parallel.
+
+	Any pointer passed here must stay valid while the GVL is released.
+	So pass frozen copies (rb_str_new_frozen()) of ruby strings, and keep them guarded.
+
+	Under a Fiber scheduler (non-blocking fibers, like with the async gem or Falcon), releasing
+	the GVL isn't enough: the thread is the scheduler's, and every fiber waits for the call.
+	Then calls are queued to a pool of native threads, and the fiber waits for its call on a pipe
+	with rb_io_wait(), which hands the wait to the scheduler, so it runs other fibers meanwhile.
+
+	The pool has up to FIBER_CALL_WORKERS_PER_CPU threads per CPU, started as calls need them,
+	and stopped after FIBER_CALL_IDLE_SECONDS without any. At most FIBER_CALL_PENDING calls are
+	queued or running, each with a pipe. Past that, calls run without the GVL on the fiber's
+	thread, like without a scheduler.
+*/
+#if defined(HAVE_PTHREAD_H) && defined(HAVE_RUBY_FIBER_SCHEDULER_H) && defined(HAVE_RB_FIBER_SCHEDULER_CURRENT) && defined(HAVE_RB_IO_WAIT)
+#define HAVE_FIBER_CALL 1
+#include <pthread.h>
+#include <signal.h>
+#include <fcntl.h>
+#include "ruby/fiber/scheduler.h"
+
+#define FIBER_CALL_WORKERS_PER_CPU 2
+#define FIBER_CALL_PENDING 256
+#define FIBER_CALL_IDLE_SECONDS 10
+
+typedef struct fiberCall {
+	void *(*func)(void *) ;
+	void *data ;
+	rb_unblock_function_t *unblock ;
+	void *unblockData ;
+
+	int fds[2] ;
+	volatile VALUE io ;
+	pthread_cond_t cond ;
+
+	// Set under the lock of the pool
+	char started ;
+	volatile char done ;
+	char joined ;
+
+	struct fiberCall *next ;
+} fiberCall_t ;
+
+// Process wide, workers don't touch ruby objects
+struct {
+	pthread_mutex_t lock ;
+	pthread_cond_t wake ;
+
+	// Calls no worker took yet
+	fiberCall_t *head, *tail ;
+	unsigned int queued ;
+
+	unsigned int workers, idle ;
+
+	// Calls queued or running
+	unsigned int pending ;
+} fiberPool = { .lock = PTHREAD_MUTEX_INITIALIZER, .wake = PTHREAD_COND_INITIALIZER } ;
+
+void *fiberPoolWorker(void *data) {
+	pthread_mutex_lock(&fiberPool.lock) ;
+
+	for(;;) {
+		while (!fiberPool.head) {
+			struct timespec deadline ;
+			clock_gettime(CLOCK_REALTIME, &deadline) ;
+			deadline.tv_sec += FIBER_CALL_IDLE_SECONDS ;
+
+			fiberPool.idle++ ;
+			int err = pthread_cond_timedwait(&fiberPool.wake, &fiberPool.lock, &deadline) ;
+			fiberPool.idle-- ;
+
+			if (err == ETIMEDOUT && !fiberPool.head) {
+				fiberPool.workers-- ;
+				pthread_mutex_unlock(&fiberPool.lock) ;
+				return NULL ;
+			}
+		}
+
+		fiberCall_t *f = fiberPool.head ;
+		fiberPool.head = f->next ;
+		if (!fiberPool.head) fiberPool.tail = NULL ;
+
+		fiberPool.queued-- ;
+		f->started = 1 ;
+		pthread_mutex_unlock(&fiberPool.lock) ;
+
+		f->func(f->data) ;
+
+		pthread_mutex_lock(&fiberPool.lock) ;
+		f->done = 1 ;
+
+		// Wakes the fiber up, the pipe has room for it. The fiber closes it once joined, under the lock.
+		char done = 1 ;
+		while (write(f->fds[1], &done, 1) < 0 && errno == EINTR) ;
+		pthread_cond_signal(&f->cond) ;
+	}
+}
+
+// Threads of the pool don't exist in a forked child, nor their calls
+void fiberPoolPrepare(void) { pthread_mutex_lock(&fiberPool.lock) ; }
+void fiberPoolParent(void) { pthread_mutex_unlock(&fiberPool.lock) ; }
+
+void fiberPoolChild(void) {
+	pthread_mutex_init(&fiberPool.lock, NULL) ;
+	pthread_cond_init(&fiberPool.wake, NULL) ;
+
+	fiberPool.head = fiberPool.tail = NULL ;
+	fiberPool.queued = fiberPool.workers = fiberPool.idle = fiberPool.pending = 0 ;
+}
+
+// Starts a worker when none is left idle, with the lock held. Returns 0 if the pool has no worker to run calls.
+int fiberPoolGrow(void) {
+	long cpus = sysconf(_SC_NPROCESSORS_ONLN) ;
+	if (cpus < 1) cpus = 1 ;
+
+	if (fiberPool.idle > fiberPool.queued || fiberPool.workers >= cpus * FIBER_CALL_WORKERS_PER_CPU) return fiberPool.workers > 0 ;
+
+	// Signals are for ruby threads to handle
+	sigset_t all, old ;
+	sigfillset(&all) ;
+	pthread_sigmask(SIG_SETMASK, &all, &old) ;
+
+	pthread_t thread ;
+	int err = pthread_create(&thread, NULL, fiberPoolWorker, NULL) ;
+	pthread_sigmask(SIG_SETMASK, &old, NULL) ;
+
+	if (!err) {
+		pthread_detach(thread) ;
+		fiberPool.workers++ ;
+	}
+
+	return fiberPool.workers > 0 ;
+}
+
+static VALUE fiberCallWait(VALUE data) {
+	fiberCall_t *f = (fiberCall_t *)data ;
+	while (!f->done) rb_io_wait(f->io, RB_INT2NUM(RUBY_IO_READABLE), Qnil) ;
+	return Qnil ;
+}
+
+void *fiberCallJoinWait(void *data) {
+	fiberCall_t *f = data ;
+
+	pthread_mutex_lock(&fiberPool.lock) ;
+	while (!f->done) pthread_cond_wait(&f->cond, &fiberPool.lock) ;
+	pthread_mutex_unlock(&fiberPool.lock) ;
+
+	f->joined = 1 ;
+	return NULL ;
+}
+
+static VALUE fiberCallCheckInts(VALUE data) {
+	rb_thread_check_ints() ;
+	return Qnil ;
+}
+
+static VALUE fiberCallJoin(VALUE data) {
+	fiberCall_t *f = (fiberCall_t *)data ;
+
+	pthread_mutex_lock(&fiberPool.lock) ;
+	char started = f->started ;
+
+	// The fiber was stopped before a worker took the call, it's just dropped
+	if (!started) {
+		fiberCall_t **link = &fiberPool.head, *previous = NULL ;
+
+		while (*link != f) {
+			previous = *link ;
+			link = &previous->next ;
+		}
+
+		*link = f->next ;
+		if (fiberPool.tail == f) fiberPool.tail = previous ;
+
+		fiberPool.queued-- ;
+		f->done = f->joined = 1 ;
+	}
+
+	pthread_mutex_unlock(&fiberPool.lock) ;
+
+	// The fiber was stopped while waiting, the call still has pointers into the frame of the fiber
+	if (!f->done) f->unblock(f->unblockData) ;
+
+	/*
+		The call may still be running, other threads run meanwhile. The wait is skipped with
+		interrupts pending: they're handled, and the first one raised once the call is done.
+	*/
+	int state = 0 ;
+	volatile VALUE error = Qnil ;
+
+	while (!f->joined) {
+		rb_thread_call_without_gvl2(fiberCallJoinWait, f, NULL, NULL) ;
+		if (f->joined) break ;
+
+		int raised = 0 ;
+		rb_protect(fiberCallCheckInts, Qnil, &raised) ;
+
+		if (raised && !state) {
+			state = raised ;
+			error = rb_errinfo() ;
+		}
+	}
+
+	pthread_mutex_lock(&fiberPool.lock) ;
+	fiberPool.pending-- ;
+	close(f->fds[1]) ;
+	pthread_mutex_unlock(&fiberPool.lock) ;
+
+	rb_io_close(f->io) ;
+	pthread_cond_destroy(&f->cond) ;
+
+	if (state) {
+		if (!NIL_P(error)) rb_set_errinfo(error) ;
+		rb_jump_tag(state) ;
+	}
+
+	return Qnil ;
+}
+
+/*
+	Runs func(data) on a thread of the pool, while the fiber waits for it through the scheduler.
+	Returns 0 if the call can't be queued, without running func.
+*/
+int fiberCall(void *(*func)(void *), void *data, rb_unblock_function_t *unblock, void *unblockData) {
+	fiberCall_t f = { .func = func, .data = data, .unblock = unblock, .unblockData = unblockData } ;
+
+	pthread_mutex_lock(&fiberPool.lock) ;
+	char full = fiberPool.pending >= FIBER_CALL_PENDING ;
+	if (!full) fiberPool.pending++ ;
+	pthread_mutex_unlock(&fiberPool.lock) ;
+
+	if (full) return 0 ;
+
+	if (rb_pipe(f.fds)) {
+		pthread_mutex_lock(&fiberPool.lock) ;
+		fiberPool.pending-- ;
+		pthread_mutex_unlock(&fiberPool.lock) ;
+
+		return 0 ;
+	}
+
+	rb_update_max_fd(f.fds[1]) ;
+	f.io = rb_io_fdopen(f.fds[0], O_RDONLY, NULL) ;
+	pthread_cond_init(&f.cond, NULL) ;
+
+	pthread_mutex_lock(&fiberPool.lock) ;
+	int queued = fiberPoolGrow() ;
+
+	if (queued) {
+		if (fiberPool.tail) fiberPool.tail->next = &f ;
+		else fiberPool.head = &f ;
+
+		fiberPool.tail = &f ;
+		fiberPool.queued++ ;
+		pthread_cond_signal(&fiberPool.wake) ;
+	} else {
+		fiberPool.pending-- ;
+		close(f.fds[1]) ;
+	}
+
+	pthread_mutex_unlock(&fiberPool.lock) ;
+
+	if (!queued) {
+		rb_io_close(f.io) ;
+		pthread_cond_destroy(&f.cond) ;
+		return 0 ;
+	}
+
+	rb_ensure(fiberCallWait, (VALUE)&f, fiberCallJoin, (VALUE)&f) ;
+
+	return 1 ;
+}
+#endif
+
+/*
+	Runs func(data) without the GVL, or on a native thread under a Fiber scheduler.
+	unblock(unblockData) is called when ruby interrupts the call.
+*/
+void magicWithoutGVL(void *(*func)(void *), void *data, rb_unblock_function_t *unblock, void *unblockData) {
+	#ifdef HAVE_FIBER_CALL
+		if (rb_fiber_scheduler_current() != Qnil && fiberCall(func, data, unblock, unblockData)) return ;
+	#endif
+
+	#ifdef HAVE_RB_THREAD_CALL_WITHOUT_GVL
+		rb_thread_call_without_gvl(func, data, unblock, unblockData) ;
+	#else
+		func(data) ;
+	#endif
+}
+#define MAGIC_CALL_FILE 0
+#define MAGIC_CALL_BUFFER 1
+#define MAGIC_CALL_LOAD 2
+#define MAGIC_CALL_CHECK 3
+#define MAGIC_CALL_DESCRIPTOR 4
+#define MAGIC_CALL_LOAD_BUFFERS 5
+
+typedef struct {
+	char op ;
+	volatile char interrupted ;
+
+	magic_t magic ;
+	const char *path ;
+	const void *buffer ;
+	size_t length ;
+	int fd ;
+
+	void **buffers ;
+	size_t *sizes ;
+
+	const char *result ;
+	int status ;
+} magicCall_t ;
+
+void *magicCallRun(void *data) {
+	magicCall_t *call = data ;
+
+	switch(call->op) {
+		case MAGIC_CALL_FILE:
+			call->result = magic_file(call->magic, call->path) ;
+			break ;
+
+		case MAGIC_CALL_BUFFER:
+			call->result = magic_buffer(call->magic, call->buffer, call->length) ;
+			break ;
+
+		case MAGIC_CALL_LOAD:
+			call->status = magic_load(call->magic, call->path) ;
+			break ;
+
+		case MAGIC_CALL_CHECK:
+			call->status = magic_check(call->magic, call->path) ;
+			break ;
+
+		case MAGIC_CALL_DESCRIPTOR:
+			call->result = magic_descriptor(call->magic, call->fd) ;
+			break ;
+
+		#ifdef HAVE_MAGIC_LOAD_BUFFERS
+		case MAGIC_CALL_LOAD_BUFFERS:
+			call->status = magic_load_buffers(call->magic, call->buffers, call->sizes, call->length) ;
+			break ;
+		#endif
+	}
+
+	return NULL ;
+}
+
+/*
+	libmagic has no way to abort a call half way, and killing the thread
+	would leave the cookie broken. So the unblocking function only records
+	the interrupt; the call runs to completion, and ruby handles the
+	interrupt (Thread#raise, Thread#kill, signals) right after it returns.
+*/
+void magicCallUnblock(void *data) {
+	magicCall_t *call = data ;
+	call->interrupted = 1 ;
+}
+
+void magicCallWithoutGVL(magicCall_t *call) {
+	magicWithoutGVL(magicCallRun, call, magicCallUnblock, call) ;
+}
+
+const char *magicFileNoGVL(magic_t magic, const char *path) {
+	magicCall_t call = { .op = MAGIC_CALL_FILE, .magic = magic, .path = path } ;
+	magicCallWithoutGVL(&call) ;
+	return call.result ;
+}
+
+const char *magicBufferNoGVL(magic_t magic, const void *buffer, size_t length) {
+	magicCall_t call = { .op = MAGIC_CALL_BUFFER, .magic = magic, .buffer = buffer, .length = length } ;
+	magicCallWithoutGVL(&call) ;
+	return call.result ;
+}
+
+int magicLoadNoGVL(magic_t magic, const char *path) {
+	magicCall_t call = { .op = MAGIC_CALL_LOAD, .magic = magic, .path = path } ;
+	magicCallWithoutGVL(&call) ;
+	return call.status ;
+}
+
+int magicCheckNoGVL(magic_t magic, const char *path) {
+	magicCall_t call = { .op = MAGIC_CALL_CHECK, .magic = magic, .path = path } ;
+	magicCallWithoutGVL(&call) ;
+	return call.status ;
+}
+
+const char *magicDescriptorNoGVL(magic_t magic, int fd) {
+	magicCall_t call = { .op = MAGIC_CALL_DESCRIPTOR, .magic = magic, .fd = fd } ;
+	magicCallWithoutGVL(&call) ;
+	return call.result ;
+}
+
+#ifdef HAVE_MAGIC_LOAD_BUFFERS
+int magicLoadBuffersNoGVL(magic_t magic, void **buffers, size_t *sizes, size_t count) {
+	magicCall_t call = { .op = MAGIC_CALL_LOAD_BUFFERS, .magic = magic, .buffers = buffers, .sizes = sizes, .length = count } ;
+	magicCallWithoutGVL(&call) ;
+	return call.status ;
+}
+#endif
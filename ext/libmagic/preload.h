@@ -0,0 +1,291 @@
+/*
+	Database files, and compiled databases preloaded once per process with LibmagicRb.preload().
+
+	A preloaded database is mapped read only and shared (MAP_SHARED), so its pages belong to
+	the page cache, not to the process. Cookies then load it with magic_load_buffers(), which
+	reads the map in place instead of reading the file into memory of their own. Processes
+	forked after preloading inherit the map, so all of them share the same pages.
+*/
+#if defined(HAVE_SYS_MMAN_H) && defined(HAVE_MMAP) && defined(HAVE_MAGIC_LOAD_BUFFERS)
+#define HAVE_PRELOAD 1
+#include <sys/mman.h>
+#include <fcntl.h>
+#endif
+
+long long statMtime(struct stat *statbuf) {
+	#if defined(HAVE_STRUCT_STAT_ST_MTIM)
+		return statbuf->st_mtim.tv_sec * 1000000000LL + statbuf->st_mtim.tv_nsec ;
+	#elif defined(HAVE_STRUCT_STAT_ST_MTIMESPEC)
+		return statbuf->st_mtimespec.tv_sec * 1000000000LL + statbuf->st_mtimespec.tv_nsec ;
+	#else
+		return statbuf->st_mtime * 1000000000LL ;
+	#endif
+}
+
+/*
+	Writes the path of the compiled system database to compiled.
+	The default path is a colon separated list (like /etc/magic:/usr/share/misc/magic),
+	the first entry that has a compiled database is used.
+	Returns 0 on success.
+*/
+int dbDefaultCompiled(char *compiled, size_t size) {
+	#if MAGIC_VERSION > 525
+		const char *defaultPath = magic_getpath(NULL, 0) ;
+		if (!defaultPath) return -1 ;
+
+		struct stat statbuf ;
+		const char *entry = defaultPath ;
+
+		while (*entry) {
+			const char *end = strchr(entry, ':') ;
+			int len = end ? (int)(end - entry) : (int)strlen(entry) ;
+			char isCompiled = len > 4 && strncmp(entry + len - 4, ".mgc", 4) == 0 ;
+
+			snprintf(compiled, size, "%.*s%s", len, entry, isCompiled ? "" : ".mgc") ;
+			if (len && stat(compiled, &statbuf) == 0 && !S_ISDIR(statbuf.st_mode)) return 0 ;
+
+			if (!end) break ;
+			entry = end + 1 ;
+		}
+	#endif
+
+	return -1 ;
+}
+
+/*
+	Stats the database file.
+	When the path is NULL, stats the compiled system database libmagic picks up.
+	Returns 0 on success.
+*/
+int dbStat(const char *databasePath, struct stat *statbuf) {
+	if (databasePath) return stat(databasePath, statbuf) ;
+
+	char compiled[PATH_MAX] ;
+	if (dbDefaultCompiled(compiled, sizeof(compiled))) return -1 ;
+	return stat(compiled, statbuf) ;
+}
+
+// The first 4 bytes of a compiled database, in the byte order it was compiled for
+#define MAGIC_DB_MAGICNO 0xF11E041C
+
+/*
+	Preloaded databases, keyed by the path they were asked for (NULL for the system database).
+	Maps are never unmapped, cookies may still be using them. A preload replaced because
+	the file changed is just taken off the list.
+
+	Preloads are shared by all Ractors, the list is only touched while holding preloadsLock.
+	Fields of a preload don't change once it's on the list, but next.
+*/
+typedef struct preload {
+	char *path ;
+	void *map ;
+	size_t size ;
+
+	dev_t dev ;
+	ino_t ino ;
+	long long mtime ;
+
+	struct preload *next ;
+} preload_t ;
+
+preload_t *preloads = NULL ;
+ractorLock_t preloadsLock ;
+
+char preloadPathEqual(const char *databasePath, preload_t *preload) {
+	return (!databasePath && !preload->path) ||
+		(databasePath && preload->path && strcmp(databasePath, preload->path) == 0) ;
+}
+
+/*
+	Returns the preload of the database path, if the file is still the one that was mapped.
+	statbuf is the current stat of the database file.
+*/
+preload_t *preloadFind(const char *databasePath, struct stat *statbuf) {
+	preload_t *preload = NULL ;
+	ractorLock(&preloadsLock) ;
+
+	for(preload_t *p = preloads ; p ; p = p->next) {
+		if (!preloadPathEqual(databasePath, p)) continue ;
+
+		if (statbuf->st_dev == p->dev &&
+			statbuf->st_ino == p->ino &&
+			(size_t)statbuf->st_size == p->size &&
+			statMtime(statbuf) == p->mtime
+		) preload = p ;
+
+		break ;
+	}
+
+	ractorUnlock(&preloadsLock) ;
+	return preload ;
+}
+
+/*
+	Loads a preloaded database into magic.
+	Returns 0 on success, like magic_load().
+*/
+int preloadLoad(magic_t magic, preload_t *preload) {
+	#ifdef HAVE_PRELOAD
+		return magicLoadBuffersNoGVL(magic, &preload->map, &preload->size, 1) ;
+	#else
+		return -1 ;
+	#endif
+}
+
+/*
+	Maps a compiled database once for the whole process (and the processes forked from it),
+	so cookies loading that database share its pages instead of reading it each. For example:
+
+		> LibmagicRb.preload
+		# => 8281024
+
+		> LibmagicRb.check(file: '/usr/share/dict/words')
+		# => "text/plain; charset=utf-8"
+
+	Call it in the master process before forking workers (Puma's before_fork, Unicorn's before_fork),
+	all the workers then check with the same pages of the database.
+
+	[db] The path of a compiled database (.mgc). Defaults to the system database.
+	For the system database, that's the compiled database of the default path (MAGIC
+	environment variable, or the path libmagic was built with); text magic files in it,
+	like /etc/magic, aren't part of the preload.
+
+	Cookies and LibmagicRb.check() with the same db (nil for the system database) use the preload,
+	as long as the file isn't replaced or modified. Preloading the same file again does nothing.
+
+	Raises LibmagicRb::InvalidDBError if the file isn't a compiled database of this machine.
+	Returns the number of bytes mapped.
+*/
+static VALUE _preload_(int argc, VALUE *argv, volatile VALUE obj) {
+	VALUE db ;
+	rb_scan_args(argc, argv, "01", &db) ;
+
+	#ifdef HAVE_PRELOAD
+		if (!NIL_P(db) && !RB_TYPE_P(db, T_STRING)) {
+			rb_raise(rb_eArgError, "Database name must be an instance of String.") ;
+		}
+
+		char *databasePath = NIL_P(db) ? NULL : StringValueCStr(db) ;
+		char compiled[PATH_MAX] ;
+		char *mapPath = databasePath ;
+
+		if (!mapPath) {
+			if (dbDefaultCompiled(compiled, sizeof(compiled))) rb_raise(rb_eFileNotFoundError, "Can't find the system database") ;
+			mapPath = compiled ;
+		}
+
+		dbPathReadable(mapPath) ;
+
+		int flags = O_RDONLY ;
+		#ifdef O_CLOEXEC
+			flags |= O_CLOEXEC ;
+		#endif
+
+		int fd = open(mapPath, flags) ;
+		if (fd < 0) rb_raise(fileErrorClass(errno), "%s", mapPath) ;
+
+		struct stat statbuf ;
+		if (fstat(fd, &statbuf)) {
+			int err = errno ;
+			close(fd) ;
+			rb_syserr_fail(err, mapPath) ;
+		}
+
+		preload_t *existing = preloadFind(databasePath, &statbuf) ;
+		if (existing) {
+			close(fd) ;
+			return SIZET2NUM(existing->size) ;
+		}
+
+		int mapFlags = MAP_SHARED ;
+		#ifdef MAP_POPULATE
+			mapFlags |= MAP_POPULATE ;
+		#endif
+
+		size_t size = statbuf.st_size ;
+		void *map = size < 4 ? MAP_FAILED : mmap(NULL, size, PROT_READ, mapFlags, fd, 0) ;
+
+		close(fd) ;
+
+		// libmagic byte swaps foreign databases in place, which a read only map can't take
+		if (map == MAP_FAILED || *(uint32_t *)map != MAGIC_DB_MAGICNO) {
+			if (map != MAP_FAILED) munmap(map, size) ;
+			rb_raise(rb_eInvalidDBError, "%s is not a compiled database of this machine", mapPath) ;
+		}
+
+		preload_t *preload = calloc(1, sizeof(preload_t)) ;
+		if (!preload) {
+			munmap(map, size) ;
+			rb_raise(rb_eNoMemError, "Failed to allocate the preload") ;
+		}
+
+		preload->path = databasePath ? strdup(databasePath) : NULL ;
+		preload->map = map ;
+		preload->size = size ;
+		preload->dev = statbuf.st_dev ;
+		preload->ino = statbuf.st_ino ;
+		preload->mtime = statMtime(&statbuf) ;
+
+		// Loads it once, so a broken database raises here, and not in every cookie
+		magic_t magic = magic_open(MAGIC_NONE) ;
+		int status = magic ? preloadLoad(magic, preload) : -1 ;
+		if (magic) magic_close(magic) ;
+
+		if (status) {
+			munmap(map, size) ;
+			free(preload->path) ;
+			free(preload) ;
+			rb_raise(rb_eInvalidDBError, "%s", mapPath) ;
+		}
+
+		ractorLock(&preloadsLock) ;
+
+		// A preload of the same path for an older file is replaced
+		for(preload_t **p = &preloads ; *p ; p = &(*p)->next) {
+			if (preloadPathEqual(databasePath, *p)) {
+				*p = (*p)->next ;
+				break ;
+			}
+		}
+
+		preload->next = preloads ;
+		preloads = preload ;
+
+		ractorUnlock(&preloadsLock) ;
+
+		return SIZET2NUM(size) ;
+	#else
+		rb_raise(rb_eNotImpError, "LibmagicRb.preload() is not supported on this platform") ;
+	#endif
+}
+
+/*
+	Returns a Hash of the preloaded databases and their sizes in bytes, nil is the system database:
+
+		> LibmagicRb.preloaded
+		# => {nil=>8281024}
+*/
+static VALUE _preloaded_(volatile VALUE obj) {
+	long count = 0 ;
+
+	ractorLock(&preloadsLock) ;
+	for(preload_t *p = preloads ; p ; p = p->next) count++ ;
+	ractorUnlock(&preloadsLock) ;
+
+	// Preloads are never freed, they're listed from a copy of the list, without the lock
+	VALUE listTmp ;
+	preload_t **list = ALLOCV_N(preload_t *, listTmp, count + 1) ;
+	long listed = 0 ;
+
+	ractorLock(&preloadsLock) ;
+	for(preload_t *p = preloads ; p && listed < count ; p = p->next) list[listed++] = p ;
+	ractorUnlock(&preloadsLock) ;
+
+	VALUE hash = rb_hash_new() ;
+
+	for(long i = 0 ; i < listed ; i++)
+		rb_hash_aset(hash, list[i]->path ? rb_str_new_cstr(list[i]->path) : Qnil, SIZET2NUM(list[i]->size)) ;
+
+	ALLOCV_END(listTmp) ;
+	return hash ;
+}
@@ -0,0 +1,35 @@
+/*
+	Ractors.
+
+	The extension is Ractor safe, so LibmagicRb can be used from any Ractor, each checking
+	files in parallel with a GVL of its own.
+
+	Cookies aren't shareable, each Ractor opens cookies of its own (LibmagicRb.local() keeps one
+	per Ractor). What configures them is shareable: frozen db paths, modes and options, frozen
+	Strings given to load_buffers(), and databases preloaded with LibmagicRb.preload(), which
+	cookies of every Ractor load from the same map.
+
+	State of the whole process is guarded by native locks, as GVLs don't exclude other Ractors:
+	the database cache of LibmagicRb.check() (dbcache.h), and the list of preloads (preload.h).
+	Nothing allocates Ruby objects or raises while holding them, a GC waiting for all Ractors
+	could deadlock otherwise. Process stats are atomic (stats.h), and the block of
+	LibmagicRb.trace() belongs to the Ractor that set it (trace.h).
+*/
+#if defined(HAVE_RB_EXT_RACTOR_SAFE) && defined(HAVE_RUBY_RACTOR_H) && defined(HAVE_RUBY_THREAD_NATIVE_H)
+#define HAVE_RACTOR 1
+#include "ruby/ractor.h"
+#include "ruby/thread_native.h"
+
+typedef rb_nativethread_lock_t ractorLock_t ;
+
+#define ractorLockInit(lock) rb_nativethread_lock_initialize(lock)
+#define ractorLock(lock) rb_nativethread_lock_lock(lock)
+#define ractorUnlock(lock) rb_nativethread_lock_unlock(lock)
+#else
+// Without Ractors, the GVL guards the state of the process
+typedef char ractorLock_t ;
+
+#define ractorLockInit(lock)
+#define ractorLock(lock)
+#define ractorUnlock(lock)
+#endif
@@ -0,0 +1,318 @@
+/*
+	Optional per cookie caches of results.
+
+	check() results (LibmagicRb.new(cache: n)) are keyed by the file's identity
+	(dev, inode, size, mtime, ctime) and the cookie's flags. A file that's modified, replaced,
+	or chmod'ed gets a new key, so a hit costs a stat() of the file instead of a magic pass.
+
+	magic_buffer() results (LibmagicRb.new(buffer_cache: bytes)) are keyed by a 128 bit hash
+	and the length of the bytes checked, and the cookie's flags. A hit costs hashing the bytes.
+
+	Both are cleared whenever the database or a parameter of the cookie changes.
+
+	Entries live in a hash table for lookups, and a doubly linked list for the LRU order.
+	A cache is bounded by a number of entries, and a number of bytes of memory.
+	The caches are only touched while holding the cookie's lock.
+*/
+typedef struct {
+	// dev, inode, size, mtime, ctime of a file, or two hashes and the length of a buffer
+	unsigned long long words[5] ;
+	unsigned int flags ;
+} resultKey_t ;
+
+typedef struct resultEntry {
+	resultKey_t key ;
+	char *result ;
+
+	struct resultEntry *hashNext ;
+	struct resultEntry *newer ;
+	struct resultEntry *older ;
+} resultEntry_t ;
+
+typedef struct {
+	resultEntry_t **buckets ;
+	unsigned long bucketCount ;
+
+	resultEntry_t *newest ;
+	resultEntry_t *oldest ;
+
+	unsigned long size ;
+	unsigned long capacity ;
+
+	size_t bytes ;
+	size_t maxBytes ;
+
+	unsigned long long hits ;
+	unsigned long long misses ;
+	unsigned long long evictions ;
+} resultCache_t ;
+
+long long statCtime(struct stat *statbuf) {
+	#if defined(HAVE_STRUCT_STAT_ST_MTIM)
+		return statbuf->st_ctim.tv_sec * 1000000000LL + statbuf->st_ctim.tv_nsec ;
+	#elif defined(HAVE_STRUCT_STAT_ST_MTIMESPEC)
+		return statbuf->st_ctimespec.tv_sec * 1000000000LL + statbuf->st_ctimespec.tv_nsec ;
+	#else
+		return statbuf->st_ctime * 1000000000LL ;
+	#endif
+}
+
+/*
+	Fills the key of a path. Symlinks are followed only with MAGIC_SYMLINK, like libmagic does.
+	Returns 0 if the path is a regular file that can be cached.
+*/
+int resultKey(const char *path, unsigned int flags, resultKey_t *key) {
+	struct stat statbuf ;
+	int status = (flags & MAGIC_SYMLINK) ? stat(path, &statbuf) : lstat(path, &statbuf) ;
+
+	if (status || !S_ISREG(statbuf.st_mode)) return -1 ;
+
+	memset(key, 0, sizeof(resultKey_t)) ;
+	key->words[0] = statbuf.st_dev ;
+	key->words[1] = statbuf.st_ino ;
+	key->words[2] = statbuf.st_size ;
+	key->words[3] = statMtime(&statbuf) ;
+	key->words[4] = statCtime(&statbuf) ;
+	key->flags = flags ;
+
+	return 0 ;
+}
+
+/*
+	128 bit hash of a buffer, in the style of wyhash: 8 byte words are multiplied
+	into 128 bit products and folded. Two lanes with their own secrets make the
+	two halves, so the bytes are read once.
+*/
+static inline uint64_t hashMum(uint64_t a, uint64_t b) {
+	#ifdef __SIZEOF_INT128__
+		__uint128_t r = (__uint128_t)a * b ;
+		return (uint64_t)r ^ (uint64_t)(r >> 64) ;
+	#else
+		uint64_t ha = a >> 32, la = (uint32_t)a, hb = b >> 32, lb = (uint32_t)b ;
+		uint64_t rh = ha * hb, rm0 = ha * lb, rm1 = hb * la, rl = la * lb ;
+		uint64_t t = rl + (rm0 << 32), c = t < rl ;
+		uint64_t lo = t + (rm1 << 32) ;
+		c += lo < t ;
+		return lo ^ (rh + (rm0 >> 32) + (rm1 >> 32) + c) ;
+	#endif
+}
+
+static inline uint64_t hashRead8(const unsigned char *p) {
+	uint64_t v ;
+	memcpy(&v, p, 8) ;
+	return v ;
+}
+
+void bufferHash(const void *data, size_t len, uint64_t out[2]) {
+	static const uint64_t secret[4] = {
+		0xa0761d6478bd642fULL, 0xe7037ed1a0b428dbULL, 0x8ebc6af09c88c6e3ULL, 0x589965cc75374cc3ULL
+	} ;
+
+	const unsigned char *p = data ;
+	uint64_t a = secret[0] ^ len, b = secret[1] ^ len ;
+	size_t i = len ;
+
+	for( ; i >= 16 ; i -= 16, p += 16) {
+		uint64_t x = hashRead8(p), y = hashRead8(p + 8) ;
+		a = hashMum(x ^ secret[2], y ^ a) ;
+		b = hashMum(y ^ secret[3], x ^ b) ;
+	}
+
+	// The last up to 15 bytes, zero padded
+	unsigned char tail[16] = { 0 } ;
+	memcpy(tail, p, i) ;
+	uint64_t x = hashRead8(tail), y = hashRead8(tail + 8) ;
+
+	a = hashMum(x ^ secret[2] ^ i, y ^ a) ;
+	b = hashMum(y ^ secret[3] ^ i, x ^ b) ;
+
+	out[0] = hashMum(a ^ secret[0], len ^ secret[1]) ;
+	out[1] = hashMum(b ^ secret[2], len ^ secret[3]) ;
+}
+
+void bufferKey(const void *data, size_t len, unsigned int flags, resultKey_t *key) {
+	uint64_t hash[2] ;
+	bufferHash(data, len, hash) ;
+
+	memset(key, 0, sizeof(resultKey_t)) ;
+	key->words[0] = hash[0] ;
+	key->words[1] = hash[1] ;
+	key->words[2] = len ;
+	key->flags = flags ;
+}
+
+unsigned long resultHash(resultKey_t *key) {
+	unsigned long long h = key->flags ;
+
+	for(int i = 0 ; i < 5 ; i++)
+		h = (h ^ key->words[i]) * 0x9E3779B97F4A7C15ULL ;
+
+	return (unsigned long)(h ^ (h >> 32)) ;
+}
+
+char resultKeyEqual(resultKey_t *a, resultKey_t *b) {
+	return memcmp(a->words, b->words, sizeof(a->words)) == 0 && a->flags == b->flags ;
+}
+
+// Memory of an entry, counted against maxBytes
+size_t resultEntryBytes(resultEntry_t *entry) {
+	return sizeof(resultEntry_t) + strlen(entry->result) + 1 ;
+}
+
+void resultUnlink(resultCache_t *cache, resultEntry_t *entry) {
+	if (entry->newer) entry->newer->older = entry->older ;
+	else cache->newest = entry->older ;
+
+	if (entry->older) entry->older->newer = entry->newer ;
+	else cache->oldest = entry->newer ;
+
+	entry->newer = entry->older = NULL ;
+}
+
+void resultPushNewest(resultCache_t *cache, resultEntry_t *entry) {
+	entry->older = cache->newest ;
+	entry->newer = NULL ;
+
+	if (cache->newest) cache->newest->newer = entry ;
+	cache->newest = entry ;
+	if (!cache->oldest) cache->oldest = entry ;
+}
+
+void resultRemove(resultCache_t *cache, resultEntry_t *entry) {
+	resultEntry_t **slot = &cache->buckets[resultHash(&entry->key) & (cache->bucketCount - 1)] ;
+	while (*slot != entry) slot = &(*slot)->hashNext ;
+	*slot = entry->hashNext ;
+
+	resultUnlink(cache, entry) ;
+	cache->bytes -= resultEntryBytes(entry) ;
+	free(entry->result) ;
+	free(entry) ;
+	cache->size-- ;
+}
+
+/*
+	Returns the cached result, and marks it as the most recently used.
+	Counts a hit or a miss.
+*/
+const char *resultCacheGet(resultCache_t *cache, resultKey_t *key) {
+	resultEntry_t *entry = cache->buckets[resultHash(key) & (cache->bucketCount - 1)] ;
+
+	while (entry && !resultKeyEqual(&entry->key, key)) entry = entry->hashNext ;
+
+	if (!entry) {
+		cache->misses++ ;
+		return NULL ;
+	}
+
+	cache->hits++ ;
+	resultUnlink(cache, entry) ;
+	resultPushNewest(cache, entry) ;
+	return entry->result ;
+}
+
+void resultCachePut(resultCache_t *cache, resultKey_t *key, const char *result) {
+	resultEntry_t *entry = calloc(1, sizeof(resultEntry_t)) ;
+	if (!entry) return ;
+
+	entry->result = strdup(result) ;
+	if (!entry->result) {
+		free(entry) ;
+		return ;
+	}
+
+	entry->key = *key ;
+
+	resultEntry_t **bucket = &cache->buckets[resultHash(key) & (cache->bucketCount - 1)] ;
+	entry->hashNext = *bucket ;
+	*bucket = entry ;
+
+	resultPushNewest(cache, entry) ;
+	cache->size++ ;
+	cache->bytes += resultEntryBytes(entry) ;
+
+	while (cache->size > cache->capacity || (cache->maxBytes && cache->bytes > cache->maxBytes)) {
+		resultRemove(cache, cache->oldest) ;
+		cache->evictions++ ;
+	}
+}
+
+/*
+	Removes the result of a path, returns 1 if there was one.
+*/
+char resultCacheInvalidate(resultCache_t *cache, resultKey_t *key) {
+	resultEntry_t *entry = cache->buckets[resultHash(key) & (cache->bucketCount - 1)] ;
+	while (entry && !resultKeyEqual(&entry->key, key)) entry = entry->hashNext ;
+
+	if (!entry) return 0 ;
+
+	resultRemove(cache, entry) ;
+	return 1 ;
+}
+
+// Removes all results, returns how many there were
+unsigned long resultCacheClear(resultCache_t *cache) {
+	unsigned long removed = cache ? cache->size : 0 ;
+	while (cache && cache->oldest) resultRemove(cache, cache->oldest) ;
+
+	return removed ;
+}
+
+void resultCacheFree(resultCache_t *cache) {
+	if (!cache) return ;
+
+	resultCacheClear(cache) ;
+	free(cache->buckets) ;
+	free(cache) ;
+}
+
+/*
+	Creates a cache of capacity results, using at most maxBytes bytes of memory (0 for no limit).
+	Returns NULL if capacity is 0. Raises NoMemoryError on failure.
+*/
+resultCache_t *resultCacheNew(unsigned long capacity, size_t maxBytes) {
+	if (!capacity) return NULL ;
+
+	resultCache_t *cache = calloc(1, sizeof(resultCache_t)) ;
+
+	// About one entry per bucket when full
+	unsigned long buckets = 16 ;
+	while (buckets < capacity && buckets < (1UL << 24)) buckets <<= 1 ;
+
+	if (cache) cache->buckets = calloc(buckets, sizeof(resultEntry_t *)) ;
+
+	if (!cache || !cache->buckets) {
+		free(cache) ;
+		rb_raise(rb_eNoMemError, "Failed to allocate the result cache") ;
+	}
+
+	cache->bucketCount = buckets ;
+	cache->capacity = capacity ;
+	cache->maxBytes = maxBytes ;
+	return cache ;
+}
+
+/*
+	Creates a cache bounded by maxBytes bytes of memory, or returns NULL if maxBytes is 0.
+	Raises NoMemoryError on failure.
+*/
+resultCache_t *resultCacheNewBytes(size_t maxBytes) {
+	// MIME results are short, an entry takes about this much
+	unsigned long capacity = maxBytes / (sizeof(resultEntry_t) + 32) ;
+	return resultCacheNew(maxBytes && !capacity ? 1 : capacity, maxBytes) ;
+}
+
+/*
+	Returns a Hash with stats of the cache.
+*/
+VALUE resultCacheStats(resultCache_t *cache) {
+	VALUE hash = rb_hash_new() ;
+	rb_hash_aset(hash, ID2SYM(rb_intern("size")), ULONG2NUM(cache ? cache->size : 0)) ;
+	rb_hash_aset(hash, ID2SYM(rb_intern("capacity")), ULONG2NUM(cache ? cache->capacity : 0)) ;
+	rb_hash_aset(hash, ID2SYM(rb_intern("bytes")), SIZET2NUM(cache ? cache->bytes : 0)) ;
+	rb_hash_aset(hash, ID2SYM(rb_intern("max_bytes")), SIZET2NUM(cache ? cache->maxBytes : 0)) ;
+	rb_hash_aset(hash, ID2SYM(rb_intern("hits")), ULL2NUM(cache ? cache->hits : 0)) ;
+	rb_hash_aset(hash, ID2SYM(rb_intern("misses")), ULL2NUM(cache ? cache->misses : 0)) ;
+	rb_hash_aset(hash, ID2SYM(rb_intern("evictions")), ULL2NUM(cache ? cache->evictions : 0)) ;
+
+	return hash ;
+}
@@ -0,0 +1,617 @@
+/*
+	Native parallel directory scanner.
+
+	A walker thread walks the tree with openat() / fdopendir(), and pushes file paths
+	into a bounded work queue. Worker threads, each with its own magic_t, check the paths
+	and push the results into a bounded result queue, which the ruby thread drains without the GVL.
+	Neither queue grows past SCAN_QUEUE entries, so a slow consumer slows down the scan
+	instead of buffering the whole tree.
+*/
+#if defined(HAVE_PTHREAD_H) && defined(HAVE_OPENAT) && defined(HAVE_FDOPENDIR) && defined(HAVE_FSTATAT)
+#define HAVE_SCAN 1
+
+#include <pthread.h>
+#include <signal.h>
+#include <fcntl.h>
+#include <dirent.h>
+
+#define SCAN_QUEUE 1024
+
+// Worker threads allowed per online CPU
+#define SCAN_THREADS_PER_CPU 8
+
+typedef struct {
+	char *path ;
+	char *result ;
+	int error ;
+} scanItem_t ;
+
+// Directories being walked, to detect loops while following symlinks
+typedef struct scanDir {
+	dev_t dev ;
+	ino_t ino ;
+	struct scanDir *parent ;
+} scanDir_t ;
+
+typedef struct {
+	char *root ;
+	char *db ;
+	preload_t *preload ;
+	unsigned int flags ;
+	char followSymlinks ;
+	char intern ;
+	int threads ;
+
+	pthread_mutex_t mutex ;
+	pthread_cond_t workReady ;
+	pthread_cond_t workSpace ;
+	pthread_cond_t resultReady ;
+	pthread_cond_t resultSpace ;
+
+	char *work[SCAN_QUEUE] ;
+	size_t workHead, workLen ;
+
+	scanItem_t results[SCAN_QUEUE] ;
+	size_t resultHead, resultLen ;
+
+	// Items taken by the ruby thread, but not converted yet
+	scanItem_t taken[SCAN_QUEUE] ;
+	size_t takenPos, takenLen ;
+
+	char walking ;
+	int workers ;
+	char finished ;
+	char stop ;
+	volatile char interrupted ;
+	char *loadError ;
+
+	pthread_t walker ;
+	char walkerStarted ;
+	pthread_t *workerThreads ;
+	int workersStarted ;
+	char joined ;
+} scan_t ;
+
+void scanItemFree(scanItem_t *item) {
+	free(item->path) ;
+	free(item->result) ;
+	item->path = NULL ;
+	item->result = NULL ;
+}
+
+// Returns 0 if the scan is stopped, the path is freed then
+char scanPushWork(scan_t *scan, char *path) {
+	pthread_mutex_lock(&scan->mutex) ;
+
+	while(scan->workLen == SCAN_QUEUE && !scan->stop)
+		pthread_cond_wait(&scan->workSpace, &scan->mutex) ;
+
+	if (scan->stop) {
+		pthread_mutex_unlock(&scan->mutex) ;
+		free(path) ;
+		return 0 ;
+	}
+
+	scan->work[(scan->workHead + scan->workLen++) % SCAN_QUEUE] = path ;
+	pthread_cond_signal(&scan->workReady) ;
+	pthread_mutex_unlock(&scan->mutex) ;
+
+	return 1 ;
+}
+
+char scanPushResult(scan_t *scan, scanItem_t *item) {
+	pthread_mutex_lock(&scan->mutex) ;
+
+	while(scan->resultLen == SCAN_QUEUE && !scan->stop)
+		pthread_cond_wait(&scan->resultSpace, &scan->mutex) ;
+
+	if (scan->stop) {
+		pthread_mutex_unlock(&scan->mutex) ;
+		scanItemFree(item) ;
+		return 0 ;
+	}
+
+	scan->results[(scan->resultHead + scan->resultLen++) % SCAN_QUEUE] = *item ;
+	pthread_cond_signal(&scan->resultReady) ;
+	pthread_mutex_unlock(&scan->mutex) ;
+
+	return 1 ;
+}
+
+char *scanJoinPath(const char *dir, const char *name) {
+	size_t dirLen = strlen(dir), nameLen = strlen(name) ;
+	char slash = dirLen && dir[dirLen - 1] != '/' ;
+
+	char *path = malloc(dirLen + slash + nameLen + 1) ;
+	if (!path) return NULL ;
+
+	memcpy(path, dir, dirLen) ;
+	if (slash) path[dirLen] = '/' ;
+	memcpy(path + dirLen + slash, name, nameLen + 1) ;
+
+	return path ;
+}
+
+char scanError(scan_t *scan, const char *path, int error) {
+	scanItem_t item = { .path = strdup(path), .error = error ? error : EIO } ;
+	if (!item.path) return 0 ;
+	return scanPushResult(scan, &item) ;
+}
+
+/*
+	Walks the directory opened as fd. Takes ownership of fd.
+	Returns 0 when the scan is stopped.
+*/
+char scanWalk(scan_t *scan, int fd, const char *dirPath, scanDir_t *parent) {
+	struct stat statbuf ;
+	if (fstat(fd, &statbuf)) {
+		close(fd) ;
+		return scanError(scan, dirPath, errno) ;
+	}
+
+	scanDir_t self = { .dev = statbuf.st_dev, .ino = statbuf.st_ino, .parent = parent } ;
+	for(scanDir_t *d = parent ; d ; d = d->parent) {
+		if (d->dev == self.dev && d->ino == self.ino) {
+			close(fd) ;
+			return 1 ;
+		}
+	}
+
+	DIR *dir = fdopendir(fd) ;
+	if (!dir) {
+		int error = errno ;
+		close(fd) ;
+		return scanError(scan, dirPath, error) ;
+	}
+
+	char running = 1 ;
+	struct dirent *entry ;
+
+	while(running && (entry = readdir(dir))) {
+		const char *name = entry->d_name ;
+		if (name[0] == '.' && (!name[1] || (name[1] == '.' && !name[2]))) continue ;
+
+		char isDir = 0, known = 0 ;
+
+		#ifdef DT_UNKNOWN
+		if (entry->d_type == DT_DIR) {
+			isDir = known = 1 ;
+		} else if (entry->d_type != DT_UNKNOWN && (entry->d_type != DT_LNK || !scan->followSymlinks)) {
+			known = 1 ;
+		}
+		#endif
+
+		if (!known) {
+			int statFlags = scan->followSymlinks ? 0 : AT_SYMLINK_NOFOLLOW ;
+			if (fstatat(dirfd(dir), name, &statbuf, statFlags) == 0) {
+				isDir = S_ISDIR(statbuf.st_mode) ;
+			}
+		}
+
+		char *path = scanJoinPath(dirPath, name) ;
+		if (!path) continue ;
+
+		if (isDir) {
+			int openFlags = O_RDONLY | O_DIRECTORY ;
+			if (!scan->followSymlinks) openFlags |= O_NOFOLLOW ;
+
+			#ifdef O_CLOEXEC
+			openFlags |= O_CLOEXEC ;
+			#endif
+
+			int child = openat(dirfd(dir), name, openFlags) ;
+
+			if (child < 0) {
+				running = scanError(scan, path, errno) ;
+			} else {
+				running = scanWalk(scan, child, path, &self) ;
+			}
+
+			free(path) ;
+		} else {
+			running = scanPushWork(scan, path) ;
+		}
+	}
+
+	closedir(dir) ;
+	return running ;
+}
+
+void *scanWalker(void *data) {
+	scan_t *scan = data ;
+	struct stat statbuf ;
+
+	int statStatus = scan->followSymlinks ? stat(scan->root, &statbuf) : lstat(scan->root, &statbuf) ;
+
+	if (statStatus) {
+		scanError(scan, scan->root, errno) ;
+	} else if (S_ISDIR(statbuf.st_mode)) {
+		int openFlags = O_RDONLY | O_DIRECTORY ;
+
+		#ifdef O_CLOEXEC
+		openFlags |= O_CLOEXEC ;
+		#endif
+
+		int fd = open(scan->root, openFlags) ;
+
+		if (fd < 0) scanError(scan, scan->root, errno) ;
+		else scanWalk(scan, fd, scan->root, NULL) ;
+	} else {
+		char *path = strdup(scan->root) ;
+		if (path) scanPushWork(scan, path) ;
+	}
+
+	pthread_mutex_lock(&scan->mutex) ;
+	scan->walking = 0 ;
+	pthread_cond_broadcast(&scan->workReady) ;
+	pthread_mutex_unlock(&scan->mutex) ;
+
+	return NULL ;
+}
+
+void *scanWorker(void *data) {
+	scan_t *scan = data ;
+	magic_t magic = magic_open(scan->flags) ;
+	unsigned long long loaded = traceBegin(STATS_LOAD, scan->db) ;
+
+	#ifdef HAVE_PRELOAD
+		int status = !magic ? -1 : scan->preload ?
+			magic_load_buffers(magic, &scan->preload->map, &scan->preload->size, 1) :
+			magic_load(magic, scan->db) ;
+	#else
+		int status = !magic ? -1 : magic_load(magic, scan->db) ;
+	#endif
+
+	traceEnd(NULL, STATS_LOAD, loaded) ;
+	if (!status) statsCount(NULL, STATS_LOADS, 1) ;
+
+	if (status) {
+		pthread_mutex_lock(&scan->mutex) ;
+
+		if (!scan->loadError) {
+			const char *err = magic ? magic_error(magic) : NULL ;
+			scan->loadError = strdup(err ? err : "could not load the magic database") ;
+		}
+
+		scan->stop = 1 ;
+		pthread_cond_broadcast(&scan->workReady) ;
+		pthread_cond_broadcast(&scan->workSpace) ;
+		pthread_cond_broadcast(&scan->resultSpace) ;
+		pthread_mutex_unlock(&scan->mutex) ;
+	} else {
+		while(1) {
+			pthread_mutex_lock(&scan->mutex) ;
+
+			while(!scan->workLen && scan->walking && !scan->stop)
+				pthread_cond_wait(&scan->workReady, &scan->mutex) ;
+
+			if (scan->stop || !scan->workLen) {
+				pthread_mutex_unlock(&scan->mutex) ;
+				break ;
+			}
+
+			char *path = scan->work[scan->workHead] ;
+			scan->workHead = (scan->workHead + 1) % SCAN_QUEUE ;
+			scan->workLen-- ;
+
+			pthread_cond_signal(&scan->workSpace) ;
+			pthread_mutex_unlock(&scan->mutex) ;
+
+			scanItem_t item = { .path = path } ;
+
+			unsigned long long started = traceBegin(STATS_CHECK, path) ;
+			const char *mt = magic_file(magic, path) ;
+			traceEnd(NULL, STATS_CHECK, started) ;
+			statsCount(NULL, STATS_CHECKS, 1) ;
+
+			if (mt) {
+				item.result = strdup(mt) ;
+			} else {
+				item.error = magic_errno(magic) ;
+				if (!item.error) item.error = EIO ;
+			}
+
+			if (!scanPushResult(scan, &item)) break ;
+		}
+	}
+
+	if (magic) magic_close(magic) ;
+
+	pthread_mutex_lock(&scan->mutex) ;
+	scan->workers-- ;
+	pthread_cond_broadcast(&scan->resultReady) ;
+	pthread_mutex_unlock(&scan->mutex) ;
+
+	return NULL ;
+}
+
+// Waits for results, and moves them to scan->taken. Runs without the GVL.
+void *scanTake(void *data) {
+	scan_t *scan = data ;
+
+	pthread_mutex_lock(&scan->mutex) ;
+
+	while(!scan->resultLen && scan->workers && !scan->interrupted && !scan->loadError)
+		pthread_cond_wait(&scan->resultReady, &scan->mutex) ;
+
+	scan->finished = !scan->resultLen && !scan->workers ;
+	scan->takenPos = 0 ;
+	scan->takenLen = 0 ;
+
+	while(scan->resultLen) {
+		scan->taken[scan->takenLen++] = scan->results[scan->resultHead] ;
+		scan->resultHead = (scan->resultHead + 1) % SCAN_QUEUE ;
+		scan->resultLen-- ;
+	}
+
+	pthread_cond_broadcast(&scan->resultSpace) ;
+	pthread_mutex_unlock(&scan->mutex) ;
+
+	return NULL ;
+}
+
+void scanUnblock(void *data) {
+	scan_t *scan = data ;
+
+	pthread_mutex_lock(&scan->mutex) ;
+	scan->interrupted = 1 ;
+	pthread_cond_broadcast(&scan->resultReady) ;
+	pthread_mutex_unlock(&scan->mutex) ;
+}
+
+void scanStart(scan_t *scan) {
+	pthread_mutex_init(&scan->mutex, NULL) ;
+	pthread_cond_init(&scan->workReady, NULL) ;
+	pthread_cond_init(&scan->workSpace, NULL) ;
+	pthread_cond_init(&scan->resultReady, NULL) ;
+	pthread_cond_init(&scan->resultSpace, NULL) ;
+
+	scan->workerThreads = calloc(scan->threads, sizeof(pthread_t)) ;
+	if (!scan->workerThreads) rb_raise(rb_eNoMemError, "Failed to allocate %d threads", scan->threads) ;
+
+	// Signals are for ruby threads to handle
+	sigset_t all, old ;
+	sigfillset(&all) ;
+	pthread_sigmask(SIG_SETMASK, &all, &old) ;
+
+	scan->walking = 1 ;
+	scan->walkerStarted = pthread_create(&scan->walker, NULL, scanWalker, scan) == 0 ;
+	if (!scan->walkerStarted) scan->walking = 0 ;
+
+	for(int i = 0 ; i < scan->threads ; i++) {
+		pthread_mutex_lock(&scan->mutex) ;
+		scan->workers++ ;
+		pthread_mutex_unlock(&scan->mutex) ;
+
+		if (pthread_create(&scan->workerThreads[scan->workersStarted], NULL, scanWorker, scan) == 0) {
+			scan->workersStarted++ ;
+		} else {
+			pthread_mutex_lock(&scan->mutex) ;
+			scan->workers-- ;
+			pthread_mutex_unlock(&scan->mutex) ;
+		}
+	}
+
+	pthread_sigmask(SIG_SETMASK, &old, NULL) ;
+
+	if (!scan->walkerStarted || !scan->workersStarted) {
+		rb_raise(rb_eRuntimeError, "Failed to start the scanner threads") ;
+	}
+}
+
+VALUE scanResult(scanItem_t *item, char intern) {
+	if (item->result) return magicResult(item->result, intern) ;
+	return rb_exc_new_cstr(fileErrorClass(item->error), item->path) ;
+}
+
+typedef struct {
+	scan_t *scan ;
+	volatile VALUE results ;
+	long yielded ;
+} scanArgs_t ;
+
+static VALUE _scanRun_(VALUE data) {
+	scanArgs_t *args = (scanArgs_t *)data ;
+	scan_t *scan = args->scan ;
+	char block = rb_block_given_p() ;
+
+	scanStart(scan) ;
+
+	while(1) {
+		scan->interrupted = 0 ;
+
+		// Pending interrupts are handled when it returns
+		magicWithoutGVL(scanTake, scan, scanUnblock, scan) ;
+
+		if (scan->loadError) {
+			rb_raise(rb_eInvalidDBError, "%s (failed to load the magic database)", scan->loadError) ;
+		}
+
+		if (!scan->takenLen) {
+			if (scan->finished) break ;
+			continue ;
+		}
+
+		while(scan->takenPos < scan->takenLen) {
+			scanItem_t *item = &scan->taken[scan->takenPos] ;
+
+			VALUE path = rb_str_new_cstr(item->path) ;
+			VALUE result = scanResult(item, scan->intern) ;
+
+			scanItemFree(item) ;
+			scan->takenPos++ ;
+
+			if (block) {
+				rb_yield_values(2, path, result) ;
+				args->yielded++ ;
+			} else {
+				rb_hash_aset(args->results, path, result) ;
+			}
+		}
+	}
+
+	return block ? LONG2NUM(args->yielded) : args->results ;
+}
+
+// Joins the walker and the workers, once told to stop
+void *scanJoin(void *data) {
+	scan_t *scan = data ;
+
+	if (scan->walkerStarted) pthread_join(scan->walker, NULL) ;
+	for(int i = 0 ; i < scan->workersStarted ; i++) pthread_join(scan->workerThreads[i], NULL) ;
+
+	scan->joined = 1 ;
+	return NULL ;
+}
+
+static VALUE _scanStop_(VALUE data) {
+	scan_t *scan = ((scanArgs_t *)data)->scan ;
+
+	if (scan->workerThreads) {
+		pthread_mutex_lock(&scan->mutex) ;
+		scan->stop = 1 ;
+		pthread_cond_broadcast(&scan->workReady) ;
+		pthread_cond_broadcast(&scan->workSpace) ;
+		pthread_cond_broadcast(&scan->resultSpace) ;
+		pthread_mutex_unlock(&scan->mutex) ;
+
+		// Workers finish the file they check, other threads run meanwhile.
+		// Skipped with interrupts pending, and raising isn't for an ensure, so they stay pending.
+		rb_thread_call_without_gvl2(scanJoin, scan, NULL, NULL) ;
+		if (!scan->joined) scanJoin(scan) ;
+
+		for(size_t i = 0 ; i < scan->workLen ; i++) free(scan->work[(scan->workHead + i) % SCAN_QUEUE]) ;
+		for(size_t i = 0 ; i < scan->resultLen ; i++) scanItemFree(&scan->results[(scan->resultHead + i) % SCAN_QUEUE]) ;
+		for(size_t i = scan->takenPos ; i < scan->takenLen ; i++) scanItemFree(&scan->taken[i]) ;
+
+		pthread_cond_destroy(&scan->workReady) ;
+		pthread_cond_destroy(&scan->workSpace) ;
+		pthread_cond_destroy(&scan->resultReady) ;
+		pthread_cond_destroy(&scan->resultSpace) ;
+		pthread_mutex_destroy(&scan->mutex) ;
+
+		free(scan->workerThreads) ;
+	}
+
+	free(scan->root) ;
+	free(scan->db) ;
+	free(scan->loadError) ;
+	free(scan) ;
+
+	return Qnil ;
+}
+#endif
+
+/*
+	Scans a directory tree natively, and checks every file on worker threads.
+	Each worker thread has its own magic cookie, so files are checked in parallel.
+
+	For example:
+
+		> LibmagicRb.scan('/usr/share/backgrounds', threads: 4)
+		# => {"/usr/share/backgrounds/vienna-5164602.jpg"=>"image/jpeg; charset=binary", ...}
+
+		> LibmagicRb.scan('/usr/share', threads: 8) { |path, mime| puts "#{path}: #{mime}" }
+		/usr/share/dict/words: text/plain; charset=utf-8
+		.
+		.
+		.
+		# => 41096
+
+	[root] The directory to scan. It can also be a single file.
+
+	[threads] The key `threads:` is the number of worker threads. Defaults to the number of online CPUs,
+	and can be up to 8 times that.
+
+	[mode] The key `mode:` works like in LibmagicRb.check(). Defaults to `MAGIC_MIME | MAGIC_CHECK`.
+
+	[follow_symlinks] The key `follow_symlinks:` follows symlinks to files and directories.
+	Without it, symlinks are reported as symlinks. Loops are skipped. Defaults to false.
+
+	[db] The key `db:` is the database path, nil for the system database.
+
+	[intern] The key `intern:` returns interned frozen results, like LibmagicRb#intern=. Defaults to false.
+
+	Directories are walked but not reported. Files that can't be checked, and directories
+	that can't be opened are reported with an instance of LibmagicRb::FileNotFound or LibmagicRb::FileUnreadable.
+	Files are reported in the order they are checked, not in the order of the directory.
+
+	Without a block returns a Hash of path => result. With a block, yields path and result as
+	they come, and returns the number of files yielded. Breaking out of the block stops the scan.
+*/
+static VALUE _scan_(int argc, VALUE *argv, volatile VALUE obj) {
+	VALUE root, opts ;
+	rb_scan_args(argc, argv, "1:", &root, &opts) ;
+
+	if (!RB_TYPE_P(root, T_STRING)) {
+		rb_raise(rb_eArgError, "Root must be an instance of String.") ;
+	}
+
+	#ifdef HAVE_SCAN
+		if (NIL_P(opts)) opts = rb_hash_new() ;
+
+		VALUE argThreads = rb_hash_aref(opts, ID2SYM(rb_intern("threads"))) ;
+		VALUE argModes = rb_hash_aref(opts, ID2SYM(rb_intern("mode"))) ;
+		VALUE argFollow = rb_hash_aref(opts, ID2SYM(rb_intern("follow_symlinks"))) ;
+		VALUE argDBPath = rb_hash_aref(opts, ID2SYM(rb_intern("db"))) ;
+
+		long cpus = sysconf(_SC_NPROCESSORS_ONLN) ;
+		if (cpus < 1) cpus = 1 ;
+
+		int threads ;
+		if (NIL_P(argThreads)) {
+			threads = (int)cpus ;
+		} else {
+			long max = cpus * SCAN_THREADS_PER_CPU ;
+			long value = NUM2LONG(argThreads) ;
+
+			if (value < 1) rb_raise(rb_eArgError, "Threads must be at least 1.") ;
+			if (value > max) rb_raise(rb_eArgError, "Threads must be at most %ld (%d per CPU).", max, SCAN_THREADS_PER_CPU) ;
+			threads = (int)value ;
+		}
+
+		unsigned int modes ;
+		if(RB_TYPE_P(argModes, T_NIL)) {
+			modes = MAGIC_MIME | MAGIC_CHECK ;
+		} else if (!RB_TYPE_P(argModes, T_FIXNUM)) {
+			rb_raise(rb_eArgError, "Modes must be an instance of Integer. Check LibmagicRb.constants() or LibmagicRb.lsmodes().") ;
+		} else {
+			modes = FIX2UINT(argModes) ;
+		}
+
+		char follow = RTEST(argFollow) ;
+		if (follow) modes |= MAGIC_SYMLINK ;
+		else modes &= ~MAGIC_SYMLINK ;
+
+		if (!NIL_P(argDBPath)) {
+			if (!RB_TYPE_P(argDBPath, T_STRING)) rb_raise(rb_eArgError, "Database name must be an instance of String.") ;
+			dbPathReadable(StringValueCStr(argDBPath)) ;
+		}
+
+		char *rootPath = StringValueCStr(root) ;
+		if (access(rootPath, F_OK)) rb_raise(fileErrorClass(errno), "%s", rootPath) ;
+
+		scan_t *scan = calloc(1, sizeof(scan_t)) ;
+		if (!scan) rb_raise(rb_eNoMemError, "Failed to allocate the scanner") ;
+
+		scan->root = strdup(rootPath) ;
+		scan->db = NIL_P(argDBPath) ? NULL : strdup(RSTRING_PTR(argDBPath)) ;
+
+		// Workers share a preloaded database, if there's one
+		struct stat statbuf ;
+		if (dbStat(scan->db, &statbuf) == 0) scan->preload = preloadFind(scan->db, &statbuf) ;
+		scan->flags = modes ;
+		scan->followSymlinks = follow ;
+		scan->intern = RTEST(rb_hash_aref(opts, ID2SYM(rb_intern("intern")))) ;
+		scan->threads = threads ;
+
+		scanArgs_t args = {
+			.scan = scan,
+			.results = rb_block_given_p() ? Qnil : rb_hash_new()
+		} ;
+
+		return rb_ensure(_scanRun_, (VALUE)&args, _scanStop_, (VALUE)&args) ;
+	#else
+		rb_raise(rb_eNotImpError, "LibmagicRb.scan() is not supported on this platform") ;
+	#endif
+}
@@ -0,0 +1,277 @@
+/*
+	Opt-in fast path for common formats (LibmagicRb.new(fast_path: true)), in front of check() and magic_buffer().
+
+	The first 16 bytes are compared against a small table of signatures, each 16 bytes with a mask,
+	with SSE2 or NEON compares where available. A match answers with the MIME type libmagic gives
+	those files, without walking the rules of the database. Anything else goes through libmagic.
+
+	A signature only answers when:
+		- The cookie's flags ask for the MIME type and maybe the encoding (MAGIC_MIME_TYPE or MAGIC_MIME),
+		  along with flags that don't change them (MAGIC_CHECK, MAGIC_SYMLINK, MAGIC_DEVICES, MAGIC_ERROR, MAGIC_RAW).
+		- The cookie's database gives the same MIME type for the sample of the signature. That's checked
+		  once per database loaded, so another version of libmagic, or a database of your own, turns off
+		  the signatures it disagrees with.
+		- With MAGIC_MIME_ENCODING, there's a NUL byte in the bytes libmagic looks at for the encoding,
+		  which makes them "binary". A PDF made of text goes through libmagic.
+
+	Formats told apart deeper in the file aren't in the table: ZIP (OOXML documents, JARs, EPUBs
+	are ZIPs), and ELF (executables and shared libraries are told apart by their program headers).
+*/
+#include <fcntl.h>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+#include <arm_neon.h>
+#endif
+
+// Flags the fast path answers for, MAGIC_MIME_TYPE must be one of them
+#define SIGNATURE_FLAGS (MAGIC_MIME | MAGIC_CHECK | MAGIC_SYMLINK | MAGIC_DEVICES | MAGIC_ERROR | MAGIC_RAW)
+
+// Bytes of files read for the fast path
+#define SIGNATURE_READ 4096
+
+typedef struct {
+	// bytes has 0 where mask has 0
+	unsigned char bytes[16] ;
+	unsigned char mask[16] ;
+
+	// Bytes needed for a match, libmagic says text or data for shorter ones
+	size_t length ;
+
+	const char *mime ;
+	const char *mimeBinary ;
+
+	// A file of the format, checked with the cookie's database
+	const char *sample ;
+	size_t sampleLength ;
+} signature_t ;
+
+#define SIGNATURE_SAMPLE(bytes) bytes, sizeof(bytes) - 1
+
+#define SIGNATURE_MP4(brand) { \
+	"\0\0\0\0ftyp" brand, "\0\0\0\0\xff\xff\xff\xff\xff\xff\xff\xff", 12, "video/mp4", "video/mp4; charset=binary", \
+	SIGNATURE_SAMPLE("\0\0\0\x18" "ftyp" brand "\0\0\2\0isomiso2\0\0\0\x08" "free") \
+}
+
+const signature_t signatures[] = {
+	{
+		"\x89PNG\r\n\x1a\n\0\0\0\rIHDR", "\xff\xff\xff\xff\xff\xff\xff\xff\xff\xff\xff\xff\xff\xff\xff\xff", 16,
+		"image/png", "image/png; charset=binary",
+		SIGNATURE_SAMPLE("\x89PNG\r\n\x1a\n\0\0\0\rIHDR\0\0\0\x10\0\0\0\x10\x08\x06\0\0\0\x1f\xf3\xff" "a")
+	},
+	{
+		"\xff\xd8\xff", "\xff\xff\xff", 4,
+		"image/jpeg", "image/jpeg; charset=binary",
+		SIGNATURE_SAMPLE("\xff\xd8\xff\xe0\0\x10" "JFIF\0\1\1\0\0\1\0\1\0\0")
+	},
+	{
+		"%PDF-", "\xff\xff\xff\xff\xff", 5,
+		"application/pdf", "application/pdf; charset=binary",
+		SIGNATURE_SAMPLE("%PDF-1.4\n%\xe2\xe3\xcf\xd3\n1 0 obj\n<< >>\nendobj\n")
+	},
+	{
+		"\x1f\x8b\x08", "\xff\xff\xff", 4,
+		"application/gzip", "application/gzip; charset=binary",
+		SIGNATURE_SAMPLE("\x1f\x8b\x08\0\0\0\0\0\0\x03\x4b\x4c\x4a\x06\0\xc2\x41\x24\x35\x03\0\0\0")
+	},
+	SIGNATURE_MP4("isom"),
+	SIGNATURE_MP4("iso2"),
+	SIGNATURE_MP4("mp41"),
+	SIGNATURE_MP4("mp42"),
+	SIGNATURE_MP4("avc1"),
+	SIGNATURE_MP4("dash"),
+} ;
+
+#define SIGNATURES (int)(sizeof(signatures) / sizeof(signatures[0]))
+
+static inline char signatureEqual(const unsigned char *head, const signature_t *signature) {
+	#if defined(__SSE2__)
+		__m128i bytes = _mm_and_si128(_mm_loadu_si128((const __m128i *)head), _mm_loadu_si128((const __m128i *)signature->mask)) ;
+		return _mm_movemask_epi8(_mm_cmpeq_epi8(bytes, _mm_loadu_si128((const __m128i *)signature->bytes))) == 0xFFFF ;
+	#elif defined(__ARM_NEON) && defined(__aarch64__)
+		uint8x16_t bytes = vandq_u8(vld1q_u8(head), vld1q_u8(signature->mask)) ;
+		return vminvq_u8(vceqq_u8(bytes, vld1q_u8(signature->bytes))) == 0xFF ;
+	#else
+		uint64_t h[2], m[2], b[2] ;
+		memcpy(h, head, 16) ;
+		memcpy(m, signature->mask, 16) ;
+		memcpy(b, signature->bytes, 16) ;
+		return (h[0] & m[0]) == b[0] && (h[1] & m[1]) == b[1] ;
+	#endif
+}
+
+// Returns the index of the signature the bytes match, or -1
+int signatureFind(const unsigned char *data, size_t length) {
+	unsigned char head[16] = { 0 } ;
+	memcpy(head, data, length < 16 ? length : 16) ;
+
+	for(int i = 0 ; i < SIGNATURES ; i++) {
+		if (length >= signatures[i].length && signatureEqual(head, &signatures[i])) return i ;
+	}
+
+	return -1 ;
+}
+
+/*
+	Returns the answer of the fast path for the bytes, or NULL to ask libmagic.
+	enabled has a bit for each signature the database agrees with. window is how many
+	of the bytes libmagic looks at for the encoding.
+*/
+const char *signatureResult(unsigned int enabled, int flags, const unsigned char *data, size_t length, size_t window) {
+	int i = signatureFind(data, length) ;
+	if (i < 0 || !(enabled & (1U << i))) return NULL ;
+
+	if (!(flags & MAGIC_MIME_ENCODING)) return signatures[i].mime ;
+
+	// memchr() is vectorized by the libc
+	return memchr(data, 0, length < window ? length : window) ? signatures[i].mimeBinary : NULL ;
+}
+
+char signatureFlags(int flags) {
+	return (flags & MAGIC_MIME_TYPE) && !(flags & ~SIGNATURE_FLAGS) ;
+}
+
+// Bytes libmagic looks at for the encoding, at most
+size_t signatureWindow(magic_t magic) {
+	size_t window = magicBytesMax(magic) ;
+
+	#if MAGIC_VERSION > 525 && defined(MAGIC_PARAM_ENCODING_MAX)
+		size_t value ;
+		if (magic_getparam(magic, MAGIC_PARAM_ENCODING_MAX, &value) == 0 && value < window) window = value ;
+	#endif
+
+	return window ;
+}
+
+typedef struct {
+	magic_t magic ;
+	int mode ;
+	unsigned int signatures ;
+	volatile char interrupted ;
+} signaturesCheck_t ;
+
+// Runs the samples with MAGIC_MIME_TYPE, and sets the flags back, all without the GVL
+void *signaturesCheckRun(void *data) {
+	signaturesCheck_t *c = data ;
+	magic_setflags(c->magic, MAGIC_MIME_TYPE) ;
+
+	for(int i = 0 ; i < SIGNATURES ; i++) {
+		const signature_t *s = &signatures[i] ;
+		const char *mt = magic_buffer(c->magic, s->sample, s->sampleLength) ;
+
+		if (mt && strcmp(mt, s->mime) == 0 && signatureFind((const unsigned char *)s->sample, s->sampleLength) == i)
+			c->signatures |= 1U << i ;
+	}
+
+	magic_setflags(c->magic, c->mode) ;
+	return NULL ;
+}
+
+// The samples are small, they're all checked once started
+void signaturesCheckUnblock(void *data) {
+	((signaturesCheck_t *)data)->interrupted = 1 ;
+}
+
+/*
+	Checks the samples of the signatures with the cookie's database, once per database loaded.
+	mode is the cookie's flags, set back afterwards. An interrupt raised once the samples
+	are checked leaves them to the next call.
+*/
+void signaturesCheck(cookie_t *cookie, int mode) {
+	if (cookie->signaturesChecked) return ;
+
+	signaturesCheck_t c = { .magic = cookie->magic, .mode = mode } ;
+	magicWithoutGVL(signaturesCheckRun, &c, signaturesCheckUnblock, &c) ;
+
+	cookie->signatures = c.signatures ;
+	cookie->signaturesChecked = 1 ;
+}
+
+typedef struct {
+	magicCall_t call ;
+
+	unsigned int enabled ;
+	int flags ;
+	size_t window ;
+	char mmap ;
+
+	char fast ;
+} signatureCall_t ;
+
+void *signatureRun(void *data) {
+	signatureCall_t *s = data ;
+
+	int flags = O_RDONLY | O_NONBLOCK | O_NOCTTY ;
+	#ifdef O_CLOEXEC
+		flags |= O_CLOEXEC ;
+	#endif
+
+	// libmagic describes the link itself without MAGIC_SYMLINK
+	if (!(s->flags & MAGIC_SYMLINK)) flags |= O_NOFOLLOW ;
+
+	int fd = open(s->call.path, flags) ;
+
+	if (fd >= 0) {
+		unsigned char head[SIGNATURE_READ] ;
+		struct stat statbuf ;
+		ssize_t length = -1 ;
+
+		if (fstat(fd, &statbuf) == 0 && S_ISREG(statbuf.st_mode) && statbuf.st_size > 0)
+			length = read(fd, head, sizeof(head)) ;
+
+		close(fd) ;
+
+		if (length > 0) {
+			s->call.result = signatureResult(s->enabled, s->flags, head, length, s->window) ;
+			s->fast = s->call.result != NULL ;
+			if (s->fast) return NULL ;
+		}
+	}
+
+	return s->mmap ? mmapRun(&s->call) : magicCallRun(&s->call) ;
+}
+
+/*
+	Checks a file the way the cookie is set up: through the fast path, a memory map, or magic_file().
+	mode is the cookie's flags.
+*/
+const char *cookieFileNoGVL(cookie_t *cookie, const char *path, int mode) {
+	if (!cookie->fastPath || !signatureFlags(mode))
+		return cookie->mmap ? magicMapNoGVL(cookie->magic, path) : magicFileNoGVL(cookie->magic, path) ;
+
+	signaturesCheck(cookie, mode) ;
+
+	signatureCall_t s = {
+		.call = { .op = MAGIC_CALL_FILE, .magic = cookie->magic, .path = path },
+		.enabled = cookie->signatures,
+		.flags = mode,
+		.window = signatureWindow(cookie->magic),
+		.mmap = cookie->mmap
+	} ;
+
+	magicWithoutGVL(signatureRun, &s, magicCallUnblock, &s.call) ;
+
+	if (s.fast) statsCount(&cookie->stats, STATS_FAST_PATH, 1) ;
+	return s.call.result ;
+}
+
+/*
+	Returns the answer of the fast path for the bytes, or NULL when they have to go through libmagic.
+	Answers are counted as checks. mode is the cookie's flags.
+*/
+const char *cookieBufferFast(cookie_t *cookie, const void *buffer, size_t length, int mode) {
+	if (!cookie->fastPath || !signatureFlags(mode) || !length) return NULL ;
+
+	signaturesCheck(cookie, mode) ;
+
+	// Not timed, a match takes nanoseconds
+	const char *mt = signatureResult(cookie->signatures, mode, buffer, length, signatureWindow(cookie->magic)) ;
+	if (!mt) return NULL ;
+
+	statsCount(&cookie->stats, STATS_CHECKS, 1) ;
+	statsCount(&cookie->stats, STATS_BYTES, length) ;
+	statsCount(&cookie->stats, STATS_FAST_PATH, 1) ;
+
+	return mt ;
+}
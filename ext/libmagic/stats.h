@@ -0,0 +1,184 @@
+/*
+	Counters and timings of what the extension does, per cookie (cookie.stats)
+	and for the whole process (LibmagicRb.stats).
+
+	Counters:
+		calls: calls of methods taking a cookie's lock, and of LibmagicRb.check()
+		errors: those of them that raised
+		loads: databases loaded
+		checks: files and buffers checked
+		bytes: bytes checked from memory (magic_buffer(), and files read by mmap: or check_all())
+		fast_path: checks answered by the fast path, without libmagic (see signature.h)
+		timeouts: checks abandoned at their deadline (see timeout.h)
+
+	Phases, each with the number of times, total and max nanoseconds on the monotonic clock:
+		lock: waiting for the cookie's lock, held by another thread
+		load: loading databases
+		validate: checking that paths exist and are readable, and that databases are valid
+		check: libmagic checking files and buffers, along with reading the files
+
+	Cookie stats are only updated while holding the cookie's lock, and read with the GVL.
+	The process stats are also updated by scan() threads, without the GVL, so they're atomic.
+*/
+#include <time.h>
+
+#define STATS_CALLS 0
+#define STATS_ERRORS 1
+#define STATS_LOADS 2
+#define STATS_CHECKS 3
+#define STATS_BYTES 4
+#define STATS_FAST_PATH 5
+#define STATS_TIMEOUTS 6
+#define STATS_COUNTERS 7
+
+#define STATS_LOCK 0
+#define STATS_LOAD 1
+#define STATS_VALIDATE 2
+#define STATS_CHECK 3
+#define STATS_PHASES 4
+
+const char *statsCounterNames[STATS_COUNTERS] = { "calls", "errors", "loads", "checks", "bytes", "fast_path", "timeouts" } ;
+const char *statsPhaseNames[STATS_PHASES] = { "lock", "load", "validate", "check" } ;
+
+typedef struct {
+	unsigned long long count ;
+	unsigned long long totalNs ;
+	unsigned long long maxNs ;
+} statsPhase_t ;
+
+typedef struct {
+	unsigned long long counters[STATS_COUNTERS] ;
+	statsPhase_t phases[STATS_PHASES] ;
+} stats_t ;
+
+stats_t statsGlobal ;
+
+#ifdef __ATOMIC_RELAXED
+	#define STATS_ATOMIC_ADD(field, value) __atomic_fetch_add(&(field), (value), __ATOMIC_RELAXED)
+	#define STATS_ATOMIC_SUB(field, value) __atomic_fetch_sub(&(field), (value), __ATOMIC_RELAXED)
+	#define STATS_ATOMIC_LOAD(field) __atomic_load_n(&(field), __ATOMIC_RELAXED)
+	#define STATS_ATOMIC_STORE(field, value) __atomic_store_n(&(field), (value), __ATOMIC_RELAXED)
+#else
+	#define STATS_ATOMIC_ADD(field, value) ((field) += (value))
+	#define STATS_ATOMIC_SUB(field, value) ((field) -= (value))
+	#define STATS_ATOMIC_LOAD(field) (field)
+	#define STATS_ATOMIC_STORE(field, value) ((field) = (value))
+#endif
+
+unsigned long long statsNow(void) {
+	#ifdef CLOCK_MONOTONIC
+		struct timespec ts ;
+		clock_gettime(CLOCK_MONOTONIC, &ts) ;
+		return ts.tv_sec * 1000000000ULL + ts.tv_nsec ;
+	#else
+		return 0 ;
+	#endif
+}
+
+// Adds to a counter of the cookie stats (if any), and of the process
+void statsCount(stats_t *stats, int counter, unsigned long long value) {
+	if (stats) stats->counters[counter] += value ;
+	STATS_ATOMIC_ADD(statsGlobal.counters[counter], value) ;
+}
+
+void statsMax(unsigned long long *max, unsigned long long value) {
+	#ifdef __ATOMIC_RELAXED
+		unsigned long long current = __atomic_load_n(max, __ATOMIC_RELAXED) ;
+
+		while (value > current &&
+			!__atomic_compare_exchange_n(max, &current, value, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED)
+		) ;
+	#else
+		if (value > *max) *max = value ;
+	#endif
+}
+
+// Adds the time since started to a phase of the cookie stats (if any), and of the process
+void statsTime(stats_t *stats, int phase, unsigned long long started) {
+	unsigned long long elapsed = statsNow() - started ;
+
+	if (stats) {
+		statsPhase_t *p = &stats->phases[phase] ;
+		p->count++ ;
+		p->totalNs += elapsed ;
+		if (elapsed > p->maxNs) p->maxNs = elapsed ;
+	}
+
+	statsPhase_t *g = &statsGlobal.phases[phase] ;
+	STATS_ATOMIC_ADD(g->count, 1) ;
+	STATS_ATOMIC_ADD(g->totalNs, elapsed) ;
+	statsMax(&g->maxNs, elapsed) ;
+}
+
+// Runs func(arg), counting the call, and the error if it raises
+VALUE statsProtect(stats_t *stats, VALUE (*func)(VALUE), VALUE arg) {
+	statsCount(stats, STATS_CALLS, 1) ;
+
+	int state = 0 ;
+	VALUE result = rb_protect(func, arg, &state) ;
+
+	if (state) {
+		statsCount(stats, STATS_ERRORS, 1) ;
+		rb_jump_tag(state) ;
+	}
+
+	return result ;
+}
+
+VALUE statsHash(stats_t *stats) {
+	VALUE hash = rb_hash_new() ;
+
+	for(int i = 0 ; i < STATS_COUNTERS ; i++)
+		rb_hash_aset(hash, ID2SYM(rb_intern(statsCounterNames[i])), ULL2NUM(STATS_ATOMIC_LOAD(stats->counters[i]))) ;
+
+	for(int i = 0 ; i < STATS_PHASES ; i++) {
+		statsPhase_t *p = &stats->phases[i] ;
+		VALUE phase = rb_hash_new() ;
+
+		rb_hash_aset(phase, ID2SYM(rb_intern("count")), ULL2NUM(STATS_ATOMIC_LOAD(p->count))) ;
+		rb_hash_aset(phase, ID2SYM(rb_intern("total_ns")), ULL2NUM(STATS_ATOMIC_LOAD(p->totalNs))) ;
+		rb_hash_aset(phase, ID2SYM(rb_intern("max_ns")), ULL2NUM(STATS_ATOMIC_LOAD(p->maxNs))) ;
+
+		rb_hash_aset(hash, ID2SYM(rb_intern(statsPhaseNames[i])), phase) ;
+	}
+
+	return hash ;
+}
+
+void statsReset(stats_t *stats) {
+	for(int i = 0 ; i < STATS_COUNTERS ; i++) STATS_ATOMIC_STORE(stats->counters[i], 0) ;
+
+	for(int i = 0 ; i < STATS_PHASES ; i++) {
+		STATS_ATOMIC_STORE(stats->phases[i].count, 0) ;
+		STATS_ATOMIC_STORE(stats->phases[i].totalNs, 0) ;
+		STATS_ATOMIC_STORE(stats->phases[i].maxNs, 0) ;
+	}
+}
+
+/*
+	Returns counters and timings of all the cookies, LibmagicRb.check() and LibmagicRb.scan(),
+	since the process started (or LibmagicRb.reset_stats). For example:
+
+		> LibmagicRb.check(file: '/usr/share/dict/words')
+		# => "text/plain; charset=utf-8"
+
+		> LibmagicRb.stats
+		# => {:calls=>1, :errors=>0, :loads=>1, :checks=>1, :bytes=>0, :fast_path=>0, :timeouts=>0,
+		#	:lock=>{:count=>0, :total_ns=>0, :max_ns=>0},
+		#	:load=>{:count=>1, :total_ns=>38914213, :max_ns=>38914213},
+		#	:validate=>{:count=>1, :total_ns=>2194, :max_ns=>2194},
+		#	:check=>{:count=>1, :total_ns=>501876, :max_ns=>501876}}
+
+	See LibmagicRb#stats for what they count. Stats of cookies that are garbage collected stay here.
+*/
+static VALUE _stats_(volatile VALUE obj) {
+	return statsHash(&statsGlobal) ;
+}
+
+/*
+	Sets all the process stats to 0, stats of cookies are kept. Returns nil.
+*/
+static VALUE _resetStats_(volatile VALUE obj) {
+	statsReset(&statsGlobal) ;
+	return Qnil ;
+}
@@ -0,0 +1,431 @@
+/*
+	Deadlines for check() and magic_buffer() (check(timeout: 0.5)), for files and buffers
+	that libmagic takes too long on, like regex rules backtracking over crafted input.
+
+	libmagic has no way to abort a call half way. So a call with a deadline runs on a native
+	thread of its own, while the caller waits for it without the GVL, until the call is done,
+	the deadline passes, or ruby interrupts the wait (Thread#raise, Timeout.timeout, signals).
+
+	When the caller gives up, the call is abandoned: its thread runs it to completion, then
+	closes the magic_t and frees the call. The cookie gets a fresh magic_t with the same flags
+	and parameters, and loads the database again on its next call, so it stays usable.
+	The call reads a copy of the path or bytes, as ruby frees its heap on exit, while abandoned
+	calls may still run. Database buffers of the cookie are kept alive by the list of abandoned calls.
+
+	Every abandoned call holds a thread and a magic_t with its database until it's done. So with
+	TIMEOUT_ABANDONED_MAX of them still running, calls with a deadline raise LibmagicRb::TimeoutError
+	right away, instead of piling more up. A forked child has none of their threads, it starts
+	with no abandoned call.
+*/
+#include <math.h>
+
+#ifdef HAVE_PTHREAD_H
+#define HAVE_TIMEOUT 1
+#include <pthread.h>
+#include <signal.h>
+
+typedef struct timeoutCall {
+	// s.call is the first member, so func is given either
+	signatureCall_t s ;
+	void *(*func)(void *) ;
+
+	// Database buffers of the cookie, libmagic reads them in place
+	VALUE buffers ;
+
+	pthread_mutex_t lock ;
+	pthread_cond_t cond ;
+	clockid_t clock ;
+	struct timespec deadline ;
+
+	volatile char done ;
+	volatile char interrupted ;
+	char abandoned ;
+
+	struct timeoutCall *next ;
+
+	// The path, or the bytes checked
+	char data[] ;
+} timeoutCall_t ;
+
+#define TIMEOUT_ABANDONED_MAX 16
+
+// Calls abandoned and still running. Their threads unlink them without the GVL.
+pthread_mutex_t timeoutsLock = PTHREAD_MUTEX_INITIALIZER ;
+timeoutCall_t *timeoutsAbandoned = NULL ;
+unsigned int timeoutsAbandonedCount = 0 ;
+
+void timeoutsPrepare(void) { pthread_mutex_lock(&timeoutsLock) ; }
+void timeoutsParent(void) { pthread_mutex_unlock(&timeoutsLock) ; }
+
+// The calls are left as they are, their threads don't exist in the child
+void timeoutsChild(void) {
+	pthread_mutex_init(&timeoutsLock, NULL) ;
+	timeoutsAbandoned = NULL ;
+	timeoutsAbandonedCount = 0 ;
+}
+
+// Marks the database buffers of abandoned calls
+VALUE timeoutKeeper = Qnil ;
+
+void timeoutKeeperMark(void *data) {
+	pthread_mutex_lock(&timeoutsLock) ;
+
+	// Pinned, libmagic holds pointers to their bytes
+	for(timeoutCall_t *t = timeoutsAbandoned ; t ; t = t->next) {
+		if (NIL_P(t->buffers)) continue ;
+		rb_gc_mark(t->buffers) ;
+
+		for(long i = 0 ; i < RARRAY_LEN(t->buffers) ; i++)
+			rb_gc_mark(RARRAY_AREF(t->buffers, i)) ;
+	}
+
+	pthread_mutex_unlock(&timeoutsLock) ;
+}
+
+static const rb_data_type_t timeoutKeeperType = {
+	.wrap_struct_name = "timeouts",
+
+	.function = {
+		.dmark = timeoutKeeperMark,
+	},
+
+	.data = NULL,
+} ;
+
+void timeoutFree(timeoutCall_t *t) {
+	pthread_cond_destroy(&t->cond) ;
+	pthread_mutex_destroy(&t->lock) ;
+	free(t) ;
+}
+
+void *timeoutRun(void *data) {
+	timeoutCall_t *t = data ;
+	t->func(&t->s) ;
+
+	pthread_mutex_lock(&t->lock) ;
+	t->done = 1 ;
+	char abandoned = t->abandoned ;
+	pthread_cond_signal(&t->cond) ;
+	pthread_mutex_unlock(&t->lock) ;
+
+	if (!abandoned) return NULL ;
+
+	pthread_mutex_lock(&timeoutsLock) ;
+
+	timeoutCall_t **link = &timeoutsAbandoned ;
+	while (*link != t) link = &(*link)->next ;
+	*link = t->next ;
+	timeoutsAbandonedCount-- ;
+
+	pthread_mutex_unlock(&timeoutsLock) ;
+
+	magic_close(t->s.call.magic) ;
+	timeoutFree(t) ;
+
+	return NULL ;
+}
+
+void *timeoutWait(void *data) {
+	timeoutCall_t *t = data ;
+
+	pthread_mutex_lock(&t->lock) ;
+
+	while (!t->done && !t->interrupted) {
+		// Anything but a wake up ends the wait, the caller checks the deadline
+		if (pthread_cond_timedwait(&t->cond, &t->lock, &t->deadline) != 0) break ;
+	}
+
+	pthread_mutex_unlock(&t->lock) ;
+	return NULL ;
+}
+
+void timeoutUnblock(void *data) {
+	timeoutCall_t *t = data ;
+
+	pthread_mutex_lock(&t->lock) ;
+	t->interrupted = 1 ;
+	pthread_cond_signal(&t->cond) ;
+	pthread_mutex_unlock(&t->lock) ;
+}
+
+char timeoutExpired(timeoutCall_t *t) {
+	struct timespec now ;
+	clock_gettime(t->clock, &now) ;
+
+	return now.tv_sec > t->deadline.tv_sec ||
+		(now.tv_sec == t->deadline.tv_sec && now.tv_nsec >= t->deadline.tv_nsec) ;
+}
+
+/*
+	Hands the call over to its thread. Returns 0 if the call is done already,
+	then it's still the caller's.
+*/
+char timeoutAbandon(timeoutCall_t *t) {
+	pthread_mutex_lock(&timeoutsLock) ;
+	pthread_mutex_lock(&t->lock) ;
+
+	char abandoned = !t->done ;
+
+	if (abandoned) {
+		t->abandoned = 1 ;
+		t->next = timeoutsAbandoned ;
+		timeoutsAbandoned = t ;
+		timeoutsAbandonedCount++ ;
+	}
+
+	pthread_mutex_unlock(&t->lock) ;
+	pthread_mutex_unlock(&timeoutsLock) ;
+
+	return abandoned ;
+}
+
+/*
+	Opens a magic_t with the same flags and parameters, to replace the one of a call
+	that's abandoned. Returns NULL if it can't be opened.
+*/
+magic_t timeoutReopen(magic_t old, int mode) {
+	const int params[] = {
+		#ifdef MAGIC_PARAM_INDIR_MAX
+			MAGIC_PARAM_INDIR_MAX,
+		#endif
+		#ifdef MAGIC_PARAM_NAME_MAX
+			MAGIC_PARAM_NAME_MAX,
+		#endif
+		#ifdef MAGIC_PARAM_ELF_PHNUM_MAX
+			MAGIC_PARAM_ELF_PHNUM_MAX,
+		#endif
+		#ifdef MAGIC_PARAM_ELF_SHNUM_MAX
+			MAGIC_PARAM_ELF_SHNUM_MAX,
+		#endif
+		#ifdef MAGIC_PARAM_ELF_NOTES_MAX
+			MAGIC_PARAM_ELF_NOTES_MAX,
+		#endif
+		#ifdef MAGIC_PARAM_REGEX_MAX
+			MAGIC_PARAM_REGEX_MAX,
+		#endif
+		#ifdef MAGIC_PARAM_BYTES_MAX
+			MAGIC_PARAM_BYTES_MAX,
+		#endif
+		#ifdef MAGIC_PARAM_ENCODING_MAX
+			MAGIC_PARAM_ENCODING_MAX,
+		#endif
+		-1
+	} ;
+
+	magic_t magic = magic_open(mode) ;
+
+	#if MAGIC_VERSION > 525
+		// libmagic only reads parameters while checking
+		for(int i = 0 ; magic && params[i] != -1 ; i++) {
+			size_t value ;
+			if (magic_getparam(old, params[i], &value) == 0) magic_setparam(magic, params[i], &value) ;
+		}
+	#else
+		(void)params ;
+		(void)old ;
+	#endif
+
+	return magic ;
+}
+
+/*
+	Gives up on the call. The cookie gets a fresh magic_t, and loads the database again
+	on its next call. Returns 0 if the call is done already, then it's still the caller's.
+*/
+char timeoutGiveUp(cookie_t *cookie, timeoutCall_t *t, int mode) {
+	// Opened before the call is abandoned, its thread closes the magic_t once done
+	magic_t magic = timeoutReopen(t->s.call.magic, mode) ;
+
+	if (!timeoutAbandon(t)) {
+		if (magic) magic_close(magic) ;
+		return 0 ;
+	}
+
+	// Without a magic_t, the cookie raises LibmagicRb::FileClosedError
+	cookie->magic = magic ;
+	cookie->loaded = 0 ;
+	cookie->signaturesChecked = 0 ;
+
+	return 1 ;
+}
+
+// Waits for the call, then handles interrupts. Ruby may raise them on its own, as the wait returns.
+static VALUE timeoutWaitInterruptible(VALUE data) {
+	timeoutCall_t *t = (timeoutCall_t *)data ;
+
+	magicWithoutGVL(timeoutWait, t, timeoutUnblock, t) ;
+	if (!t->done) rb_thread_check_ints() ;
+
+	return Qnil ;
+}
+
+/*
+	Runs t->func on a thread of its own, and waits for it until the deadline.
+	Raises LibmagicRb::TimeoutError when the deadline passes, and lets ruby interrupts through,
+	either way the call is abandoned. Frees t, unless it's abandoned.
+	mode is the cookie's flags.
+*/
+void timeoutCallRun(cookie_t *cookie, timeoutCall_t *t, double seconds, int mode) {
+	pthread_condattr_t attr ;
+	pthread_condattr_init(&attr) ;
+
+	t->clock = CLOCK_REALTIME ;
+	#if defined(HAVE_PTHREAD_CONDATTR_SETCLOCK) && defined(CLOCK_MONOTONIC)
+		if (pthread_condattr_setclock(&attr, CLOCK_MONOTONIC) == 0) t->clock = CLOCK_MONOTONIC ;
+	#endif
+
+	pthread_mutex_init(&t->lock, NULL) ;
+	pthread_cond_init(&t->cond, &attr) ;
+	pthread_condattr_destroy(&attr) ;
+
+	clock_gettime(t->clock, &t->deadline) ;
+	double whole = (double)(time_t)seconds ;
+	t->deadline.tv_sec += (time_t)whole ;
+	t->deadline.tv_nsec += (long)((seconds - whole) * 1e9) ;
+
+	if (t->deadline.tv_nsec >= 1000000000L) {
+		t->deadline.tv_sec++ ;
+		t->deadline.tv_nsec -= 1000000000L ;
+	}
+
+	pthread_mutex_lock(&timeoutsLock) ;
+	char full = timeoutsAbandonedCount >= TIMEOUT_ABANDONED_MAX ;
+	pthread_mutex_unlock(&timeoutsLock) ;
+
+	if (full) {
+		timeoutFree(t) ;
+		rb_raise(rb_eTimeoutError, "%d checks past their timeout are still running", TIMEOUT_ABANDONED_MAX) ;
+	}
+
+	pthread_t thread ;
+	pthread_attr_t threadAttr ;
+	pthread_attr_init(&threadAttr) ;
+	pthread_attr_setdetachstate(&threadAttr, PTHREAD_CREATE_DETACHED) ;
+
+	// Signals are for ruby threads to handle
+	sigset_t all, old ;
+	sigfillset(&all) ;
+	pthread_sigmask(SIG_SETMASK, &all, &old) ;
+	int err = pthread_create(&thread, &threadAttr, timeoutRun, t) ;
+	pthread_sigmask(SIG_SETMASK, &old, NULL) ;
+	pthread_attr_destroy(&threadAttr) ;
+
+	if (err) {
+		timeoutFree(t) ;
+		rb_syserr_fail(err, "pthread_create") ;
+	}
+
+	for(;;) {
+		// An interrupt that raises abandons the call
+		int state = 0 ;
+		rb_protect(timeoutWaitInterruptible, (VALUE)t, &state) ;
+
+		if (state) {
+			if (!timeoutGiveUp(cookie, t, mode)) timeoutFree(t) ;
+			rb_jump_tag(state) ;
+		}
+
+		if (t->done) break ;
+		t->interrupted = 0 ;
+
+		if (timeoutExpired(t)) {
+			// Done right at the deadline, the result is there
+			if (!timeoutGiveUp(cookie, t, mode)) break ;
+
+			statsCount(&cookie->stats, STATS_TIMEOUTS, 1) ;
+			rb_raise(rb_eTimeoutError, "Check took longer than %g seconds", seconds) ;
+		}
+	}
+}
+
+// A call of the cookie's magic_t, on a copy of length bytes of data, NUL terminated
+timeoutCall_t *timeoutCallNew(cookie_t *cookie, const void *data, size_t length) {
+	timeoutCall_t *t = calloc(1, sizeof(*t) + length + 1) ;
+	if (!t) rb_memerror() ;
+
+	memcpy(t->data, data, length) ;
+	t->s.call.magic = cookie->magic ;
+	t->buffers = cookie->buffers ;
+
+	return t ;
+}
+#endif
+
+/*
+	Checks a file like cookieFileNoGVL(), giving up after seconds.
+	mode is the cookie's flags.
+*/
+const char *cookieFileTimed(cookie_t *cookie, const char *path, int mode, double seconds) {
+	#ifdef HAVE_TIMEOUT
+		timeoutCall_t *t = timeoutCallNew(cookie, path, strlen(path)) ;
+
+		t->s.call.op = MAGIC_CALL_FILE ;
+		t->s.call.path = t->data ;
+		t->func = cookie->mmap ? mmapRun : magicCallRun ;
+
+		if (cookie->fastPath && signatureFlags(mode)) {
+			signaturesCheck(cookie, mode) ;
+
+			t->s.enabled = cookie->signatures ;
+			t->s.flags = mode ;
+			t->s.window = signatureWindow(cookie->magic) ;
+			t->s.mmap = cookie->mmap ;
+			t->func = signatureRun ;
+		}
+
+		timeoutCallRun(cookie, t, seconds, mode) ;
+
+		const char *result = t->s.call.result ;
+		if (t->s.fast) statsCount(&cookie->stats, STATS_FAST_PATH, 1) ;
+		timeoutFree(t) ;
+
+		return result ;
+	#else
+		rb_raise(rb_eNotImpError, "Timeouts are not supported on this platform") ;
+	#endif
+}
+
+/*
+	Checks bytes like magicBufferNoGVL(), giving up after seconds.
+	mode is the cookie's flags.
+*/
+const char *cookieBufferTimed(cookie_t *cookie, const void *buffer, size_t length, int mode, double seconds) {
+	#ifdef HAVE_TIMEOUT
+		timeoutCall_t *t = timeoutCallNew(cookie, buffer, length) ;
+
+		t->s.call.op = MAGIC_CALL_BUFFER ;
+		t->s.call.buffer = t->data ;
+		t->s.call.length = length ;
+		t->func = magicCallRun ;
+
+		timeoutCallRun(cookie, t, seconds, mode) ;
+
+		const char *result = t->s.call.result ;
+		timeoutFree(t) ;
+
+		return result ;
+	#else
+		rb_raise(rb_eNotImpError, "Timeouts are not supported on this platform") ;
+	#endif
+}
+
+// Longer timeouts are clamped to a day, the deadline has to fit a timespec
+#define TIMEOUT_MAX 86400.0
+
+/*
+	Returns the timeout: keyword of opts as a Float, or nil without one.
+	Raises ArgumentError unless it's a finite Numeric greater than 0.
+*/
+VALUE timeoutOption(VALUE opts) {
+	VALUE timeout = NIL_P(opts) ? Qnil : rb_hash_aref(opts, ID2SYM(rb_intern("timeout"))) ;
+	if (NIL_P(timeout)) return Qnil ;
+
+	if (!rb_obj_is_kind_of(timeout, rb_cNumeric)) rb_raise(rb_eArgError, "Timeout must be an instance of Numeric.") ;
+
+	double seconds = NUM2DBL(timeout) ;
+	if (!isfinite(seconds)) rb_raise(rb_eArgError, "Timeout must be finite.") ;
+	if (!(seconds > 0)) rb_raise(rb_eArgError, "Timeout must be greater than 0.") ;
+	if (seconds > TIMEOUT_MAX) seconds = TIMEOUT_MAX ;
+
+	return DBL2NUM(seconds) ;
+}
@@ -0,0 +1,277 @@
+/*
+	Hooks around the phases of stats.h (lock, load, validate, check), to find where slow calls spend their time.
+
+	With sys/sdt.h (systemtap-sdt-dev on Debian and Ubuntu), every phase fires USDT probes of the
+	libmagic_rb provider, that bpftrace, perf or SystemTap can attach to:
+
+		phase__start(char *phase, char *path)
+		phase__done(char *phase, unsigned long long ns)
+
+	path is the file or database the phase is about, NULL when there's none (the lock, buffers,
+	the system database). A probe is a nop instruction until a tracer attaches to it.
+	Phases of LibmagicRb.scan() fire in its worker threads.
+
+	LibmagicRb.trace() sets a block called after sampled calls, with the time each phase took.
+	A sampled call keeps the phases it goes through in a trace_t, found through the fiber local
+	traceKey: under a Fiber scheduler, calls of several fibers run interleaved on one thread.
+	The thread local traceSampled counts the sampled calls of the thread, so other calls, and the
+	native threads of scan.h, don't look it up. The block runs after the call, once the cookie's
+	lock is released.
+
+	The block isn't shareable, so it belongs to the Ractor that set it, in a traceHook_t of the
+	Ractor's local storage. Calls of other Ractors aren't traced. traceHooks counts the Ractors
+	with a block, so calls don't look theirs up while there's none.
+*/
+#if defined(HAVE_SYS_SDT_H)
+#include <sys/sdt.h>
+#endif
+
+#if defined(DTRACE_PROBE2)
+	#define TRACE_PROBE_START(phase, path) DTRACE_PROBE2(libmagic_rb, phase__start, statsPhaseNames[phase], path)
+	#define TRACE_PROBE_DONE(phase, ns) DTRACE_PROBE2(libmagic_rb, phase__done, statsPhaseNames[phase], ns)
+#else
+	#define TRACE_PROBE_START(phase, path)
+	#define TRACE_PROBE_DONE(phase, ns)
+#endif
+
+#if defined(__GNUC__) || defined(__clang__)
+	#define TRACE_THREAD __thread
+#elif defined(__STDC_VERSION__) && __STDC_VERSION__ >= 201112L
+	#define TRACE_THREAD _Thread_local
+#endif
+
+typedef struct trace {
+	// The path of the last phase that had one
+	VALUE path ;
+	unsigned long long ns[STATS_PHASES] ;
+	unsigned int count[STATS_PHASES] ;
+} trace_t ;
+
+VALUE cLibmagicRbTrace ;
+
+// The block of LibmagicRb.trace() of a Ractor, called every `every` calls
+typedef struct {
+	VALUE hook ;
+	unsigned long every ;
+	unsigned long calls ;
+} traceHook_t ;
+
+unsigned long traceHooks = 0 ;
+
+#ifdef HAVE_RACTOR
+	void traceHookMark(void *ptr) {
+		rb_gc_mark(((traceHook_t *)ptr)->hook) ;
+	}
+
+	void traceHookFree(void *ptr) {
+		if (!NIL_P(((traceHook_t *)ptr)->hook)) STATS_ATOMIC_SUB(traceHooks, 1) ;
+		free(ptr) ;
+	}
+
+	const struct rb_ractor_local_storage_type traceHookType = { traceHookMark, traceHookFree } ;
+	rb_ractor_local_key_t traceHookKey ;
+#else
+	traceHook_t traceHookGlobal = { .hook = Qnil } ;
+#endif
+
+// The traceHook_t of the current Ractor, or NULL if it never had one and create is 0
+traceHook_t *traceHookCurrent(char create) {
+	#ifdef HAVE_RACTOR
+		traceHook_t *hook = rb_ractor_local_storage_ptr(traceHookKey) ;
+
+		if (!hook && create) {
+			hook = calloc(1, sizeof(traceHook_t)) ;
+			if (!hook) rb_raise(rb_eNoMemError, "Failed to allocate the trace hook") ;
+
+			hook->hook = Qnil ;
+			rb_ractor_local_storage_ptr_set(traceHookKey, hook) ;
+		}
+
+		return hook ;
+	#else
+		return &traceHookGlobal ;
+	#endif
+}
+
+#ifdef TRACE_THREAD
+	// Sampled calls in progress on this thread, in any of its fibers
+	static TRACE_THREAD unsigned int traceSampled = 0 ;
+
+	// Fiber local, the trace of the sampled call of the fiber
+	ID traceKey ;
+
+	void traceMark(void *ptr) {
+		rb_gc_mark(((trace_t *)ptr)->path) ;
+	}
+
+	static const rb_data_type_t traceType = {
+		.wrap_struct_name = "trace",
+
+		.function = {
+			.dmark = traceMark,
+			.dfree = RUBY_TYPED_DEFAULT_FREE,
+		},
+
+		.data = NULL,
+	} ;
+
+	// The sampled call running on this fiber, if any. Sampled calls run on Ruby threads, holding the GVL here.
+	trace_t *traceCurrent(void) {
+		if (!traceSampled) return NULL ;
+
+		VALUE trace = rb_thread_local_aref(rb_thread_current(), traceKey) ;
+		return NIL_P(trace) ? NULL : RTYPEDDATA_DATA(trace) ;
+	}
+#endif
+
+// Starts a phase, returns the time it started for traceEnd()
+unsigned long long traceBegin(int phase, const char *path) {
+	TRACE_PROBE_START(phase, path) ;
+
+	#ifdef TRACE_THREAD
+		trace_t *trace = path ? traceCurrent() : NULL ;
+		if (trace) trace->path = rb_str_new_cstr(path) ;
+	#endif
+
+	return statsNow() ;
+}
+
+// Ends a phase, timing it in the stats (NULL for the process stats only), and in the sampled call
+void traceEnd(stats_t *stats, int phase, unsigned long long started) {
+	unsigned long long elapsed = statsNow() - started ;
+
+	statsTime(stats, phase, started) ;
+	TRACE_PROBE_DONE(phase, elapsed) ;
+
+	#ifdef TRACE_THREAD
+		trace_t *trace = traceCurrent() ;
+
+		if (trace) {
+			trace->ns[phase] += elapsed ;
+			trace->count[phase]++ ;
+		}
+	#endif
+}
+
+/*
+	Runs func(arg). When it's a sampled call, calls the block of LibmagicRb.trace() afterwards,
+	even if func raised. Errors of the block are raised.
+*/
+VALUE traceCall(VALUE (*func)(VALUE), VALUE arg) {
+	#ifdef TRACE_THREAD
+		if (!STATS_ATOMIC_LOAD(traceHooks)) return func(arg) ;
+
+		traceHook_t *current = traceHookCurrent(0) ;
+		if (!current || NIL_P(current->hook) || ++current->calls % current->every) return func(arg) ;
+
+		volatile VALUE hook = current->hook ;
+		ID name = rb_frame_this_func() ;
+
+		trace_t *trace ;
+		volatile VALUE traced = TypedData_Make_Struct(rb_cObject, trace_t, &traceType, trace) ;
+		trace->path = Qnil ;
+
+		// Restored once done, the fiber may have been in a sampled call already
+		volatile VALUE thread = rb_thread_current() ;
+		volatile VALUE previous = rb_thread_local_aref(thread, traceKey) ;
+
+		unsigned long long started = statsNow() ;
+		rb_thread_local_aset(thread, traceKey, traced) ;
+		traceSampled++ ;
+
+		int state = 0 ;
+		volatile VALUE result = rb_protect(func, arg, &state) ;
+
+		traceSampled-- ;
+		rb_thread_local_aset(thread, traceKey, previous) ;
+		unsigned long long elapsed = statsNow() - started ;
+
+		volatile VALUE error = state ? rb_errinfo() : Qnil ;
+		if (!rb_obj_is_kind_of(error, rb_eException)) error = Qnil ;
+
+		volatile VALUE phases = rb_hash_new() ;
+		for(int i = 0 ; i < STATS_PHASES ; i++) {
+			if (trace->count[i]) rb_hash_aset(phases, ID2SYM(rb_intern(statsPhaseNames[i])), ULL2NUM(trace->ns[i])) ;
+		}
+
+		rb_funcall(hook, rb_intern("call"), 1, rb_struct_new(cLibmagicRbTrace,
+			name ? ID2SYM(name) : Qnil, trace->path, ULL2NUM(elapsed), phases, error
+		)) ;
+
+		if (state) {
+			if (!NIL_P(error)) rb_set_errinfo(error) ;
+			rb_jump_tag(state) ;
+		}
+
+		return result ;
+	#else
+		return func(arg) ;
+	#endif
+}
+
+/*
+	Calls the block after sampled calls of LibmagicRb.check() and the methods of cookies,
+	with a LibmagicRb::Trace of where the call spent its time. For example:
+
+		> LibmagicRb.trace(sample: 0.01) { |trace| warn trace.inspect if trace.total_ns > 10_000_000 }
+		# => nil
+
+		> cookie.check
+		# => "application/pdf; charset=binary"
+
+		#<struct LibmagicRb::Trace name=:check, path="/tmp/report.pdf", total_ns=10523113,
+		#	phases={:lock=>1203, :validate=>2410, :check=>10491764}, error=nil>
+
+	[sample] The share of calls traced, 1 traces every call, 0.01 one call in 100. Defaults to 1.
+
+	phases has the nanoseconds spent in each phase the call went through: waiting for the lock,
+	loading and validating databases, validating the file, and checking. error is the exception
+	the call raised, which is raised again after the block. Errors of the block are raised by the call.
+
+	Calls that aren't sampled cost a comparison. LibmagicRb.untrace() removes the block.
+	The block is the current Ractor's, calls of other Ractors aren't traced.
+	The phases also fire USDT probes for bpftrace, when the extension is built with sys/sdt.h.
+	Returns nil.
+*/
+static VALUE _trace_(int argc, VALUE *argv, volatile VALUE obj) {
+	VALUE opts, block ;
+	rb_scan_args(argc, argv, "0:&", &opts, &block) ;
+
+	#ifdef TRACE_THREAD
+		if (NIL_P(block)) rb_raise(rb_eArgError, "Expected a block.") ;
+
+		VALUE argSample = NIL_P(opts) ? Qnil : rb_hash_aref(opts, ID2SYM(rb_intern("sample"))) ;
+		double sample = 1 ;
+
+		if (!NIL_P(argSample)) {
+			if (!rb_obj_is_kind_of(argSample, rb_cNumeric)) rb_raise(rb_eArgError, "Sample must be an instance of Numeric.") ;
+			sample = NUM2DBL(argSample) ;
+		}
+
+		if (!(sample > 0 && sample <= 1)) rb_raise(rb_eArgError, "Sample must be greater than 0 and at most 1.") ;
+
+		traceHook_t *current = traceHookCurrent(1) ;
+		if (NIL_P(current->hook)) STATS_ATOMIC_ADD(traceHooks, 1) ;
+
+		current->every = (unsigned long)(1 / sample + 0.5) ;
+		current->calls = 0 ;
+		current->hook = block ;
+		return Qnil ;
+	#else
+		rb_raise(rb_eNotImpError, "LibmagicRb.trace() is not supported on this platform") ;
+	#endif
+}
+
+/*
+	Removes the block of LibmagicRb.trace() of the current Ractor. USDT probes aren't affected. Returns nil.
+*/
+static VALUE _untrace_(volatile VALUE obj) {
+	traceHook_t *current = traceHookCurrent(0) ;
+
+	if (current && !NIL_P(current->hook)) {
+		current->hook = Qnil ;
+		STATS_ATOMIC_SUB(traceHooks, 1) ;
+	}
+
+	return Qnil ;
+}
@@ -1,9 +1,39 @@
+// Error class for errno set by access(), stat() or open() on a file to check
+VALUE fileErrorClass(int err) {
+	return (err == EACCES || err == EPERM) ? rb_eFileNotReadableError : rb_eFileNotFoundError ;
+}
+
+/*
+	Capacities given as options, for a type of the caller that holds up to max. name is for the error.
+	Raises ArgumentError if negative or past max, instead of wrapping around.
+*/
+unsigned long long capacityValue(volatile VALUE value, const char *name, unsigned long long max) {
+	value = rb_to_int(value) ;
+
+	char negative = FIXNUM_P(value) ? FIX2LONG(value) < 0 : !rb_big_sign(value) ;
+	if (negative) rb_raise(rb_eArgError, "%s must not be negative.", name) ;
+
+	if (rb_absint_size(value, NULL) > sizeof(unsigned long long) || NUM2ULL(value) > max)
+		rb_raise(rb_eArgError, "%s must be at most %llu.", name, max) ;
+
+	return NUM2ULL(value) ;
+}
+
 void fileReadable(char *filePath) {
-	if(access(filePath, F_OK)) rb_raise(rb_eFileNotFoundError, "%s", filePath) ;
-	if(access(filePath, R_OK)) rb_raise(rb_eFileNotReadableError, "%s", filePath) ;
+	if(access(filePath, R_OK)) rb_raise(fileErrorClass(errno), "%s", filePath) ;
 }
 
-void magic_validate_db(magic_t cookie, char *databasePath) {
+// fileReadable(), traced in the validate phase of stats (NULL for the process stats only)
+void fileReadableStats(char *filePath, stats_t *stats) {
+	unsigned long long started = traceBegin(STATS_VALIDATE, filePath) ;
+	int status = access(filePath, R_OK) ;
+	int err = errno ;
+
+	traceEnd(stats, STATS_VALIDATE, started) ;
+	if(status) rb_raise(fileErrorClass(err), "%s", filePath) ;
+}
+
+void dbPathReadable(char *databasePath) {
 	struct stat statbuf ;
 
 	if (stat(databasePath, &statbuf) != 0)
@@ -13,8 +43,12 @@ void magic_validate_db(magic_t cookie, char *databasePath) {
 		rb_raise(rb_eIsDirError, "%s", databasePath) ;
 
 	if(access(databasePath, R_OK)) rb_raise(rb_eFileNotReadableError, "%s", databasePath) ;
+}
+
+void magic_validate_db(magic_t cookie, char *databasePath) {
+	dbPathReadable(databasePath) ;
 
-	int validFile = magic_check(cookie, databasePath) ;
+	int validFile = magicCheckNoGVL(cookie, databasePath) ;
 
 	if (validFile != 0) {
 		const char *err = magic_error(cookie) ;
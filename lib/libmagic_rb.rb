@@ -2,3 +2,7 @@
 
 require "libmagic_rb/version"
 require "libmagic_rb/main"
+require "libmagic_rb/pool"
+require "libmagic_rb/local"
+require "libmagic_rb/compile"
+require "libmagic_rb/stream"
@@ -0,0 +1,34 @@
+# frozen_string_literal: true
+
+class LibmagicRb
+	# Returns a cookie of the current Ractor opened with the options, with the database loaded.
+	# Later calls with the same options return the same cookie, until it's closed.
+	#
+	# Cookies can't be shared between Ractors, but options can, so a frozen Hash
+	# configures the cookies of all of them:
+	#
+	#	CONFIG = Ractor.make_shareable({ db: nil, mode: LibmagicRb::MAGIC_MIME_TYPE })
+	#
+	#	ractors = paths.each_slice(100).map { |slice|
+	#		Ractor.new(slice) { |x| LibmagicRb.local(**CONFIG).check_many(x) }
+	#	}
+	#
+	#	ractors.flat_map(&:take)    # => ["application/pdf", "image/png", ...]
+	#
+	# [options] Options of LibmagicRb.new(), file: defaults to the current directory.
+	#
+	# Threads of a Ractor share its cookies, like any cookie shared between threads.
+	# Without Ractors, the cookies belong to the process.
+	def self.local(**options)
+		cookies = if defined?(Ractor)
+			Ractor.current[:__libmagic_rb_local__] ||= {}
+		else
+			@local ||= {}
+		end
+
+		cookie = cookies[options]
+		return cookie if cookie && !cookie.closed?
+
+		cookies[options.freeze] = new({ file: ?. }.merge(options)).tap { |x| x.load(options[:db]) }
+	end
+end
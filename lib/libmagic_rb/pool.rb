@@ -0,0 +1,195 @@
+# frozen_string_literal: true
+
+class LibmagicRb
+	# A fixed set of cookies opened with the same db and mode, shared by threads.
+	#
+	# A cookie can't be used by two threads at once, so threads check cookies out,
+	# and check them back in when done. Memory stays bounded to `size` loaded databases,
+	# and cookies are warmed up (database loaded) when the pool is created.
+	#
+	#	pool = LibmagicRb::Pool.new(size: 4)
+	#	pool.check('/usr/share/dict/words')    # => "text/plain; charset=utf-8"
+	#
+	#	pool.with { |cookie|
+	#		cookie.file = '/tmp'
+	#		cookie.check    # => "inode/directory; charset=binary"
+	#	}
+	#
+	#	pool.close
+	class Pool
+		class TimeoutError < RuntimeError
+		end
+
+		attr_reader :size
+
+		# [size] Number of cookies to open.
+		# [db] Database path, nil for the system database.
+		# [mode] Mode of the cookies, nil for the LibmagicRb.new() default.
+		# [timeout] Default seconds to wait for a free cookie in checkout(), nil waits forever.
+		def initialize(size: 4, db: nil, mode: nil, timeout: nil)
+			raise ArgumentError, 'Pool size must be at least 1' if size < 1
+
+			@size = size
+			@timeout = timeout
+
+			@cookies = Array.new(size) {
+				cookie = LibmagicRb.new(file: ?., db: db, mode: mode)
+				cookie.load(db)
+			}
+
+			@available = @cookies.dup
+			@owners = {}
+
+			# The cookie each thread last checked in, held by the pool, weakly keyed so threads can go
+			@affinity = ObjectSpace::WeakMap.new
+
+			@mutex = Mutex.new
+			@cond = ConditionVariable.new
+			@closed = false
+
+			@created_at = monotonic
+			@checkouts = @waits = @peak_in_use = 0
+			@wait_time = @max_wait_time = @busy_time = 0.0
+		end
+
+		# Checks out a cookie for the current thread.
+		# A thread that already holds a cookie gets the same one again, it must be checked in as many times.
+		# Otherwise the cookie last used by this thread is preferred, if it's free.
+		#
+		# Raises LibmagicRb::Pool::TimeoutError if no cookie is free within timeout seconds.
+		def checkout(timeout = @timeout)
+			thread = Thread.current
+
+			@mutex.synchronize {
+				raise LibmagicRb::FileClosedError, 'Pool already closed' if @closed
+
+				if (owned = @owners[thread])
+					owned[1] += 1
+					return owned[0]
+				end
+
+				if @available.empty?
+					started = monotonic
+					deadline = started + timeout if timeout
+
+					while @available.empty?
+						remaining = deadline ? deadline - monotonic : nil
+						raise TimeoutError, "No free cookie in #{timeout} seconds" if remaining && remaining <= 0
+
+						@cond.wait(@mutex, remaining)
+						raise LibmagicRb::FileClosedError, 'Pool already closed' if @closed
+					end
+
+					waited = monotonic - started
+					@waits += 1
+					@wait_time += waited
+					@max_wait_time = waited if waited > @max_wait_time
+				end
+
+				last = @affinity[thread]
+				cookie = (last && @available.delete(last)) || @available.pop
+
+				@owners[thread] = [cookie, 1, monotonic]
+				@checkouts += 1
+
+				in_use = @size - @available.size
+				@peak_in_use = in_use if in_use > @peak_in_use
+
+				cookie
+			}
+		end
+
+		# Checks the cookie of the current thread back in.
+		def checkin(cookie)
+			@mutex.synchronize {
+				owned = @owners[Thread.current]
+				raise ArgumentError, 'Cookie is not checked out by this thread' unless owned && owned[0].equal?(cookie)
+
+				owned[1] -= 1
+				return nil if owned[1] > 0
+
+				@owners.delete(Thread.current)
+				@affinity[Thread.current] = cookie
+				@busy_time += monotonic - owned[2]
+
+				@available.push(cookie)
+				@cond.signal
+			}
+
+			nil
+		end
+
+		# Yields a checked out cookie, and checks it back in.
+		def with(timeout = @timeout)
+			cookie = checkout(timeout)
+
+			begin
+				yield cookie
+			ensure
+				checkin(cookie)
+			end
+		end
+
+		# Checks a file with a cookie from the pool.
+		def check(file, timeout = @timeout)
+			with(timeout) { |cookie|
+				cookie.file = file
+				cookie.check
+			}
+		end
+
+		# Returns a Hash of counters:
+		#
+		#	pool.stats
+		#	# => {:size=>4, :available=>4, :in_use=>0, :peak_in_use=>2, :checkouts=>120, :waits=>3,
+		#	#      :wait_time=>0.0012, :max_wait_time=>0.0006, :busy_time=>0.0551, :utilization=>0.0212}
+		#
+		# [waits] Checkouts that had to wait for a free cookie, wait_time and max_wait_time are in seconds.
+		# [busy_time] Total seconds cookies were checked out.
+		# [utilization] busy_time divided by the time all cookies existed, between 0 and 1.
+		def stats
+			@mutex.synchronize {
+				now = monotonic
+				busy = @busy_time + @owners.each_value.sum { |x| now - x[2] }
+				uptime = (now - @created_at) * @size
+
+				{
+					size: @size,
+					available: @available.size,
+					in_use: @size - @available.size,
+					peak_in_use: @peak_in_use,
+					checkouts: @checkouts,
+					waits: @waits,
+					wait_time: @wait_time,
+					max_wait_time: @max_wait_time,
+					busy_time: busy,
+					utilization: uptime > 0 ? busy / uptime : 0.0
+				}
+			}
+		end
+
+		# Closes all the cookies. Threads waiting for a cookie raise LibmagicRb::FileClosedError.
+		def close
+			@mutex.synchronize {
+				return self if @closed
+
+				@closed = true
+				@cookies.each(&:close)
+				@affinity = ObjectSpace::WeakMap.new
+				@cond.broadcast
+			}
+
+			self
+		end
+
+		def closed?
+			@closed
+		end
+
+		private
+
+		def monotonic
+			Process.clock_gettime(Process::CLOCK_MONOTONIC)
+		end
+	end
+end
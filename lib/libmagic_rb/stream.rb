@@ -0,0 +1,125 @@
+# frozen_string_literal: true
+
+class LibmagicRb
+	# Checks data that arrives in chunks, like an upload, without holding all of it.
+	#
+	# Only a prefix of the stream is buffered, the first 8 KiB by default, which is enough
+	# for libmagic to tell common formats apart. The result is known as soon as the prefix
+	# is full, or the stream is finished, and the buffer is released then.
+	#
+	#	stream = LibmagicRb::Stream.new(bytes: 8192) { |mime| reject! unless mime.start_with?('image/') }
+	#
+	#	request.body.each { |chunk|
+	#		stream << chunk
+	#		break if stream.done?
+	#	}
+	#
+	#	stream.finish    # => "image/png; charset=binary"
+	#	stream.close
+	class Stream
+		# Bytes buffered by default
+		BYTES = 8192
+
+		attr_reader :bytes, :result
+
+		# [bytes] Bytes to buffer before checking, defaults to BYTES.
+		#         At most the MAGIC_PARAM_BYTES_MAX of the cookie, libmagic never looks past it.
+		# [cookie] A cookie to check with, it's not closed by the stream. Otherwise a cookie is opened with db and mode.
+		# [db] Database path, nil for the system database.
+		# [mode] Mode of the cookie, nil for the LibmagicRb.new() default.
+		#
+		# The block, if given, is called with the result once it's known.
+		def initialize(bytes: nil, cookie: nil, db: nil, mode: nil, &block)
+			@owned = !cookie
+			@cookie = cookie || LibmagicRb.new(file: ?., db: db, mode: mode)
+
+			# getparam() is nil on libmagic without parameters, that looked at the first MiB
+			max = defined?(MAGIC_PARAM_BYTES_MAX) && @cookie.getparam(MAGIC_PARAM_BYTES_MAX)
+			@bytes = [bytes || BYTES, max || 1 << 20].min
+			raise ArgumentError, 'Stream bytes must be at least 1' if @bytes < 1
+
+			# Grows as chunks arrive, a large prefix may never be filled
+			@buffer = String.new(capacity: [@bytes, BYTES].min, encoding: Encoding::BINARY)
+			@callback = block
+			@result = nil
+			@done = false
+			@closed = false
+		end
+
+		# Buffers the part of chunk that fits in the prefix, the rest is dropped.
+		# Checks as soon as the prefix is full.
+		#
+		# Returns the bytesize of chunk, so the stream can be written to like an IO.
+		# Raises LibmagicRb::FileClosedError once the stream is closed.
+		def write(chunk)
+			ensure_open
+			size = chunk.bytesize
+			return size if @done || size == 0
+
+			chunk = chunk.b unless chunk.encoding == Encoding::BINARY
+			room = @bytes - @buffer.bytesize
+			@buffer << (size > room ? chunk.byteslice(0, room) : chunk)
+
+			complete if @buffer.bytesize == @bytes
+			size
+		end
+
+		def <<(chunk)
+			write(chunk)
+			self
+		end
+
+		# Bytes buffered so far.
+		def size
+			@done ? @size : @buffer.bytesize
+		end
+
+		# True once the result is known.
+		def done?
+			@done
+		end
+
+		# Checks what's buffered so far, without ending the stream.
+		# Returns the result if it's already known.
+		def peek
+			ensure_open
+			@done ? @result : @cookie.magic_buffer(@buffer)
+		end
+
+		# Ends the stream, and checks what's buffered if the prefix isn't full.
+		# Returns String or nil.
+		def finish
+			ensure_open
+			complete unless @done
+			@result
+		end
+
+		# Closes the cookie, if the stream opened it.
+		# Writing to, peeking at or finishing the stream afterwards raises LibmagicRb::FileClosedError.
+		def close
+			@cookie.close if @owned && !@cookie.closed?
+			@buffer = nil
+			@closed = true
+			self
+		end
+
+		def closed?
+			@closed
+		end
+
+		private
+
+		def ensure_open
+			raise LibmagicRb::FileClosedError, 'Stream already closed' if @closed
+		end
+
+		def complete
+			@result = @cookie.magic_buffer(@buffer)
+			@size = @buffer.bytesize
+			@buffer = nil
+			@done = true
+
+			@callback&.call(@result)
+		end
+	end
+end
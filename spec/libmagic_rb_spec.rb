@@ -6,6 +6,91 @@ module Bullet
 	def self.get() @c.rotate![0] end
 end
 
+module Corpus
+	FILES = {
+		'text.txt' => "Hello world!\n" * 2048,
+		'script.rb' => "#!/usr/bin/env ruby\nputs 'hello'\n" * 128,
+		'doc.pdf' => "%PDF-1.4\n%\xE2\xE3\xCF\xD3\n" + "1 0 obj\n<< >>\nendobj\n" * 64,
+		'image.png' => "\x89PNG\r\n\x1a\n\x00\x00\x00\rIHDR\x00\x00\x00\x10\x00\x00\x00\x10\x08\x06\x00\x00\x00\x1f\xf3\xffa" + "\x00" * 64,
+		'data.json' => '{"a": [1, 2, 3], "b": {"c": "d"}}' * 256,
+		'page.html' => "<!DOCTYPE html>\n<html><body>#{'<p>hi</p>' * 512}</body></html>\n",
+	}.freeze
+
+	# A CDF (OLE2) container, like .doc and .xls files: the header, a FAT sector, and a directory with the root entry
+	CDF = begin
+		header = ['D0CF11E0A1B11AE1'].pack('H*') + "\0" * 16 + [0x3E, 3, 0xFFFE, 9, 6].pack('v5') + "\0" * 6 +
+			[0, 1, 1, 0, 0x1000, 0xFFFFFFFE, 0, 0xFFFFFFFE, 0, 0].pack('V10') + [0xFFFFFFFF].pack('V') * 108
+
+		fat = [0xFFFFFFFD, 0xFFFFFFFE].pack('V2') + [0xFFFFFFFF].pack('V') * 126
+		name = "Root Entry\0".encode('UTF-16LE').b
+
+		root = name.ljust(64, "\0") + [name.bytesize, 5, 1].pack('vCC') + [0xFFFFFFFF].pack('V') * 3 +
+			"\0" * 36 + [0xFFFFFFFE, 0, 0].pack('V3')
+
+		(header + fat + root + ("\0" * 68 + [0xFFFFFFFF].pack('V') * 3 + "\0" * 48) * 3).freeze
+	end
+
+	# Writes `copies` of each file in the corpus to dir, returns the paths
+	def self.generate(dir, copies = 1)
+		copies.times.flat_map { |i|
+			FILES.map { |name, content|
+				path = File.join(dir, "#{i}-#{name}")
+				File.binwrite(path, content)
+				path
+			}
+		}
+	end
+end
+
+# A minimal Fiber scheduler on IO.select, like the ones of the async gem
+class FiberScheduler
+	def initialize
+		@readable, @writable, @waiting, @ready = {}, {}, {}, []
+		@blocked = 0
+		@lock = Thread::Mutex.new
+		@urgent = IO.pipe
+	end
+
+	def run
+		until @readable.empty? && @writable.empty? && @waiting.empty? && @blocked.zero? && @ready.empty?
+			timeout = @waiting.values.min&.then { |x| [x - now, 0].max }
+			readable, writable = IO.select([*@readable.keys, @urgent[0]], @writable.keys, [], timeout)
+			@urgent[0].read_nonblock(64, exception: false) if readable&.delete(@urgent[0])
+
+			readable&.each { |io| @readable.delete(io)&.resume }
+			writable&.each { |io| @writable.delete(io)&.resume }
+			@waiting.select { |_, x| x <= now }.each_key { |fiber| @waiting.delete(fiber) ; fiber.resume }
+			@lock.synchronize { @ready.slice!(0..) }.each(&:resume)
+		end
+	end
+
+	def io_wait(io, events, timeout)
+		@readable[io] = Fiber.current if events & IO::READABLE != 0
+		@writable[io] = Fiber.current if events & IO::WRITABLE != 0
+		Fiber.yield
+		events
+	end
+
+	def block(blocker, timeout = nil)
+		@waiting[Fiber.current] = now + timeout if timeout
+		@blocked += 1
+		Fiber.yield
+	ensure
+		@blocked -= 1
+		@waiting.delete(Fiber.current)
+	end
+
+	def unblock(blocker, fiber)
+		@lock.synchronize { @ready << fiber }
+		@urgent[1].write('.')
+	end
+
+	def kernel_sleep(duration = nil) = block(:sleep, duration)
+	def fiber(&block) = Fiber.new(blocking: false, &block).tap(&:resume)
+	def close = run
+	def now = Process.clock_gettime(Process::CLOCK_MONOTONIC)
+end
+
 RSpec.describe LibmagicRb do
 	it "#{Bullet.get} has a version number" do
 		expect(LibmagicRb::VERSION).not_to be nil
@@ -23,6 +108,42 @@ RSpec.describe LibmagicRb do
 		expect(LibmagicRb.check(file: __FILE__)).to be == "text/x-ruby; charset=us-ascii"
 	end
 
+	it "#{Bullet.get} reuses loaded databases for LibmagicRb.check" do
+		LibmagicRb.cache_evict
+		before = LibmagicRb.cache_stats
+
+		3.times { expect(LibmagicRb.check(file: __FILE__)).to be == "text/x-ruby; charset=us-ascii" }
+		expect(LibmagicRb.check(file: __FILE__, mode: LibmagicRb::MAGIC_MIME_TYPE)).to be == "text/x-ruby"
+
+		stats = LibmagicRb.cache_stats
+		expect(stats[:misses] - before[:misses]).to be == 2
+		expect(stats[:hits] - before[:hits]).to be == 2
+		expect(stats[:size]).to be == 2
+		expect(stats[:in_use]).to be == 0
+
+		expect(LibmagicRb.cache_evict).to be == 2
+		expect(LibmagicRb.cache_stats[:size]).to be == 0
+	end
+
+	it "#{Bullet.get} keeps at most cache_capacity idle databases" do
+		capacity = LibmagicRb.cache_capacity
+		LibmagicRb.cache_capacity = 1
+
+		LibmagicRb.check(file: __FILE__)
+		LibmagicRb.check(file: __FILE__, mode: LibmagicRb::MAGIC_NONE)
+		expect(LibmagicRb.cache_stats[:size]).to be == 1
+
+		LibmagicRb.cache_capacity = 0
+		expect(LibmagicRb.cache_stats[:size]).to be == 0
+		expect(LibmagicRb.check(file: __FILE__)).to be == "text/x-ruby; charset=us-ascii"
+		expect(LibmagicRb.cache_stats[:size]).to be == 0
+		expect { LibmagicRb.cache_capacity = -1 }.to raise_error ArgumentError
+		expect { LibmagicRb.cache_capacity = -2**64 }.to raise_error ArgumentError
+		expect { LibmagicRb.cache_capacity = 2**64 }.to raise_error ArgumentError
+	ensure
+		LibmagicRb.cache_capacity = capacity
+	end
+
 	it "#{Bullet.get} can create and close multiple cookies with the LibmagicRb#new" do
 		a = LibmagicRb.new(file: Dir.pwd)
 		b = LibmagicRb.new(file: __FILE__)
@@ -102,6 +223,1074 @@ RSpec.describe LibmagicRb do
 		cookie.close
 	end
 
+	it "#{Bullet.get} can check binary strings and windows of them as magic buffer" do
+		cookie = LibmagicRb.new(file: ?.)
+
+		png = "\x89PNG\r\n\x1a\n\x00\x00\x00\rIHDR\x00\x00\x00\x01\x00\x00\x00\x01\x08\x06\x00\x00\x00".b
+		expect(cookie.magic_buffer(png)).to be == "image/png; charset=binary"
+
+		blob = ("\x00" * 100 + png + "\x00" * 100).b
+		expect(cookie.magic_buffer(blob, 100)).to be == "image/png; charset=binary"
+		expect(cookie.magic_buffer(blob, 100, png.bytesize)).to be == "image/png; charset=binary"
+		expect(cookie.magic_buffer(blob, -(png.bytesize + 100), png.bytesize)).to be == "image/png; charset=binary"
+		expect(cookie.magic_buffer(blob, 100, 1 << 20)).to be == "image/png; charset=binary"
+		expect(cookie.magic_buffer(blob, 0, 0)).to be == "application/x-empty; charset=binary"
+
+		expect { cookie.magic_buffer(blob, blob.bytesize + 1) }.to raise_error(IndexError)
+		expect { cookie.magic_buffer(blob, 0, -1) }.to raise_error(ArgumentError)
+		expect { cookie.magic_buffer(nil) }.to raise_error(ArgumentError)
+
+		cookie.close
+	end
+
+	# Database loading
+	it "#{Bullet.get} reloads the database only when the database file changes" do
+		require 'tmpdir'
+
+		Dir.mktmpdir do |dir|
+			db = File.join(dir, 'magic.mgc')
+			File.binwrite(db, File.binread('/usr/share/file/magic.mgc'))
+
+			cookie = LibmagicRb.new(file: Dir.pwd, db: db)
+			expect(cookie.check).to be == "inode/directory; charset=binary"
+			expect(cookie.check).to be == "inode/directory; charset=binary"
+
+			File.binwrite(db, 'not a magic database')
+			expect { cookie.check }.to raise_error LibmagicRb::InvalidDBError
+
+			cookie.db = nil
+			expect(cookie.check).to be == "inode/directory; charset=binary"
+			cookie.close
+		end
+	end if File.exist?('/usr/share/file/magic.mgc')
+
+	it "#{Bullet.get} can load the database explicitly" do
+		cookie = LibmagicRb.new(file: Dir.pwd)
+		expect(cookie.load(nil)).to be cookie
+		expect(cookie.db).to be nil
+		expect(cookie.check).to be == "inode/directory; charset=binary"
+		cookie.close
+	end
+
+	it "#{Bullet.get} loads databases from strings in memory" do
+		db = File.binread('/usr/share/file/magic.mgc').freeze
+		cookies = 2.times.map { LibmagicRb.new(file: __FILE__) }
+		plain = LibmagicRb.check(file: __FILE__, mode: cookies[0].mode)
+
+		cookies.each { |x| expect(x.load_buffers([db])).to be x }
+		GC.start
+		GC.compact if GC.respond_to?(:compact)
+
+		cookies.each { |x| expect(x.check).to be == plain }
+		expect(cookies[0].magic_buffer(Corpus::FILES['image.png'])).to be == "image/png; charset=binary"
+
+		# Misaligned bytes get a copy of their own
+		cookies[1].load_buffers([("x" + db).byteslice(1..)])
+		expect(cookies[1].check).to be == plain
+
+		expect { cookies[1].load_buffers(['not a magic database']) }.to raise_error LibmagicRb::InvalidDBError
+		expect { cookies[1].load_buffers([nil]) }.to raise_error ArgumentError
+
+		cookies[1].load(nil)
+		expect(cookies[1].check).to be == plain
+
+		cookies.each(&:close)
+	end if File.exist?('/usr/share/file/magic.mgc')
+
+	it "#{Bullet.get} shares a preloaded database with forked processes" do
+		# Preloading is process-wide, so it's done in a child, not to affect the other examples
+		reader, writer = IO.pipe
+
+		pid = fork {
+			reader.close
+			plain = LibmagicRb.check(file: __FILE__)
+
+			size = LibmagicRb.preload
+			mapped = File.basename(File.realpath('/usr/share/file/magic.mgc'))
+
+			workers = 3.times.map {
+				fork {
+					cookie = LibmagicRb.new(file: __FILE__)
+					result = [cookie.check, LibmagicRb.check(file: __FILE__)]
+
+					# Memory of the database map in this process, in kB
+					smaps = File.read('/proc/self/smaps').split(/^(?=\h+-\h+ )/)
+					map = smaps.find { |x| x.lines[0].include?(mapped) && x.lines[0].include?('r--s') }
+					mem = %w(Rss Pss Private_Dirty).map { |k| map[/^#{k}:\s+(\d+)/, 1].to_i }
+
+					writer.puts Marshal.dump([result, mem]).unpack1('H*')
+					sleep 0.2
+				}
+			}
+
+			workers.each { |x| Process.wait(x) }
+			writer.puts Marshal.dump([size, LibmagicRb.preloaded, plain]).unpack1('H*')
+		}
+
+		writer.close
+		lines = reader.read.lines.map { |x| Marshal.load([x.chomp].pack('H*')) }
+		Process.wait(pid)
+
+		size, preloaded, plain = lines.pop
+		expect(size).to be == File.size('/usr/share/file/magic.mgc')
+		expect(preloaded).to be == { nil => size }
+		expect(lines.size).to be == 3
+
+		lines.each { |result, (rss, pss, dirty)|
+			expect(result).to be == [plain, plain]
+
+			# The pages are shared with the parent and the other workers, and never copied
+			expect(dirty).to be == 0
+			expect(pss).to be < rss
+		}
+	end if File.exist?('/usr/share/file/magic.mgc') && File.exist?('/proc/self/smaps') && Process.respond_to?(:fork)
+
+	# Compiling databases
+	it "#{Bullet.get} compiles and caches databases of the MIME types wanted" do
+		require 'tmpdir'
+
+		Dir.mktmpdir do |dir|
+			source = File.join(dir, 'magic')
+			Dir.mkdir(source)
+
+			File.write(File.join(source, 'one'), <<~EOF)
+				# Named entries are kept for the rules using them
+				0	name	libmagic-rb-version
+				>0	byte	x	version %d
+
+				0	string	LIBRBONE	libmagic_rb one
+				!:mime	application/x-libmagic-rb-one
+				>8	use	libmagic-rb-version
+			EOF
+
+			File.write(File.join(source, 'two'), "0\tstring\tLIBRBTWO\tlibmagic_rb two\n!:mime\tapplication/x-libmagic-rb-two\n")
+			File.binwrite(one = File.join(dir, 'one.bin'), "LIBRBONE\x03")
+			File.binwrite(two = File.join(dir, 'two.bin'), 'LIBRBTWO')
+
+			cache = File.join(dir, 'cache')
+			db = LibmagicRb.compile(source, mime: %w(application/x-libmagic-rb-one), cache_dir: cache)
+
+			expect(File.dirname(db)).to be == cache
+			expect(LibmagicRb.check(file: one, db: db, mode: LibmagicRb::MAGIC_NONE)).to be == 'libmagic_rb one version 3'
+			expect(LibmagicRb.new(file: one, db: db).check).to be == 'application/x-libmagic-rb-one; charset=binary'
+			expect(LibmagicRb.check(file: two, db: db)).to be == 'text/plain; charset=us-ascii'
+
+			# Cached by content, compiled again once the sources change
+			mtime = File.mtime(db)
+			expect(LibmagicRb.compile(source, mime: %i(application/x-libmagic-rb-one), cache_dir: cache)).to be == db
+			expect(LibmagicRb.compile(source, mime: 'application/x-libmagic-rb-one', cache_dir: cache)).to be == db
+			expect(File.mtime(db)).to be == mtime
+
+			all = LibmagicRb.compile(source, cache_dir: cache)
+			expect(all).not_to be == db
+			expect(LibmagicRb.check(file: two, db: all)).to be == 'application/x-libmagic-rb-two; charset=us-ascii'
+			expect(Dir.children(cache).sort).to be == [db, all].map { |x| File.basename(x) }.sort
+
+			# The cookie writes where it's told, not to the current directory
+			cookie = LibmagicRb.new(file: ?.)
+			expect(cookie.magic_compile(File.join(source, 'two'), dir)).to be == File.join(dir, 'two.mgc')
+			expect(File.exist?('two.mgc')).to be false
+
+			File.write(File.join(dir, 'broken'), "0\tnot-a-type\tx\n")
+			expect { cookie.magic_compile(File.join(dir, 'broken'), dir) }.to raise_error LibmagicRb::InvalidDBError
+			expect(cookie.check).to be == 'inode/directory; charset=binary'
+			cookie.close
+
+			expect { LibmagicRb.compile(source, mime: %w(image/png), cache_dir: cache) }.to raise_error LibmagicRb::InvalidDBError
+		end
+	end if Process.respond_to?(:fork)
+
+	# Memory maps
+	it "#{Bullet.get} checks files through a memory map the same way" do
+		require 'tmpdir'
+
+		Dir.mktmpdir do |dir|
+			paths = Corpus.generate(dir)
+			File.binwrite(File.join(dir, 'empty'), '')
+			File.symlink(paths[0], File.join(dir, 'link'))
+			File.binwrite(File.join(dir, 'sheet.xls'), Corpus::CDF)
+			paths += [dir, File.join(dir, 'empty'), File.join(dir, 'link'), File.join(dir, 'sheet.xls'), RbConfig.ruby]
+
+			plain = LibmagicRb.new(file: ?.)
+			mapped = LibmagicRb.new(file: ?., mmap: true)
+			expect(plain.mmap?).to be false
+			expect(mapped.mmap?).to be true
+
+			[LibmagicRb::MAGIC_MIME | LibmagicRb::MAGIC_CHECK, LibmagicRb::MAGIC_MIME | LibmagicRb::MAGIC_SYMLINK, LibmagicRb::MAGIC_NONE].each { |mode|
+				plain.mode = mapped.mode = mode
+
+				paths.each { |path|
+					plain.file = mapped.file = path
+					expect(mapped.check).to be == plain.check
+				}
+			}
+
+			# Files bigger than the prefix libmagic looks at
+			plain.mode = mapped.mode = LibmagicRb::MAGIC_MIME
+			[plain, mapped].each { |x| x.setparam(LibmagicRb::MAGIC_PARAM_BYTES_MAX, 64) }
+			plain.file = mapped.file = paths[0]
+			expect(mapped.check).to be == plain.check
+
+			# libmagic reads the sectors of CDF files past the prefix
+			plain.file = mapped.file = File.join(dir, 'sheet.xls')
+			expect(plain.check).to be == "application/x-ole-storage; charset=binary"
+			expect(mapped.check).to be == plain.check
+
+			mapped.mmap = false
+			expect(mapped.mmap?).to be false
+
+			plain.close
+			mapped.close
+		end
+	end
+
+	# Open files
+	it "#{Bullet.get} can check open IOs and file descriptors" do
+		require 'tempfile'
+		cookie = LibmagicRb.new(file: ?.)
+
+		Tempfile.create(['libmagic_rb', '.png']) do |file|
+			# Buffered and not yet flushed
+			file.write(Corpus::FILES['image.png'])
+			expect(cookie.check_io(file)).to be == "image/png; charset=binary"
+			expect(file.pos).to be == Corpus::FILES['image.png'].bytesize
+
+			file.pos = 4
+			expect(cookie.check_fd(file.fileno)).to be == "image/png; charset=binary"
+			expect(file.pos).to be == 4
+
+			expect(cookie.check_io(file, false)).to be == "image/png; charset=binary"
+			expect(file.pos).to be == 0
+
+			File.unlink(file.path)
+			expect(cookie.check_io(file)).to be == "image/png; charset=binary"
+		end
+
+		IO.pipe do |r, w|
+			w.write(Corpus::FILES['doc.pdf'])
+			w.close
+			expect(cookie.check_io(r)).to be == cookie.magic_buffer(Corpus::FILES['doc.pdf'])
+		end
+
+		expect { cookie.check_io(File.open(__FILE__).tap(&:close)) }.to raise_error IOError
+		expect { cookie.check_fd(IO.sysopen(__FILE__).tap { |fd| IO.for_fd(fd).close }) }.to raise_error Errno::EBADF
+
+		cookie.close
+	end
+
+	# Result cache
+	it "#{Bullet.get} caches results by file identity" do
+		require 'tmpdir'
+
+		Dir.mktmpdir do |dir|
+			paths = Corpus.generate(dir)
+			cookie = LibmagicRb.new(file: paths[0], cache: 4)
+			expect(cookie.result_cache_capacity).to be == 4
+
+			expected = paths.map { |x| cookie.file = x ; cookie.check }
+			expect(paths.last(4).map { |x| cookie.file = x ; cookie.check }).to be == expected.last(4)
+
+			stats = cookie.result_cache_stats
+			expect(stats[:size]).to be == 4
+			expect(stats[:misses]).to be == paths.size
+			expect(stats[:hits]).to be == 4
+			expect(stats[:evictions]).to be == paths.size - 4
+
+			# A modified file is checked again
+			cookie.file = paths[0]
+			cookie.check
+			File.binwrite(paths[0], Corpus::FILES['image.png'])
+			File.utime(Time.now, Time.now + 10, paths[0])
+			expect(cookie.check).to be == "image/png; charset=binary"
+
+			# Modes are part of the key
+			mode = cookie.mode
+			cookie.mode = LibmagicRb::MAGIC_MIME_TYPE
+			expect(cookie.check).to be == "image/png"
+			cookie.mode = mode
+			hits = cookie.result_cache_stats[:hits]
+			expect(cookie.check).to be == "image/png; charset=binary"
+			expect(cookie.result_cache_stats[:hits]).to be == hits + 1
+
+			expect(cookie.invalidate(paths[0])).to be true
+			expect(cookie.invalidate(paths[0])).to be false
+			size = cookie.result_cache_stats[:size]
+			expect(cookie.invalidate).to be == size
+			expect(cookie.result_cache_stats[:size]).to be == 0
+
+			# Parameters change results, so setting one clears the cache
+			cookie.check
+			cookie.setparam(LibmagicRb::MAGIC_PARAM_BYTES_MAX, 1 << 20)
+			expect(cookie.result_cache_stats[:size]).to be == 0
+
+			cookie.result_cache_capacity = 0
+			cookie.check
+			expect(cookie.result_cache_stats).to be == { size: 0, capacity: 0, bytes: 0, max_bytes: 0, hits: 0, misses: 0, evictions: 0 }
+
+			expect { cookie.result_cache_capacity = -1 }.to raise_error ArgumentError
+			expect { LibmagicRb.new(file: paths[0], cache: -1) }.to raise_error ArgumentError
+			expect { cookie.result_cache_capacity = 2**64 }.to raise_error ArgumentError
+			expect { LibmagicRb.new(file: paths[0], cache: -2**64) }.to raise_error ArgumentError
+
+			cookie.close
+		end
+	end
+
+	it "#{Bullet.get} caches magic_buffer results by content" do
+		cookie = LibmagicRb.new(file: ?., buffer_cache: 4096)
+		expect(cookie.buffer_cache_bytes).to be == 4096
+
+		pdf, png = Corpus::FILES.values_at('doc.pdf', 'image.png')
+		expected = [pdf, png].map { |x| cookie.magic_buffer(x) }
+
+		3.times { expect([pdf, png].map { |x| cookie.magic_buffer(x) }).to be == expected }
+		expect(cookie.magic_buffer(pdf.dup)).to be == expected[0]
+
+		stats = cookie.buffer_cache_stats
+		expect(stats[:size]).to be == 2
+		expect(stats[:misses]).to be == 2
+		expect(stats[:hits]).to be == 7
+		expect(stats[:bytes]).to be_between(1, 4096)
+
+		# Windows of the same bytes are different content
+		expect(cookie.magic_buffer(pdf, 0, 4)).to be == cookie.magic_buffer(pdf.byteslice(0, 4))
+		expect(cookie.buffer_cache_stats[:hits]).to be == 8
+
+		# Modes are part of the key
+		mode = cookie.mode
+		cookie.mode = LibmagicRb::MAGIC_MIME_TYPE
+		expect(cookie.magic_buffer(png)).to be == 'image/png'
+		cookie.mode = mode
+
+		# Memory is bounded, least recently used results go first
+		cookie.buffer_cache_bytes = 256
+		200.times { |i| cookie.magic_buffer("#{i} " * 8) }
+		stats = cookie.buffer_cache_stats
+		expect(stats[:bytes]).to be <= 256
+		expect(stats[:evictions]).to be > 0
+
+		expect(cookie.invalidate).to be == stats[:size]
+		cookie.buffer_cache_bytes = 0
+		cookie.magic_buffer(pdf)
+		expect(cookie.buffer_cache_stats[:size]).to be == 0
+
+		expect { cookie.buffer_cache_bytes = -1 }.to raise_error ArgumentError
+		expect { LibmagicRb.new(file: ?., buffer_cache: -1) }.to raise_error ArgumentError
+		expect { cookie.buffer_cache_bytes = 2**64 }.to raise_error ArgumentError
+		expect { LibmagicRb.new(file: ?., buffer_cache: -2**64) }.to raise_error ArgumentError
+
+		cookie.close
+	end
+
+	# All results
+	it "#{Bullet.get} checks all results of a file at once" do
+		require 'tmpdir'
+
+		Dir.mktmpdir do |dir|
+			paths = Corpus.generate(dir) + [dir, RbConfig.ruby]
+			cookie = LibmagicRb.new(file: ?.)
+			mode = cookie.mode
+
+			paths.each do |path|
+				cookie.file = path
+				result = cookie.check_all
+				expect(result).to be_a LibmagicRb::Result
+				expect(cookie.mode).to be == mode
+
+				expected = [
+					LibmagicRb::MAGIC_MIME_TYPE, LibmagicRb::MAGIC_MIME_ENCODING, LibmagicRb::MAGIC_NONE
+				].map { |x| cookie.mode = x ; cookie.check }
+
+				expect([result.mime_type, result.encoding, result.description]).to be == expected
+				cookie.mode = mode
+			end
+
+			cookie.file = paths[Corpus::FILES.keys.index('image.png')]
+			expect(cookie.detect.mime_type).to be == 'image/png'
+			expect(cookie.detect.extensions).to be == %w(png) if defined?(LibmagicRb::MAGIC_EXTENSION)
+
+			# Traps interrupt the passes, which carry on after them
+			previous = trap('USR1') { }
+			signals = Thread.new { 50.times { Process.kill('USR1', Process.pid) ; sleep 0.002 } }
+			results = 500.times.map { cookie.check_all }
+			signals.join
+			trap('USR1', previous)
+
+			expect(results.uniq).to be == [cookie.check_all]
+
+			cookie.file = "#{dir}/missing"
+			expect { cookie.check_all }.to raise_error LibmagicRb::FileNotFound
+
+			cookie.close
+		end
+	end
+
+	# Interned results
+	it "#{Bullet.get} returns interned frozen results" do
+		cookie = LibmagicRb.new(file: __FILE__, intern: true)
+		expect(cookie.intern?).to be true
+
+		result = cookie.check
+		expect(result).to be == 'text/x-ruby; charset=us-ascii'
+		expect(result.frozen?).to be true
+		expect(result.encoding).to be == Encoding::US_ASCII
+		expect(cookie.check).to equal result
+		expect(cookie.check_many([__FILE__])[0]).to equal result
+		expect(LibmagicRb.check(file: __FILE__, intern: true)).to equal result
+
+		pdf = Corpus::FILES['doc.pdf'].dup.freeze
+		expect(cookie.magic_buffer(pdf)).to equal cookie.magic_buffer(pdf.dup)
+
+		# Nothing is allocated for a result seen before, with a frozen buffer
+		before = GC.stat(:total_allocated_objects)
+		100.times { cookie.magic_buffer(pdf) }
+		expect(GC.stat(:total_allocated_objects) - before).to be < 10
+
+		cookie.intern = false
+		expect(cookie.check).not_to equal cookie.check
+		expect(cookie.check.frozen?).to be false
+
+		cookie.close
+	end
+
+	it "#{Bullet.get} returns MIME types as Symbols" do
+		require 'tmpdir'
+
+		Dir.mktmpdir do |dir|
+			paths = Corpus.generate(dir) + [dir]
+			cookie = LibmagicRb.new(file: ?., mode: LibmagicRb::MAGIC_NONE)
+
+			paths.each do |path|
+				cookie.file = path
+				pair = cookie.check_mime
+				expect(pair.frozen?).to be true
+				expect(cookie.mode).to be == LibmagicRb::MAGIC_NONE
+
+				cookie.mode = LibmagicRb::MAGIC_MIME
+				expect(pair.join('; charset=')).to be == cookie.check
+				cookie.mode = LibmagicRb::MAGIC_NONE
+
+				expect(cookie.check_mime).to equal pair
+			end
+
+			png = Corpus::FILES['image.png']
+			expect(cookie.buffer_mime(png)).to be == [:'image/png', :binary]
+			expect(cookie.buffer_mime(png)).to equal cookie.buffer_mime(png.dup)
+			expect { cookie.buffer_mime(nil) }.to raise_error ArgumentError
+
+			cookie.close
+		end
+	end
+
+	# Stats
+	it "#{Bullet.get} counts and times what cookies do" do
+		before = LibmagicRb.stats
+		cookie = LibmagicRb.new(file: __FILE__)
+
+		2.times { cookie.check }
+		cookie.magic_buffer(Corpus::FILES['doc.pdf'])
+		cookie.check_many([__FILE__, Dir.pwd])
+
+		cookie.file = "invalidFileName-#{Time.now.to_f}"
+		expect { cookie.check }.to raise_error LibmagicRb::FileNotFound
+
+		stats = cookie.stats
+		expect(stats.values_at(:calls, :errors, :loads, :checks)).to be == [5, 1, 1, 5]
+		expect(stats[:bytes]).to be == Corpus::FILES['doc.pdf'].bytesize
+		expect(stats[:lock][:count]).to be == 5
+		expect(stats[:load][:count]).to be == 1
+		expect(stats[:validate][:count]).to be == 3
+		expect(stats[:check][:count]).to be == 4
+
+		stats.values_at(:lock, :load, :validate, :check).each { |phase|
+			expect(phase[:total_ns]).to be >= phase[:max_ns]
+			expect(phase[:max_ns]).to be > 0
+		}
+
+		# The process stats count every cookie
+		after = LibmagicRb.stats
+		%i(calls errors loads checks bytes).each { |x| expect(after[x] - before[x]).to be >= stats[x] }
+		expect(after[:check][:total_ns] - before[:check][:total_ns]).to be >= stats[:check][:total_ns]
+
+		cookie.reset_stats
+		expect(cookie.stats[:calls]).to be == 0
+		expect(cookie.stats[:check]).to be == { count: 0, total_ns: 0, max_ns: 0 }
+
+		LibmagicRb.reset_stats
+		LibmagicRb.check(file: __FILE__)
+		expect(LibmagicRb.stats.values_at(:calls, :checks)).to be == [1, 1]
+
+		cookie.close
+		expect(cookie.stats[:calls]).to be == 1
+	end
+
+	# Fast path
+	it "#{Bullet.get} answers common formats like libmagic does" do
+		random = Random.new(42)
+
+		heads = [
+			Corpus::FILES['image.png'], "\xFF\xD8\xFF\xE0\x00\x10JFIF\x00", "\xFF\xD8\xFF\xDB\x00\x43",
+			Corpus::FILES['doc.pdf'], '%PDF-', "\x1F\x8B\x08\x00", "PK\x03\x04\x14\x00",
+			*%w(isom iso2 mp41 mp42 avc1 dash M4A\  qt\ \  heic).map { |x| [random.rand(1 << 32)].pack('N') + "ftyp#{x}" }
+		].map(&:b)
+
+		# Each head with random bytes and text after it, cut at random lengths
+		corpus = heads.flat_map { |head|
+			[head, head.byteslice(0, 3)] + 8.times.map { |i|
+				data = head + (i.even? ? random.bytes(random.rand(1..512)) : 'x = 1 ' * random.rand(1..64))
+				data.byteslice(0, random.rand(1..data.bytesize))
+			}
+		} + Corpus::FILES.values
+
+		slow = LibmagicRb.new(file: __FILE__)
+		fast = LibmagicRb.new(file: __FILE__, fast_path: true)
+		expect(fast.fast_path?).to be true
+
+		Dir.mktmpdir do |dir|
+			[LibmagicRb::MAGIC_MIME | LibmagicRb::MAGIC_CHECK, LibmagicRb::MAGIC_MIME_TYPE, LibmagicRb::MAGIC_NONE].each { |mode|
+				slow.mode = fast.mode = mode
+
+				corpus.each_with_index { |data, i|
+					expect(fast.magic_buffer(data)).to be == slow.magic_buffer(data)
+
+					slow.file = fast.file = File.join(dir, i.to_s).tap { |x| File.binwrite(x, data) }
+					expect(fast.check).to be == slow.check
+				}
+			}
+		end
+
+		# Everything else went through libmagic
+		expect(fast.stats[:fast_path]).to be > corpus.size
+		expect(fast.stats[:fast_path]).to be < fast.stats[:checks] / 2
+		expect(slow.stats[:fast_path]).to be == 0
+
+		[slow, fast].each(&:close)
+	end
+
+	# Fiber scheduler
+	it "#{Bullet.get} lets other fibers run under a Fiber scheduler" do
+		events = []
+		cookie = LibmagicRb.new(file: __FILE__)
+		expected = cookie.check
+
+		thread = Thread.new {
+			Fiber.set_scheduler(FiberScheduler.new)
+
+			# Both share the cookie, the second waits for its lock
+			2.times { |i|
+				Fiber.schedule {
+					events << :"check#{i}"
+					events << cookie.check
+					events << cookie.magic_buffer(Corpus::FILES['image.png'])
+				}
+			}
+
+			Fiber.schedule { events << :other }
+			Fiber.schedule { events << LibmagicRb.check(file: __FILE__) << cookie.check_many([__FILE__]) }
+		}
+
+		expect(thread.join(10)).not_to be_nil
+		expect(events.first(3)).to be == %i(check0 check1 other)
+
+		png = "image/png; charset=binary"
+		expect(events.drop(3).sort_by(&:to_s)).to be == [[expected], expected, expected, expected, png, png].sort_by(&:to_s)
+
+		cookie.close
+	end if Fiber.respond_to?(:set_scheduler)
+
+	it "#{Bullet.get} runs the calls of many fibers on a bounded pool of threads" do
+		require 'etc'
+
+		expected = LibmagicRb.check(file: __FILE__)
+		tasks = -> { Dir.children('/proc/self/task').size }
+		before = tasks.()
+		results, most = [], 0
+
+		thread = Thread.new {
+			Fiber.set_scheduler(FiberScheduler.new)
+
+			# More than the queue holds, the rest run on this thread
+			300.times {
+				Fiber.schedule {
+					results << LibmagicRb.check(file: __FILE__)
+					most = [most, tasks.()].max
+				}
+			}
+		}
+
+		expect(thread.join(30)).not_to be_nil
+		expect(results).to be == [expected] * 300
+
+		# The thread of the scheduler, and the pool
+		expect(most - before).to be <= 1 + Etc.nprocessors * 2
+	end if Fiber.respond_to?(:set_scheduler) && File.directory?('/proc/self/task')
+
+	# Deadlines
+	it "#{Bullet.get} gives up on checks past their timeout, and keeps the cookie usable" do
+		require 'timeout'
+		require 'tmpdir'
+
+		Dir.mktmpdir do |dir|
+			# Backtracks for a while over a run of a's without the b
+			File.write(File.join(dir, 'slow'), "0\tregex/100000\t(a*)(a*)(a*)\\\\3\\\\2\\\\1b\tslow regex\n")
+			db = LibmagicRb.new(file: dir).then { |x| x.magic_compile(File.join(dir, 'slow'), dir).tap { x.close } }
+
+			slow = File.join(dir, 'slow.txt').tap { |x| File.write(x, 'a' * 40) }
+			fast = File.join(dir, 'fast.txt').tap { |x| File.write(x, 'ab') }
+
+			cookie = LibmagicRb.new(file: fast, db: db, mode: LibmagicRb::MAGIC_NONE)
+			expected = cookie.check
+			buffer = cookie.magic_buffer('ab')
+			expect(cookie.check(timeout: 5)).to be == expected
+			expect(cookie.magic_buffer('ab', timeout: 5)).to be == buffer
+
+			cookie.file = slow
+			started = Process.clock_gettime(Process::CLOCK_MONOTONIC)
+			expect { cookie.check(timeout: 0.05) }.to raise_error LibmagicRb::TimeoutError
+			expect { cookie.magic_buffer('a' * 40, timeout: 0.05) }.to raise_error LibmagicRb::TimeoutError
+			expect { Timeout.timeout(0.05) { cookie.check(timeout: 10) } }.to raise_error Timeout::Error
+			expect(Process.clock_gettime(Process::CLOCK_MONOTONIC) - started).to be < 1
+
+			# A fresh magic_t, with the database loaded again
+			cookie.file = fast
+			expect(cookie.check).to be == expected
+			expect(cookie.magic_buffer('ab', timeout: 5)).to be == buffer
+			expect(cookie.stats[:timeouts]).to be == 2
+
+			expect { cookie.check(timeout: 0) }.to raise_error ArgumentError
+			expect { cookie.check(timeout: '1') }.to raise_error ArgumentError
+			expect { cookie.check(timeout: Float::INFINITY) }.to raise_error ArgumentError
+			expect { cookie.check(timeout: Float::NAN) }.to raise_error ArgumentError
+			expect(cookie.check(timeout: 1e30)).to be == expected
+
+			cookie.close
+		end
+	end
+
+	it "#{Bullet.get} raises right away while too many checks past their timeout still run" do
+		require 'tmpdir'
+
+		Dir.mktmpdir do |dir|
+			File.write(File.join(dir, 'slow'), "0\tregex/100000\t(a*)(a*)(a*)\\\\3\\\\2\\\\1b\tslow regex\n")
+			db = LibmagicRb.new(file: dir).then { |x| x.magic_compile(File.join(dir, 'slow'), dir).tap { x.close } }
+
+			slow = File.join(dir, 'slow.txt').tap { |x| File.write(x, 'a' * 30) }
+			fast = File.join(dir, 'fast.txt').tap { |x| File.write(x, 'ab') }
+
+			cookie = LibmagicRb.new(file: fast, db: db, mode: LibmagicRb::MAGIC_NONE)
+			expected = cookie.check
+			cookie.file = slow
+
+			errors = 24.times.map do
+				cookie.check(timeout: 0.01)
+			rescue LibmagicRb::TimeoutError => e
+				e.message
+			end
+
+			expect(errors.grep(String).size).to be == 24
+			expect(errors.grep(/still running/)).not_to be_empty
+			expect(cookie.stats[:timeouts]).to be <= 16
+
+			cookie.file = fast
+
+			# A forked child has none of their threads
+			if Process.respond_to?(:fork)
+				pid = fork { exit!((cookie.check(timeout: 5) == expected rescue false) ? 0 : 1) }
+				expect(Process.wait2(pid)[1].exitstatus).to be == 0
+			end
+
+			# Usable again once they're done
+			deadline = Process.clock_gettime(Process::CLOCK_MONOTONIC) + 60
+
+			result = begin
+				cookie.check(timeout: 5)
+			rescue LibmagicRb::TimeoutError
+				sleep 0.05
+				retry if Process.clock_gettime(Process::CLOCK_MONOTONIC) < deadline
+			end
+
+			expect(result).to be == expected
+			cookie.close
+		end
+	end
+
+	# Tracing
+	it "#{Bullet.get} traces sampled calls" do
+		traces = []
+		cookie = LibmagicRb.new(file: __FILE__)
+
+		begin
+			LibmagicRb.trace { |trace| traces << trace }
+
+			cookie.check
+			cookie.magic_buffer(Corpus::FILES['doc.pdf'])
+			LibmagicRb.check(file: __FILE__)
+
+			cookie.file = "invalidFileName-#{Time.now.to_f}"
+			expect { cookie.check }.to raise_error LibmagicRb::FileNotFound
+
+			expect(traces.map(&:name)).to be == %i(check magic_buffer check check)
+			expect(traces.map(&:path)).to be == [__FILE__, nil, __FILE__, cookie.file]
+
+			expect(traces[0].phases.keys).to include(:lock, :validate, :check)
+			expect(traces[1].phases.keys).to be == %i(lock check)
+			traces.each { |x| expect(x.total_ns).to be >= x.phases.values.sum }
+
+			expect(traces[3].phases).not_to include(:check)
+			expect(traces[3].error).to be_a LibmagicRb::FileNotFound
+			expect(traces[0].error).to be_nil
+
+			# One call in 4
+			traces.clear
+			cookie.file = __FILE__
+			LibmagicRb.trace(sample: 0.25) { |trace| traces << trace }
+			8.times { cookie.check }
+			expect(traces.size).to be == 2
+
+			expect { LibmagicRb.trace(sample: 0) {} }.to raise_error ArgumentError
+			expect { LibmagicRb.trace }.to raise_error ArgumentError
+		ensure
+			LibmagicRb.untrace
+		end
+
+		traces.clear
+		cookie.check
+		expect(traces).to be_empty
+
+		cookie.close
+	end
+
+	it "#{Bullet.get} traces the calls of each fiber under a Fiber scheduler" do
+		require 'tmpdir'
+
+		Dir.mktmpdir do |dir|
+			paths = Corpus.generate(dir)
+			traces = Hash.new { |h, k| h[k] = [] }
+
+			thread = Thread.new {
+				LibmagicRb.trace(sample: 0.5) { |trace| traces[Fiber.current] << trace }
+				Fiber.set_scheduler(FiberScheduler.new)
+
+				# Calls of the fibers interleave, and finish in any order
+				paths.each { |path|
+					Fiber.schedule {
+						cookie = LibmagicRb.new(file: path)
+						6.times { cookie.check }
+						cookie.close
+					}
+				}
+			}
+
+			expect(thread.join(10)).not_to be_nil
+
+			# One call in 2, of the checks and closes of every fiber
+			expect(traces.values.sum(&:size)).to be == paths.size * 7 / 2
+
+			checks = traces.values.map { |x| x.select { |trace| trace.name == :check } }
+			expect(checks.map { |x| x.map(&:path).uniq }.sort).to be == paths.sort.map { |x| [x] }
+			checks.flatten.each { |trace| expect(trace.phases.keys).to include(:lock, :validate, :check) }
+		end
+	end if Fiber.respond_to?(:set_scheduler)
+
+	# Batches
+	it "#{Bullet.get} can check many files at once" do
+		cookie = LibmagicRb.new(file: ?.)
+		missing = "invalidFileName-#{Time.now.to_f}.mp3"
+
+		results = cookie.check_many([Dir.pwd, __FILE__, missing])
+		expect(results[0]).to be == "inode/directory; charset=binary"
+		expect(results[1]).to be == "text/x-ruby; charset=us-ascii"
+		expect(results[2]).to be_a LibmagicRb::FileNotFound
+		expect(results[2].message).to be == missing
+
+		expect(cookie.check_many([])).to be == []
+		expect { cookie.check_many([1]) }.to raise_error ArgumentError
+
+		# Traps interrupt the batch, which carries on after them
+		trapped = 0
+		previous = trap('USR1') { trapped += 1 }
+		signals = Thread.new { 20.times { Process.kill('USR1', Process.pid) ; sleep 0.01 } }
+		results = cookie.check_many([__FILE__] * 20000)
+		signals.join
+		trap('USR1', previous)
+
+		expect(trapped).to be > 0
+		expect(results.uniq).to be == ["text/x-ruby; charset=us-ascii"]
+
+		cookie.close
+		expect { cookie.check_many([__FILE__]) }.to raise_error LibmagicRb::FileClosedError
+	end
+
+	it "#{Bullet.get} yields results of many files in chunks" do
+		require 'tmpdir'
+
+		Dir.mktmpdir do |dir|
+			paths = Corpus.generate(dir, 50)
+			cookie = LibmagicRb.new(file: ?.)
+			expected = cookie.check_many(paths)
+
+			yielded = []
+			expect(cookie.check_many(paths) { |path, mime|
+				# The cookie isn't locked while yielding
+				cookie.file = path
+				expect(cookie.check).to be == mime
+
+				yielded << [path, mime]
+			}).to be cookie
+
+			expect(yielded).to be == paths.zip(expected)
+			cookie.close
+		end
+	end
+
+	# Scanner
+	it "#{Bullet.get} scans a directory tree with worker threads" do
+		require 'tmpdir'
+
+		Dir.mktmpdir do |dir|
+			Dir.mkdir(File.join(dir, 'sub'))
+			Dir.mkdir(File.join(dir, 'sub', 'empty'))
+
+			sub = Corpus.generate(File.join(dir, 'sub'), 2)
+			paths = Corpus.generate(dir, 3) + sub
+
+			File.symlink(dir, File.join(dir, 'sub', 'loop'))
+			File.symlink(File.join(dir, 'sub'), File.join(dir, 'link'))
+
+			mode = LibmagicRb::MAGIC_MIME | LibmagicRb::MAGIC_CHECK
+			expected = paths.to_h { |x| [x, LibmagicRb.check(file: x, mode: mode)] }
+
+			results = LibmagicRb.scan(dir, threads: 3)
+			expect(results.size).to be == expected.size + 2
+			expect(results.reject { |k, _| k.end_with?('loop', 'link') }).to be == expected
+			expect(results[File.join(dir, 'sub', 'loop')]).to be == "inode/symlink; charset=binary"
+
+			# Following symlinks walks the linked directory, and skips loops
+			followed = LibmagicRb.scan(dir, threads: 2, follow_symlinks: true)
+			expect(followed.size).to be == expected.size + sub.size
+			expect(followed[File.join(dir, 'link', File.basename(sub[0]))]).to be == expected[sub[0]]
+
+			yielded = {}
+			expect(LibmagicRb.scan(dir, threads: 2) { |path, mime| yielded[path] = mime }).to be == results.size
+			expect(yielded).to be == results
+
+			# Breaking out stops the workers
+			count = 0
+			LibmagicRb.scan(dir, threads: 2) { break if (count += 1) == 2 }
+			expect(count).to be == 2
+
+			expect(LibmagicRb.scan(paths[0], threads: 1)).to be == { paths[0] => expected[paths[0]] }
+			expect { LibmagicRb.scan(dir, threads: 10**6) }.to raise_error ArgumentError
+
+			db = File.join(dir, 'invalid.mgc')
+			File.binwrite(db, 'not a magic database')
+			expect { LibmagicRb.scan(dir, db: db) }.to raise_error LibmagicRb::InvalidDBError
+		end
+
+		expect { LibmagicRb.scan("invalidDir-#{Time.now.to_f}") }.to raise_error LibmagicRb::FileNotFound
+	end
+
+	# Threads
+	it "#{Bullet.get} can share a cookie between threads" do
+		require 'tmpdir'
+
+		Dir.mktmpdir do |dir|
+			buffers = Corpus.generate(dir).map { |x| File.binread(x) }
+
+			cookie = LibmagicRb.new(file: ?.)
+			expected = buffers.map { |x| cookie.magic_buffer(x) }
+
+			results = 4.times.map {
+				Thread.new {
+					20.times.map { buffers.map { |x| cookie.magic_buffer(x) } }
+				}
+			}.map(&:value)
+
+			cookie.close
+
+			results.each { |t| t.each { |x| expect(x).to be == expected } }
+		end
+	end
+
+	it "#{Bullet.get} classifies files in parallel threads" do
+		require 'tmpdir'
+
+		Dir.mktmpdir do |dir|
+			paths = Corpus.generate(dir, 2)
+			cookies = 4.times.map { LibmagicRb.new(file: ?.) }
+			expected = paths.map { |x| LibmagicRb.check(file: x) }
+
+			results = cookies.map { |c|
+				Thread.new { 3.times.map { paths.map { |x| c.file = x ; c.check } } }
+			}.map(&:value)
+
+			expect(results.flatten(1)).to be == [expected] * 12
+			cookies.each(&:close)
+
+			# Other threads run while libmagic backtracks, the GVL is released
+			File.write(File.join(dir, 'slow'), "0\tregex/100000\t(a*)(a*)(a*)\\\\3\\\\2\\\\1b\tslow regex\n")
+			db = LibmagicRb.new(file: dir).then { |x| x.magic_compile(File.join(dir, 'slow'), dir).tap { x.close } }
+			slow = File.join(dir, 'slow.txt').tap { |x| File.write(x, 'a' * 30) }
+
+			cookie = LibmagicRb.new(file: slow, db: db, mode: LibmagicRb::MAGIC_NONE)
+			cookie.magic_buffer('ab')
+
+			ticks, done = 0, false
+			ticker = Thread.new { until done ; ticks += 1 ; Thread.pass ; end }
+
+			Thread.pass until ticks > 0
+			before = ticks
+			cookie.check
+			during = ticks - before
+
+			done = true
+			ticker.join
+			cookie.close
+
+			expect(during).to be > 0
+		end
+	end
+
+	# Pool
+	it "#{Bullet.get} hands out pooled cookies to threads" do
+		pool = LibmagicRb::Pool.new(size: 2)
+
+		results = 4.times.map {
+			Thread.new { 10.times.map { pool.check(__FILE__) } }
+		}.flat_map(&:value)
+
+		expect(results.uniq).to be == ["text/x-ruby; charset=us-ascii"]
+
+		stats = pool.stats
+		expect(stats[:checkouts]).to be == 40
+		expect(stats[:in_use]).to be == 0
+		expect(stats[:available]).to be == 2
+		expect(stats[:peak_in_use]).to be <= 2
+		expect(stats[:utilization]).to be_between(0, 1)
+
+		pool.close
+		expect(pool.closed?).to be true
+		expect { pool.checkout }.to raise_error LibmagicRb::FileClosedError
+	end
+
+	it "#{Bullet.get} prefers the pooled cookie a thread last used" do
+		pool = LibmagicRb::Pool.new(size: 2)
+
+		a = pool.checkout
+		other = Thread.new { pool.checkout.tap { |b| Thread.stop ; pool.checkin(b) } }
+		Thread.pass until other.stop?
+
+		pool.checkin(a)
+		other.wakeup
+		b = other.value
+
+		# b was checked in last, a is still this thread's
+		expect(b).not_to be a
+		expect(pool.with { |x| x }).to be a
+		expect(Thread.current.thread_variables.grep(/libmagic/)).to be_empty
+
+		pool.close
+	end
+
+	it "#{Bullet.get} gives a thread the same pooled cookie when nested" do
+		pool = LibmagicRb::Pool.new(size: 1)
+
+		pool.with { |a|
+			pool.with { |b| expect(b).to be a }
+			expect(pool.stats[:in_use]).to be == 1
+			waiter = Thread.new { pool.checkout(0.01) rescue $! }
+			expect(waiter.value).to be_a LibmagicRb::Pool::TimeoutError
+		}
+
+		expect(pool.stats[:in_use]).to be == 0
+		expect(pool.stats[:waits]).to be == 0
+		pool.close
+	end
+
+	# Ractors
+	it "#{Bullet.get} classifies a corpus across Ractors" do
+		require 'tmpdir'
+
+		experimental, Warning[:experimental] = Warning[:experimental], false
+
+		Dir.mktmpdir do |dir|
+			paths = Corpus.generate(dir, 4)
+			config = Ractor.make_shareable({ mode: LibmagicRb::MAGIC_MIME_TYPE, intern: true })
+
+			cookie = LibmagicRb.new(file: ?., **config)
+			expected = cookie.check_many(paths)
+			cookie.close
+
+			ractors = paths.each_slice(6).map { |slice|
+				Ractor.new(slice, config) { |x, c|
+					local = LibmagicRb.local(**c)
+
+					# The same cookie for the same options, and the database cache of LibmagicRb.check()
+					[local.check_many(x), LibmagicRb.local(**c).equal?(local),
+						x.map { |y| LibmagicRb.check(file: y, mode: c[:mode]) }]
+				}
+			}
+
+			results = ractors.map(&:take)
+			expect(results.flat_map(&:first)).to be == expected
+			expect(results.map { |x| x[1] }.uniq).to be == [true]
+			expect(results.flat_map(&:last)).to be == expected
+		end
+	ensure
+		Warning[:experimental] = experimental
+	end if defined?(Ractor)
+
+	# Streams
+	it "#{Bullet.get} checks a stream of chunks from a bounded prefix" do
+		png = Corpus::FILES['image.png'].b
+		body = png + "\x00".b * 10_000
+		cookie = LibmagicRb.new(file: ?.)
+
+		called = []
+		stream = LibmagicRb::Stream.new(bytes: 64, cookie: cookie) { |mime| called << mime }
+
+		expect(stream.write(png.byteslice(0, 8))).to be == 8
+		expect(stream.done?).to be false
+		expect(stream.peek).to be == cookie.magic_buffer(png, 0, 8)
+
+		body.byteslice(8..).each_char.each_slice(100).map(&:join).each { |chunk| stream << chunk }
+		expect(stream.done?).to be true
+		expect(stream.size).to be == 64
+		expect(stream.result).to be == "image/png; charset=binary"
+		expect(stream.finish).to be == stream.result
+		expect(called).to be == [stream.result]
+
+		# Shorter than the prefix, checked on finish
+		short = LibmagicRb::Stream.new(cookie: cookie)
+		expect(short.bytes).to be == LibmagicRb::Stream::BYTES
+		short << Corpus::FILES['doc.pdf']
+		expect(short.done?).to be false
+		expect(short.finish).to be == cookie.magic_buffer(Corpus::FILES['doc.pdf'])
+
+		# The default prefix is done after a few KiB
+		text = LibmagicRb::Stream.new(cookie: cookie) << Corpus::FILES['text.txt']
+		expect(text.done?).to be true
+		expect(text.result).to be == cookie.magic_buffer(Corpus::FILES['text.txt'], 0, LibmagicRb::Stream::BYTES)
+
+		max = cookie.getparam(LibmagicRb::MAGIC_PARAM_BYTES_MAX)
+		expect(LibmagicRb::Stream.new(bytes: 1 << 40, cookie: cookie).bytes).to be == max
+		expect { LibmagicRb::Stream.new(bytes: 0, cookie: cookie) }.to raise_error ArgumentError
+
+		short.close
+		expect(cookie.closed?).to be false
+		expect(short.closed?).to be true
+
+		# Closed streams raise, whether they were finished or not
+		[short, LibmagicRb::Stream.new(cookie: cookie).close].each { |x|
+			expect { x << 'a' }.to raise_error LibmagicRb::FileClosedError
+			expect { x.write('a') }.to raise_error LibmagicRb::FileClosedError
+			expect { x.peek }.to raise_error LibmagicRb::FileClosedError
+			expect { x.finish }.to raise_error LibmagicRb::FileClosedError
+		}
+
+		cookie.close
+	end
+
 	# Errors
 	it "#{Bullet.get} raises error on invalid filename" do
 		cookie = LibmagicRb.new(file: "invalidFileName-#{Time.now.to_f}.mp3")